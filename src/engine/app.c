@@ -9,6 +9,8 @@
 #include "controls.h"
 #include "graphics.h"
 #include "assets.h"
+#include "kernels.h"
+#include "workers.h"
 
 #include "stdlib.h"
 #include "math.h"
@@ -149,6 +151,19 @@ static int app_init(SCENE* arrScenes, int count, const char* assPath)
         return 1;
     }
 
+    // Pick the kernels for this CPU
+    kr_init(config.kernels);
+    if(config.verbose)
+        printf("Using %s kernels\n",kr_get_name());
+
+    // Start worker threads
+    if(wk_init(config.threads) == 1)
+    {
+        return 1;
+    }
+    if(config.verbose)
+        printf("Using %d threads\n",wk_get_thread_count());
+
     // Set global renderer & init graphics
     init_graphics();
     set_global_renderer(rend);
@@ -376,6 +391,8 @@ static void app_destroy()
     SDL_DestroyWindow(window);
 
     SDL_JoystickClose(joy);
+
+    wk_destroy();
 }
 
 
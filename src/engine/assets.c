@@ -12,6 +12,7 @@
 
 #include "bitmap.h"
 #include "mesh.h"
+#include "textcache.h"
 
 /// Asset type enum
 enum
@@ -19,6 +20,8 @@ enum
     T_BITMAP = 0,
     T_TILEMAP = 1,
     T_MESH = 2,
+    T_MESH_LOD = 3,
+    T_TEXTURE = 4,
 };
 
 // Global file path
@@ -72,6 +75,10 @@ static void parse_command_type(char* w1, char* w2)
         {
             assetType = T_BITMAP;
         }
+        else if(strcmp(w2,"texture") == 0)
+        {
+            assetType = T_TEXTURE;
+        }
         else if(strcmp(w2,"tilemap") == 0)
         {
             assetType = T_TILEMAP;
@@ -80,9 +87,90 @@ static void parse_command_type(char* w1, char* w2)
         {
             assetType = T_MESH;
         }
+        else if(strcmp(w2,"meshlod") == 0)
+        {
+            assetType = T_MESH_LOD;
+        }
+    }
+}
+
+// Load a bitmap and turn it to a texture
+static BITMAP* load_texture(const char* path)
+{
+    BITMAP* b = load_bitmap(path);
+    if(b == NULL)
+        return NULL;
+
+    if(bmp_make_texture(b) == 1)
+    {
+        printf("Memory allocation error!\n");
+        destroy_bitmap(b);
+        return NULL;
+    }
+
+    return b;
+}
+
+
+// Load a mesh with a collision hierarchy. Detail levels
+// are loaded without one, collisions use the full mesh
+static MESH* load_collision_mesh(const char* path)
+{
+    MESH* m = load_mesh(path);
+    if(m == NULL)
+        return NULL;
+
+    if(mesh_build_bvh(m) == 1)
+    {
+        destroy_mesh(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+
+// Add a detail level to a mesh loaded earlier. The second
+// word is either a mesh file or a cell count to simplify
+// the mesh with
+static int load_mesh_lod(ASSET_PACK* p, int count, const char* name, const char* file, const char* path)
+{
+    MESH* m = NULL;
+    int i = 0;
+    for(; i < count; ++ i)
+    {
+        if(p->types[i] == T_MESH && strcmp(name,p->names[i].data) == 0)
+        {
+            m = (MESH*)p->objects[i];
+            break;
+        }
+    }
+    if(m == NULL)
+    {
+        printf("No mesh called %s to add a detail level to!\n",name);
+        return 1;
+    }
+
+    char* end;
+    long cells = strtol(file,&end,10);
+    MESH* lod = (*end == 0) ? mesh_simplify(m,(int)cells) : load_mesh(path);
+    if(lod == NULL)
+    {
+        printf("Failed to create a detail level for %s!\n",name);
+        return 1;
     }
+
+    if(mesh_add_lod(m,lod) == 1)
+    {
+        printf("Too many detail levels for %s!\n",name);
+        destroy_mesh(lod);
+        return 1;
+    }
+
+    return 0;
 }
 
+
 // Load
 ASSET_PACK* load_asset_pack(const char* path)
 {
@@ -157,17 +245,35 @@ ASSET_PACK* load_asset_pack(const char* path)
                 char path[1024];
                 snprintf(path,1024,"%s%s",filePath,op[1]);
 
+                // Detail levels are not assets of their own
+                if(assetType == T_MESH_LOD)
+                {
+                    if(load_mesh_lod(p,index,op[0],op[1],path) == 1)
+                    {
+                        free(p->objects);
+                        free(p->names);
+                        free(p->types);
+                        free(p);
+                        return NULL;
+                    }
+                    continue;
+                }
+
                 if(assetType == T_BITMAP)
                 {
                     p->objects[index] = (ANY)load_bitmap(path);
                 }
+                else if(assetType == T_TEXTURE)
+                {
+                    p->objects[index] = (ANY)load_texture(path);
+                }
                 else if(assetType == T_TILEMAP)
                 {
                     p->objects[index] = (ANY)load_tilemap(path);
                 }
                 else if(assetType == T_MESH)
                 {
-                    p->objects[index] = (ANY)load_mesh(path);
+                    p->objects[index] = (ANY)load_collision_mesh(path);
                 }
                 
                 p->types[index] = assetType;
@@ -184,6 +290,8 @@ ASSET_PACK* load_asset_pack(const char* path)
             }
         }
     }
+    // Detail levels were counted as assets, too
+    p->assetCount = index;
 
     return p;
 }
@@ -210,12 +318,17 @@ void destroy_asset_pack(ASSET_PACK* p)
 {
     int i = 0;
     ANY obj;
+
+    // Cached strings may refer to the fonts
+    tc_clear();
+
     for(; i < p->assetCount; ++ i)
     {   
         obj = p->objects[i];
         switch(p->types[i])
         {
         case T_BITMAP:
+        case T_TEXTURE:
             destroy_bitmap((BITMAP*)obj);
             break;
         case T_TILEMAP:
@@ -6,12 +6,120 @@
 
 #include "bitmap.h"
 #include "graphics.h"
+#include "kernels.h"
 
 #include "stdlib.h"
 #include "math.h"
 #include "stdio.h"
+#include "string.h"
 
 
+/// Allocate memory aligned to BMP_ALIGN, padded to
+/// a multiple of the alignment
+static void* alloc_aligned(size_t size)
+{
+    size = (size + BMP_ALIGN-1) & ~(size_t)(BMP_ALIGN-1);
+
+    // The original pointer is stored before the
+    // aligned block
+    Uint8* p = (Uint8*)malloc(size + BMP_ALIGN + sizeof(void*));
+    if(p == NULL) return NULL;
+
+    Uint8* a = (Uint8*)( ((size_t)p + sizeof(void*) + BMP_ALIGN-1) & ~(size_t)(BMP_ALIGN-1) );
+    ((void**)a)[-1] = p;
+
+    return a;
+}
+
+/// Free aligned memory
+static void free_aligned(void* a)
+{
+    if(a == NULL) return;
+
+    free( ((void**)a)[-1] );
+}
+
+/// Move row-major pixel data to 4x4 tiles
+static int gen_tiles(BITMAP* b)
+{
+    if(b->data == NULL)
+        return 0;
+    if( (b->w & (b->w-1)) != 0 || (b->h & (b->h-1)) != 0 || b->w < 4 || b->h < 4)
+        return 0;
+
+    b->tiles = (Uint8*)alloc_aligned(sizeof(Uint8) * b->w * b->h);
+    if(b->tiles == NULL)
+        return 1;
+
+    int x, y;
+    for(y = 0; y < b->h; ++ y)
+    {
+        for(x = 0; x < b->w; ++ x)
+        {
+            b->tiles[BMP_TILE_INDEX(b->w,x,y)] = b->data[y*b->w + x];
+        }
+    }
+
+    free_aligned(b->data);
+    b->data = NULL;
+
+    return 0;
+}
+
+/// Pack pixel data to 4 bits per pixel in 4x4 tiles if
+/// at most 16 colors are used. The other stores are freed
+static int gen_packed(BITMAP* b)
+{
+    if(b->packed != NULL || (b->w & 3) != 0 || (b->h & 3) != 0)
+        return 0;
+
+    // Find the colors used
+    Uint8 index[256];
+    int count = 0;
+    int x, y;
+    Uint8 col;
+    memset(index,0xFF,256);
+    for(y = 0; y < b->h; ++ y)
+    {
+        for(x = 0; x < b->w; ++ x)
+        {
+            col = bmp_texel(b,x,y);
+            if(index[col] != 0xFF) continue;
+            if(count == 16) return 0;
+
+            index[col] = (Uint8)count;
+            b->subPalette[count ++] = col;
+        }
+    }
+    b->colorCount = count;
+    b->packedAlpha = index[get_alpha()] == 0xFF ? 16 : index[get_alpha()];
+
+    Uint8* packed = (Uint8*)alloc_aligned(sizeof(Uint8) * (b->w*b->h/2));
+    if(packed == NULL)
+        return 1;
+    memset(packed,0,b->w*b->h/2);
+
+    // Two pixels per byte, the first one in the
+    // low bits
+    int i;
+    for(y = 0; y < b->h; ++ y)
+    {
+        for(x = 0; x < b->w; ++ x)
+        {
+            i = BMP_TILE_INDEX(b->w,x,y);
+            packed[i >> 1] |= index[bmp_texel(b,x,y)] << ((i & 1) << 2);
+        }
+    }
+
+    free_aligned(b->data);
+    free_aligned(b->tiles);
+    b->data = NULL;
+    b->tiles = NULL;
+    b->packed = packed;
+
+    return 0;
+}
+
 /// Load bitmap
 BITMAP* load_bitmap(const char* path)
 {
@@ -37,48 +145,199 @@ BITMAP* load_bitmap(const char* path)
     unsigned int pixelCount = bmp->w * bmp->h;
 
     // Allocate image and temp buffer data
-    bmp->data = (Uint8*)malloc(sizeof(Uint8) * pixelCount);
+    bmp->data = (Uint8*)alloc_aligned(sizeof(Uint8) * pixelCount);
     if(bmp->data == NULL) 
     {
         SDL_ShowSimpleMessageBox( SDL_MESSAGEBOX_ERROR,"Error!","Failed to allocate memory for a bitmap!\n",NULL);
         return NULL;
     }
 
-    // Go through the data
-    int i = 0;
-    Uint8 pixel;
-    Uint8 r,g,b,a;
-    Uint8 er,eg,eb;
-    for(; i < pixelCount; i++)
+    // Quantize to the palette
+    kr_quantize(pdata,bmp->data,pixelCount,get_alpha());
+
+    // Free data
+    stbi_image_free(pdata);
+
+    // Generate opaque runs, and pack the pixels if
+    // there are few enough colors
+    bmp->tiles = NULL;
+    bmp->packed = NULL;
+    bmp->spans = NULL;
+    bmp->rowSpans = NULL;
+    bmp->mip = NULL;
+    if(bmp_gen_spans(bmp) == 1 || gen_packed(bmp) == 1)
+    {
+        SDL_ShowSimpleMessageBox( SDL_MESSAGEBOX_ERROR,"Error!","Failed to allocate memory for a bitmap!\n",NULL);
+        return NULL;
+    }
+
+    return bmp;
+}
+
+/// Create an empty bitmap
+BITMAP* create_bitmap(int w, int h, Uint8 fill)
+{
+    BITMAP* bmp = (BITMAP*)malloc(sizeof(BITMAP));
+    if(bmp == NULL)
+    {
+        return NULL;
+    }
+
+    bmp->w = w;
+    bmp->h = h;
+    bmp->spans = NULL;
+    bmp->rowSpans = NULL;
+    bmp->mip = NULL;
+    bmp->tiles = NULL;
+    bmp->packed = NULL;
+    bmp->data = (Uint8*)alloc_aligned(sizeof(Uint8) * w * h);
+    if(bmp->data == NULL)
+    {
+        free(bmp);
+        return NULL;
+    }
+    memset(bmp->data,fill,w*h);
+
+    return bmp;
+}
+
+/// Generate opaque runs
+int bmp_gen_spans(BITMAP* b)
+{
+    Uint8 alpha = get_alpha();
+    Uint32 count = 0;
+    int x, y;
+
+    // Count runs
+    for(y = 0; y < b->h; ++ y)
     {
-        a = pdata[i*4 +3];
-        if(a < 255)
+        for(x = 0; x < b->w; ++ x)
         {
-            bmp->data[i] = get_alpha();
-            continue;
+            if(bmp_texel(b,x,y) != alpha && (x == 0 || bmp_texel(b,x-1,y) == alpha))
+                ++ count;
         }
+    }
 
-        r = pdata[i*4 +2];
-        g = pdata[i*4 +1];
-        b = pdata[i*4 ];
+    if(b->spans != NULL) free(b->spans);
+    if(b->rowSpans != NULL) free(b->rowSpans);
 
-        er = (Uint8) (r / 36.428f);
-        if(er > 7) r = 7;
-        er = er << 5;
-        eg = (Uint8) (g / 36.428f);
-        if(eg > 7) eg = 7;
-        eg = eg << 2;
-        eb = (b / 85);
+    b->spans = (BMP_SPAN*)malloc(sizeof(BMP_SPAN) * (count > 0 ? count : 1));
+    b->rowSpans = (Uint32*)malloc(sizeof(Uint32) * (b->h+1));
+    if(b->spans == NULL || b->rowSpans == NULL)
+    {
+        return 1;
+    }
+
+    // Store runs
+    Uint32 index = 0;
+    int start;
+    for(y = 0; y < b->h; ++ y)
+    {
+        b->rowSpans[y] = index;
+        for(x = 0; x < b->w; ++ x)
+        {
+            if(bmp_texel(b,x,y) == alpha) continue;
 
-        pixel = er | eg | eb;
+            start = x;
+            while(x < b->w && bmp_texel(b,x,y) != alpha) ++ x;
 
-        bmp->data[i] = pixel;
+            b->spans[index ++] = (BMP_SPAN){(Uint16)start, (Uint16)(x-start)};
+        }
     }
+    b->rowSpans[b->h] = index;
 
-    // Free data
-    stbi_image_free(pdata);
+    return 0;
+}
 
-    return bmp;
+/// Generate mipmaps, box-filtered in RGB space
+static int gen_mipmaps(BITMAP* b)
+{
+    Uint8 alpha = get_alpha();
+    BITMAP* src = b;
+    BITMAP* dst;
+    int x, y, i;
+    int count, r, g, bl;
+    Uint8 p[4];
+    Uint8 col;
+
+    destroy_bitmap(b->mip);
+    b->mip = NULL;
+
+    while(src->w >= 2 && src->h >= 2)
+    {
+        dst = create_bitmap(src->w/2, src->h/2, alpha);
+        if(dst == NULL)
+            return 1;
+
+        for(y = 0; y < dst->h; ++ y)
+        {
+            for(x = 0; x < dst->w; ++ x)
+            {
+                p[0] = bmp_texel(src,x*2,y*2);
+                p[1] = bmp_texel(src,x*2+1,y*2);
+                p[2] = bmp_texel(src,x*2,y*2+1);
+                p[3] = bmp_texel(src,x*2+1,y*2+1);
+
+                // Average the opaque texels in RGB space
+                count = 0; r = 0; g = 0; bl = 0;
+                for(i = 0; i < 4; ++ i)
+                {
+                    if(p[i] == alpha) continue;
+
+                    r += (p[i] >> 5) * 36;
+                    g += ((p[i] >> 2) & 7) * 36;
+                    bl += (p[i] & 3) * 85;
+                    ++ count;
+                }
+
+                // Half or more transparent, the texel
+                // is transparent
+                if(count <= 2)
+                    continue;
+
+                r /= count; g /= count; bl /= count;
+                col = (Uint8)( (((r + 18) / 36) << 5) | (((g + 18) / 36) << 2) | ((bl + 42) / 85) );
+
+                // Do not turn into the alpha color by accident
+                if(col == alpha)
+                    col ^= 1;
+
+                dst->data[y*dst->w + x] = col;
+            }
+        }
+
+        if(bmp_gen_spans(dst) == 1)
+        {
+            destroy_bitmap(dst);
+            return 1;
+        }
+
+        src->mip = dst;
+        src = dst;
+    }
+
+    return 0;
+}
+
+/// Make a texture
+int bmp_make_texture(BITMAP* b)
+{
+    // Only power-of-two textures are sampled with
+    // wrapping, so only they are tiled and get mipmaps
+    if( (b->w & (b->w-1)) != 0 || (b->h & (b->h-1)) != 0 || b->w < 4 || b->h < 4)
+        return 0;
+
+    if(gen_mipmaps(b) == 1)
+        return 1;
+
+    BITMAP* m;
+    for(m = b; m != NULL; m = m->mip)
+    {
+        if(gen_tiles(m) == 1 || gen_packed(m) == 1)
+            return 1;
+    }
+
+    return 0;
 }
 
 /// Destroy bitmap
@@ -86,14 +345,57 @@ void destroy_bitmap(BITMAP* bmp)
 {
     if(bmp == NULL) return;
 
-    if(bmp->data != NULL) free(bmp->data);
+    free_aligned(bmp->data);
+    free_aligned(bmp->tiles);
+    free_aligned(bmp->packed);
+    if(bmp->spans != NULL) free(bmp->spans);
+    if(bmp->rowSpans != NULL) free(bmp->rowSpans);
+    destroy_bitmap(bmp->mip);
     free(bmp);
 }
 
+/// Read a run of texels
+void bmp_read_row(const BITMAP* b, int x, int y, int n, Uint8* out)
+{
+    if(b->data != NULL)
+    {
+        memcpy(out,b->data + y*b->w + x,n);
+        return;
+    }
+
+    int i;
+    if(b->packed == NULL)
+    {
+        for(i = 0; i < n; ++ i)
+        {
+            out[i] = bmp_texel(b,x+i,y);
+        }
+        return;
+    }
+
+    // Packed rows are read a tile row (two bytes)
+    // at a time
+    const Uint8* src = b->packed + (BMP_TILE_INDEX(b->w,x & ~3,y) >> 1);
+    const Uint8* pal = b->subPalette;
+    int k = x & 3;
+    Uint8 p;
+    for(i = 0; i < n; ++ i)
+    {
+        p = src[k >> 1];
+        out[i] = pal[(p >> ((k & 1) << 2)) & 15];
+
+        if(++ k == 4)
+        {
+            k = 0;
+            src += 8;
+        }
+    }
+}
+
 /// Get pixel in bitmap
 Uint8 bmp_get_pixel(BITMAP* b, int x, int y)
 {
     if(x < 0 || y < 0 || x >= b->w || y >= b->h) return 0;
 
-    return b->data[y * b->w + x];
+    return bmp_texel(b,x,y);
 }
\ No newline at end of file
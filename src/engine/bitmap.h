@@ -6,23 +6,100 @@
 
 #include <SDL2/SDL.h>
 
-/// Bitmap type
+/// Alignment of bitmap pixel data in bytes
+#define BMP_ALIGN 64
+
+/// Index of a texel in tiled storage. Texels are stored
+/// in 4x4 tiles, so the neighbours of a texel are close
+/// in memory in every direction
+#define BMP_TILE_INDEX(w,x,y) ( ((y) & ~3)*(w) + (((x) & ~3) << 2) + (((y) & 3) << 2) + ((x) & 3) )
+
+/// Opaque pixel run
 typedef struct
+{
+    Uint16 x; /// Starting x coordinate
+    Uint16 len; /// Run length
+}
+BMP_SPAN;
+
+/// Bitmap type. The pixels are kept in exactly one of
+/// the stores, the other ones are NULL
+typedef struct _BITMAP
 {
     int w; /// Bitmap width
     int h; /// Bitmap height
-    Uint8* data; /// Pixel data
+    Uint8* data; /// Pixel data, row by row
+    Uint8* tiles; /// Pixel data in 4x4 tiles
+    Uint8* packed; /// 4-bit pixel data in 4x4 tiles
+    Uint8 subPalette[16]; /// Palette indices of the packed values
+    int colorCount; /// Number of colors in the sub-palette
+    int packedAlpha; /// Packed value of the alpha color, 16 if none
+
+    BMP_SPAN* spans; /// Opaque runs, row by row
+    Uint32* rowSpans; /// Index of the first run of each row (h+1 entries)
+
+    struct _BITMAP* mip; /// Next mipmap level (half size), NULL if none
 }
 BITMAP;
 
-/// Load bitmap
+/// Load bitmap. Bitmaps with at most 16 colors (and
+/// a size divisible by 4) are stored in 4-bit tiles only
 /// < path Bitmap path
 /// > Returns a new bitmap (pointer)
 BITMAP* load_bitmap(const char* path);
 
+/// Create an empty bitmap
+/// < w Width
+/// < h Height
+/// < fill Initial color index
+/// > A new bitmap (pointer), NULL on error
+BITMAP* create_bitmap(int w, int h, Uint8 fill);
+
+/// Generate opaque runs for a bitmap. Needs to
+/// be called again if the pixel data is modified
+/// < b Bitmap
+/// > 0 on success, 1 on error
+int bmp_gen_spans(BITMAP* b);
+
+/// Turn a bitmap to a texture sampled by the 3D and
+/// affine renderers. Power-of-two bitmaps (at least 4x4)
+/// get a mipmap chain and their pixels are moved to 4x4
+/// tiles, or 4-bit tiles if at most 16 colors are used.
+/// The row-major pixel data is freed, so it cannot be
+/// modified afterwards
+/// < b Bitmap
+/// > 0 on success, 1 on error
+int bmp_make_texture(BITMAP* b);
+
 /// Destroy bitmap
 void destroy_bitmap(BITMAP* bmp);
 
+/// Read a texel from any of the pixel stores, the
+/// coordinates are expected to be inside the bitmap
+/// < b Bitmap
+/// < x X coordinate
+/// < y Y coordinate
+/// > Color index
+static inline Uint8 bmp_texel(const BITMAP* b, int x, int y)
+{
+    if(b->data != NULL)
+        return b->data[y*b->w + x];
+    if(b->tiles != NULL)
+        return b->tiles[BMP_TILE_INDEX(b->w,x,y)];
+
+    int i = BMP_TILE_INDEX(b->w,x,y);
+    return b->subPalette[(b->packed[i >> 1] >> ((i & 1) << 2)) & 15];
+}
+
+/// Copy a run of texels on a row from any of the
+/// pixel stores
+/// < b Bitmap
+/// < x Starting x coordinate
+/// < y Y coordinate
+/// < n Texel count
+/// < out Destination
+void bmp_read_row(const BITMAP* b, int x, int y, int n, Uint8* out);
+
 /// Get pixel in bitmap
 /// > b Bitmap
 /// > x X coordinate
@@ -0,0 +1,220 @@
+/// Bounding volume hierarchy (source)
+/// (c) 2018 Jani Nykänen
+
+#include "bvh.h"
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "math.h"
+
+/// Traversal stack size. Median splits keep the depth
+/// logarithmic, so this is plenty
+#define BVH_STACK_SIZE 64
+
+
+// Triangle bounds
+static void tri_bounds(BVH_TRIANGLE* t, VEC3* minV, VEC3* maxV)
+{
+    *minV = t->A;
+    *maxV = t->A;
+
+    VEC3 p[2] = {t->B, t->C};
+    int i = 0;
+    for(; i < 2; ++ i)
+    {
+        if(p[i].x < minV->x) minV->x = p[i].x;
+        if(p[i].y < minV->y) minV->y = p[i].y;
+        if(p[i].z < minV->z) minV->z = p[i].z;
+        if(p[i].x > maxV->x) maxV->x = p[i].x;
+        if(p[i].y > maxV->y) maxV->y = p[i].y;
+        if(p[i].z > maxV->z) maxV->z = p[i].z;
+    }
+}
+
+
+// Centroid component
+static float tri_centroid(BVH_TRIANGLE* t, int axis)
+{
+    switch(axis)
+    {
+    case 0: return t->A.x + t->B.x + t->C.x;
+    case 1: return t->A.y + t->B.y + t->C.y;
+    default: return t->A.z + t->B.z + t->C.z;
+    }
+}
+
+
+// Partially sort triangles so the k:th one is in place
+// (quickselect by centroid)
+static void select_median(BVH_TRIANGLE* tris, Uint32 lo, Uint32 hi, Uint32 k, int axis)
+{
+    BVH_TRIANGLE tmp;
+    float pivot;
+    Uint32 i, j;
+    while(lo < hi)
+    {
+        pivot = tri_centroid(&tris[(lo+hi)/2],axis);
+        i = lo;
+        j = hi;
+        while(i <= j)
+        {
+            while(tri_centroid(&tris[i],axis) < pivot) ++ i;
+            while(tri_centroid(&tris[j],axis) > pivot) -- j;
+            if(i <= j)
+            {
+                tmp = tris[i];
+                tris[i] = tris[j];
+                tris[j] = tmp;
+                ++ i;
+                if(j == 0) break;
+                -- j;
+            }
+        }
+        if(k <= j) hi = j;
+        else if(k >= i) lo = i;
+        else break;
+    }
+}
+
+
+// Build a node (recursive)
+static Uint32 build_node(BVH* b, Uint32 start, Uint32 count)
+{
+    Uint32 index = b->nodeCount ++;
+    BVH_NODE* n = &b->nodes[index];
+
+    // Compute bounds
+    VEC3 tmin, tmax;
+    tri_bounds(&b->tris[start],&n->minV,&n->maxV);
+    Uint32 i = start+1;
+    for(; i < start+count; ++ i)
+    {
+        tri_bounds(&b->tris[i],&tmin,&tmax);
+        if(tmin.x < n->minV.x) n->minV.x = tmin.x;
+        if(tmin.y < n->minV.y) n->minV.y = tmin.y;
+        if(tmin.z < n->minV.z) n->minV.z = tmin.z;
+        if(tmax.x > n->maxV.x) n->maxV.x = tmax.x;
+        if(tmax.y > n->maxV.y) n->maxV.y = tmax.y;
+        if(tmax.z > n->maxV.z) n->maxV.z = tmax.z;
+    }
+
+    n->start = start;
+    n->right = 0;
+    if(count <= BVH_LEAF_SIZE)
+    {
+        n->count = count;
+        return index;
+    }
+    n->count = 0;
+
+    // Split the longest axis at the median centroid, so
+    // the depth stays logarithmic
+    float ex = n->maxV.x - n->minV.x;
+    float ey = n->maxV.y - n->minV.y;
+    float ez = n->maxV.z - n->minV.z;
+    int axis = (ex >= ey && ex >= ez) ? 0 : (ey >= ez ? 1 : 2);
+
+    Uint32 leftCount = count / 2;
+    select_median(b->tris,start,start+count-1,start+leftCount,axis);
+
+    build_node(b,start,leftCount);
+    Uint32 right = build_node(b,start+leftCount,count-leftCount);
+    b->nodes[index].right = right;
+
+    return index;
+}
+
+
+// Create a BVH
+BVH* bvh_create(const float* vertices, const float* normals, Uint32 triCount)
+{
+    if(triCount == 0) return NULL;
+
+    BVH* b = (BVH*)malloc(sizeof(BVH));
+    if(b == NULL)
+    {
+        printf("Memory allocation error!\n");
+        return NULL;
+    }
+    b->tris = (BVH_TRIANGLE*)malloc(sizeof(BVH_TRIANGLE) * triCount);
+    b->nodes = (BVH_NODE*)malloc(sizeof(BVH_NODE) * triCount * 2);
+    if(b->tris == NULL || b->nodes == NULL)
+    {
+        printf("Memory allocation error!\n");
+        free(b->tris);
+        free(b->nodes);
+        free(b);
+        return NULL;
+    }
+    b->triCount = triCount;
+    b->nodeCount = 0;
+
+    // Store triangles & plane data
+    BVH_TRIANGLE* t;
+    const float* v;
+    float l;
+    Uint32 i = 0;
+    for(; i < triCount; ++ i)
+    {
+        t = &b->tris[i];
+        v = vertices + i*9;
+        t->A = vec3(v[0],v[1],v[2]);
+        t->B = vec3(v[3],v[4],v[5]);
+        t->C = vec3(v[6],v[7],v[8]);
+        t->N = vec3(normals[i*9],normals[i*9 +1],normals[i*9 +2]);
+
+        l = sqrtf(t->N.x*t->N.x + t->N.y*t->N.y + t->N.z*t->N.z);
+        t->invLen = l > 0.0f ? 1.0f / l : 0.0f;
+    }
+
+    build_node(b,0,triCount);
+
+    return b;
+}
+
+
+// Query a box
+void bvh_query_box(BVH* b, VEC3 minV, VEC3 maxV, BVH_FUNC f, void* user)
+{
+    if(b == NULL) return;
+
+    Uint32 stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top ++] = 0;
+
+    BVH_NODE* n;
+    Uint32 i;
+    while(top > 0)
+    {
+        n = &b->nodes[stack[-- top]];
+
+        if(maxV.x < n->minV.x || minV.x > n->maxV.x
+        || maxV.y < n->minV.y || minV.y > n->maxV.y
+        || maxV.z < n->minV.z || minV.z > n->maxV.z)
+            continue;
+
+        if(n->count > 0)
+        {
+            for(i = n->start; i < n->start + n->count; ++ i)
+            {
+                f(&b->tris[i],user);
+            }
+            continue;
+        }
+
+        // Children
+        stack[top ++] = n->right;
+        stack[top ++] = (Uint32)(n - b->nodes) + 1;
+    }
+}
+
+
+// Destroy a BVH
+void bvh_destroy(BVH* b)
+{
+    if(b == NULL) return;
+
+    free(b->nodes);
+    free(b->tris);
+    free(b);
+}
@@ -0,0 +1,71 @@
+/// Bounding volume hierarchy (header)
+/// (c) 2018 Jani Nykänen
+
+#ifndef __BVH__
+#define __BVH__
+
+#include "SDL2/SDL.h"
+
+#include "vector.h"
+
+/// Max triangles in a leaf
+#define BVH_LEAF_SIZE 4
+
+/// Collision triangle
+typedef struct
+{
+    VEC3 A, B, C;
+    VEC3 N; /// Normal of the first vertex
+    float invLen; /// 1 / |N|, so the plane distance needs no sqrt
+}
+BVH_TRIANGLE;
+
+/// BVH node. The left child follows the node, the right
+/// child is at index "right". Leaves have count > 0
+typedef struct
+{
+    VEC3 minV;
+    VEC3 maxV;
+    Uint32 start;
+    Uint32 count;
+    Uint32 right;
+}
+BVH_NODE;
+
+/// BVH type
+typedef struct
+{
+    BVH_NODE* nodes;
+    Uint32 nodeCount;
+    BVH_TRIANGLE* tris;
+    Uint32 triCount;
+}
+BVH;
+
+/// Triangle callback
+/// < t Triangle
+/// < user User data
+typedef void (*BVH_FUNC) (BVH_TRIANGLE* t, void* user);
+
+/// Build a BVH over triangles
+/// < vertices Vertices, 9 floats per triangle
+/// < normals Normals, 9 floats per triangle
+/// < triCount Triangle count
+/// > A new BVH
+BVH* bvh_create(const float* vertices, const float* normals, Uint32 triCount);
+
+/// Call a function for the triangles of every leaf that
+/// overlaps a box. Includes all the triangles that overlap
+/// the box, and possibly a few neighbours
+/// < b BVH
+/// < minV Box minimum
+/// < maxV Box maximum
+/// < f Callback
+/// < user User data passed to the callback
+void bvh_query_box(BVH* b, VEC3 minV, VEC3 maxV, BVH_FUNC f, void* user);
+
+/// Destroy a BVH
+/// < b BVH
+void bvh_destroy(BVH* b);
+
+#endif // __BVH__
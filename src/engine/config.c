@@ -36,6 +36,13 @@ int read_config(CONFIG* c, const char* path)
         return 1;
     }
 
+    // Pick the kernels automatically by default
+    strcpy(c->kernels,"auto");
+    // One thread per core by default
+    c->threads = 0;
+    // No startup messages by default
+    c->verbose = false;
+
     // Read words
     int count = 0;
     int i = 0;
@@ -75,6 +82,18 @@ int read_config(CONFIG* c, const char* path)
             {
                 c->fps = (int)strtol(value,NULL,10);
             }
+            else if(strcmp(key,"kernels") == 0)
+            {
+                snprintf(c->kernels,KERNEL_STRING_SIZE,"%s",value);
+            }
+            else if(strcmp(key,"threads") == 0)
+            {
+                c->threads = (int)strtol(value,NULL,10);
+            }
+            else if(strcmp(key,"verbose") == 0)
+            {
+                c->verbose = (bool)strtol(value,NULL,10);
+            }
         }
 
         count = !count;
@@ -10,6 +10,8 @@
 #define TITLE_STRING_SIZE 64
 /// Asset path size
 #define ASSET_PATH_SIZE 256
+/// Kernel variant name size
+#define KERNEL_STRING_SIZE 16
 
 /// Configuration structure 
 typedef struct
@@ -21,6 +23,9 @@ typedef struct
     int fps;
     bool fullscreen;
     char title[TITLE_STRING_SIZE];
+    char kernels[KERNEL_STRING_SIZE];
+    int threads;
+    bool verbose;
 }
 CONFIG;
 
@@ -10,7 +10,8 @@
 #include "math.h"
 #include "stdio.h"
 
-#include "mathext.h"
+#include "vecmath.h"
+#include "kernels.h"
 
 /// Global palette
 static Uint8 palette[256 * 3];
@@ -28,10 +29,12 @@ void fr_gen_palette()
         b = i << 6;
         b = b >> 6; 
 
-        palette[i*3 +2] = (Uint8) floor(minf(255,36.428f * r) );
-        palette[i*3 +1] = (Uint8) floor(minf(255,36.428f * g) );
+        palette[i*3 +2] = (Uint8) floor(vm_minf(255,36.428f * r) );
+        palette[i*3 +1] = (Uint8) floor(vm_minf(255,36.428f * g) );
         palette[i*3 ] = b *85;
     }
+
+    kr_set_palette(palette);
 }
 
 /// Create frame
@@ -108,16 +111,7 @@ void frame_update_tex(FRAME* fr)
 {
     if(fr == NULL) return;
 
-    int i = 0;
-    int pos = 0;
-    for(; i < (int)fr->size; i++)
-    {
-        pos = fr->colorData[i]*3;
-
-        fr->data[i*4 + 1] = palette[ pos +2 ];
-        fr->data[i*4 + 2] = palette[ pos + 1];
-        fr->data[i*4 + 3] = palette[ pos ];
-    }
+    kr_expand(fr->colorData,fr->data,(int)fr->size);
 
     SDL_UpdateTexture(fr->tex,NULL,fr->data,fr->w*4);
 }
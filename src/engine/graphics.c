@@ -4,12 +4,17 @@
 #include "graphics.h"
 
 #include "mathext.h"
+#include "vecmath.h"
 #include "transform.h"
+#include "textcache.h"
+#include "kernels.h"
+#include "workers.h"
 
 #include "malloc.h"
 #include "stdlib.h"
 #include "math.h"
 #include "stdio.h"
+#include "string.h"
 
 
 // Triangle type
@@ -19,9 +24,10 @@ typedef struct
     VEC2 tA,tB,tC; // Texture coordinates
     BITMAP* tex; // Texture
     float depth; // Depth value
-    bool light; // Light enabled
+    int light; // Light level
     bool darkness; // Darkness enabled
-    VEC3 normal; // Normal
+    Sint32 fogA,fogB,fogC; // Fog levels at vertices (16.16 fixed point)
+    Uint8 mask; // Screen-door mask
 }
 _TRIANGLE;
 
@@ -31,14 +37,25 @@ static const float DEPTH_MIN = 0.025f;
 // Max depth (default for far plane)
 static const float DEPTH_MAX = 100.0f;
 
-// Size of triangle buffer
+// Initial size of triangle buffer
 #define TBUFFER_SIZE 4096
+// Triangles with smaller bounding boxes are drawn
+// with a single color
+#define SMALL_TRIANGLE_SIZE 4
+// Projected mesh radius (in pixels) below which the first
+// lower detail level is used. Halves for every level
+#define LOD_SIZE 24.0f
+// How far past a level threshold the size must go before
+// the level changes, relative to the threshold
+#define LOD_HYSTERESIS 0.2f
 // Triangle buffer
-static _TRIANGLE tbuffer[TBUFFER_SIZE];
-// Which triangles are drawn
-static bool tdrawn[TBUFFER_SIZE];
+static _TRIANGLE* tbuffer;
+// Drawing order
+static int* torder;
 // Triangle index pointer
 static int tindex;
+// Triangle buffer capacity
+static int tcapacity;
 
 // Global renderer
 static SDL_Renderer* grend;
@@ -58,8 +75,15 @@ static Uint8 alpha = 170;
 // Put pixel function
 static void (*ppfunc) (int,int,Uint8);
 
+// Screen-door mask of the triangles pushed
+static Uint8 pushMask = DITHER_FULL;
+// Screen-door mask of the triangle being drawn
+static Uint8 pixelMask = DITHER_FULL;
+
 // Global texture used in drawing filled polygons
 static BITMAP* gtex;
+// Texture (mipmap) level sampled by the spans
+static BITMAP* spanTex;
 
 // Matrix
 static MAT2 invM;
@@ -77,6 +101,26 @@ static bool lightEnabled;
 static VEC3 lightDir;
 // Light magnitude
 static float lightMag;
+// Light generation, changes when the light changes
+static Uint32 lightGen = 1;
+
+// Transformed mesh vertices
+static float* tverts = NULL;
+// Capacity of the transformed vertex buffer (vertices)
+static Uint32 tvertCount = 0;
+
+// Instances per worker job piece
+#define INSTANCE_GRAIN 16
+// Detail level of instances that are not drawn
+#define INSTANCE_CULLED 255
+// Instance matrices (12 values each)
+static float* instMats = NULL;
+// Instance detail levels
+static Uint8* instLevels = NULL;
+// First transformed vertex of each instance
+static Uint32* instStart = NULL;
+// Capacity of the instance buffers
+static int instCapacity = 0;
 
 // Is darkness enabled
 static bool darknessEnabled;
@@ -85,14 +129,21 @@ static float darkBegin;
 // Darkness end
 static float darkEnd;
 
-// Depth min
-static float depthMin;
-// Depth max
-static float depthMax;
-// Depth step
-static float depthStep;
-// Depth direction
-static int depthDirection;
+// Size of the depth-to-darkness table
+#define FOG_TABLE_SIZE 256
+// Depth-to-darkness table (16.16 fixed point levels)
+static Sint32 fogTable[FOG_TABLE_SIZE +1];
+// Depth to fog table index multiplier
+static float fogScale;
+
+// Fog levels of the vertices of the current triangle
+static Sint32 vertexFog[3];
+// Fog level at the first vertex
+static float fogBase;
+// Fog gradient, horizontal
+static float fogDx;
+// Fog gradient, vertical
+static float fogDy;
 
 // Near plane
 static float nearPlane;
@@ -147,6 +198,31 @@ static void gen_light_palettes()
     }
 }
 
+// Generate depth-to-darkness table
+static void gen_fog_table()
+{
+    int i = 0;
+    for(; i <= FOG_TABLE_SIZE; ++ i)
+    {
+        fogTable[i] = (Sint32)( (2*MAX_DARKNESS_VALUE) * ((float)i / (float)FOG_TABLE_SIZE) * 65536.0f);
+    }
+    fogScale = darkEnd > darkBegin ? (float)FOG_TABLE_SIZE / (darkEnd - darkBegin) : 0.0f;
+}
+
+
+// Get the fog level of a depth value
+static Sint32 get_fog_level(float depth)
+{
+    if(depth <= darkBegin) return 0;
+
+    // Clamp before converting, huge depths would overflow
+    float f = (depth-darkBegin) * fogScale;
+    if(!(f < (float)FOG_TABLE_SIZE)) return fogTable[FOG_TABLE_SIZE];
+
+    return fogTable[(int)f];
+}
+
+
 // Put pixel to the screen
 static void put_pixel(int x, int y, Uint8 index)
 {
@@ -155,46 +231,268 @@ static void put_pixel(int x, int y, Uint8 index)
 }
 
 
-/// Put pixel to the screen (with darkness enabled)
-/// < x X coordinate
-/// < y Y coordinate
-/// < index Color index
-static void put_pixel_dark(int x, int y, Uint8 index)
+// Convert a texture coordinate to 16.16 fixed point,
+// wrapped to the texture size
+static Sint32 tex_fixed(float f, int size)
 {
-    if(index == alpha || x < 0 || y < 0 || x >= gframe->w || y >= gframe->h) return;
+    f = fmodf(f,(float)size);
+    if(f < 0.0f) f += size;
+
+    return (Sint32)(f * 65536.0f);
+}
+
+
+// Convert a texture coordinate step to 16.16 fixed point
+static Sint32 step_fixed(float f)
+{
+    const float LIMIT = 16384.0f;
+
+    if(f > LIMIT) f = LIMIT;
+    else if(f < -LIMIT) f = -LIMIT;
+
+    return (Sint32)(f * 65536.0f);
+}
+
+
+// Draw a textured span through the screen-door mask.
+// Samples texel by texel from any of the pixel stores
+static void draw_masked_span(int y, int x0, int x1, Sint32 u, Sint32 v, Sint32 du, Sint32 dv, int level)
+{
+    BITMAP* b = spanTex;
+    int w = b->w;
+    int h = b->h;
+    Uint8* out = gframe->colorData + y*gframe->w;
+    Uint8 row = (pixelMask >> ((y & 1) << 1)) & 3;
+    Uint8 col;
+    int x = x0;
+    int tx, ty;
+
+    const Uint8* pals[2] = {NULL, NULL};
+    int k = 0;
+    if(level > 0)
+    {
+        if(level > MAX_DARKNESS_VALUE*2-2) level = MAX_DARKNESS_VALUE*2-2;
+
+        pals[0] = lpalettes[level/2];
+        pals[1] = (level % 2 == 0) ? pals[0] : lpalettes[level/2+1];
+        k = (x0 + y) & 1;
+    }
+
+    for(; x < x1; ++ x)
+    {
+        if((row >> (x & 1)) & 1)
+        {
+            tx = (u >> 16) % w; if(tx < 0) tx += w;
+            ty = (v >> 16) % h; if(ty < 0) ty += h;
 
-    if(lightVal > 0)
+            col = bmp_texel(b,tx,ty);
+            if(col != alpha)
+                out[x] = pals[0] == NULL ? col : pals[k][col];
+        }
+
+        k ^= 1;
+        u += du; v += dv;
+    }
+}
+
+
+// Draw a textured span
+// < y Y coordinate
+// < x0 Starting x
+// < x1 Ending x (exclusive)
+// < u, v Texture coordinates at x0 (16.16 fixed point)
+// < du, dv Texture coordinate steps
+// < level Darkness level (0 = no darkness)
+static void draw_tex_span(int y, int x0, int x1, Sint32 u, Sint32 v, Sint32 du, Sint32 dv, int level)
+{
+    // Dithered triangles take the slow path
+    if(pixelMask != DITHER_FULL)
+    {
+        draw_masked_span(y,x0,x1,u,v,du,dv,level);
+        return;
+    }
+
+    BITMAP* b = spanTex;
+    int w = b->w;
+    int h = b->h;
+    Uint8* out = gframe->colorData + y*gframe->w;
+    Uint8 col;
+    int x = x0;
+    int tx, ty;
+
+    // Palette rows are picked once per span, odd
+    // levels alternate between two rows in a 2x2
+    // checkerboard
+    const Uint8* pals[2] = {NULL, NULL};
+    int k = 0;
+    if(level > 0)
+    {
+        if(level > MAX_DARKNESS_VALUE*2-2) level = MAX_DARKNESS_VALUE*2-2;
+
+        pals[0] = lpalettes[level/2];
+        pals[1] = (level % 2 == 0) ? pals[0] : lpalettes[level/2+1];
+        k = (x0 + y) & 1;
+    }
+
+    bool pow2 = (w & (w-1)) == 0 && (h & (h-1)) == 0;
+
+    // Packed textures are sampled through a lookup that
+    // already has the darkness applied
+    if(pow2 && b->packed != NULL)
     {
-        Uint8 col;
-        if(lightVal % 2 == 0)
+        const Uint8* packed = b->packed;
+        Uint32 uu = (Uint32)u, vv = (Uint32)v;
+        int mw = w-1, mh = h-1;
+        int an = b->packedAlpha;
+        Uint32 i;
+        int p;
+
+        Uint8 lut[2][16];
+        for(p = 0; p < b->colorCount; ++ p)
         {
-            col = lpalettes[lightVal/2][index];
+            col = b->subPalette[p];
+            lut[0][p] = pals[0] == NULL ? col : pals[0][col];
+            lut[1][p] = pals[1] == NULL ? col : pals[1][col];
+        }
+
+        for(; x < x1; ++ x)
+        {
+            i = BMP_TILE_INDEX(w, (uu >> 16) & mw, (vv >> 16) & mh);
+            p = (packed[i >> 1] >> ((i & 1) << 2)) & 15;
+            if(p != an)
+                out[x] = lut[k][p];
+
+            k ^= 1;
+            uu += du; vv += dv;
+        }
+        return;
+    }
+
+    // Power-of-two textures are tiled and wrap with a mask
+    if(b->tiles != NULL)
+    {
+        const Uint8* tiles = b->tiles;
+        Uint32 uu = (Uint32)u, vv = (Uint32)v;
+        int mw = w-1, mh = h-1;
+
+        if(pals[0] == NULL)
+        {
+            for(; x < x1; ++ x)
+            {
+                col = tiles[ BMP_TILE_INDEX(w, (uu >> 16) & mw, (vv >> 16) & mh) ];
+                if(col != alpha)
+                    out[x] = col;
+
+                uu += du; vv += dv;
+            }
         }
         else
         {
-            if( (x % 2 == 0 && y % 2 == 0) || (x % 2 == 1 && y % 2 == 1) )
-                col = lpalettes[lightVal/2][index];
-            else
-                col = lpalettes[lightVal/2+1][index];
+            for(; x < x1; ++ x)
+            {
+                col = tiles[ BMP_TILE_INDEX(w, (uu >> 16) & mw, (vv >> 16) & mh) ];
+                if(col != alpha)
+                    out[x] = pals[k][col];
+
+                k ^= 1;
+                uu += du; vv += dv;
+            }
         }
-        gframe->colorData[y*gframe->w+x] = col;
         return;
     }
 
-    gframe->colorData[y*gframe->w+x] = index;
+    // Other textures wrap by division
+    for(; x < x1; ++ x)
+    {
+        tx = (u >> 16) % w; if(tx < 0) tx += w;
+        ty = (v >> 16) % h; if(ty < 0) ty += h;
+
+        col = bmp_texel(b,tx,ty);
+        if(col != alpha)
+            out[x] = pals[0] == NULL ? col : pals[k][col];
+
+        k ^= 1;
+        u += du; v += dv;
+    }
 }
 
 
-/// Calculate darkness value of lighting
-static int calculate_ligthing_value(VEC3 normal)
+// Draw a textured span with interpolated fog. The span
+// is split to runs that have a constant darkness level
+// < y Y coordinate
+// < x0 Starting x
+// < x1 Ending x (exclusive)
+// < u, v Texture coordinates at x0 (16.16 fixed point)
+// < du, dv Texture coordinate steps
+// < fog Fog level at x0 (16.16 fixed point)
+// < dfog Fog level step
+// < base Base darkness level
+static void draw_fog_span(int y, int x0, int x1, Sint32 u, Sint32 v, Sint32 du, Sint32 dv, Sint32 fog, Sint32 dfog, int base)
+{
+    const int MAX_LEVEL = MAX_DARKNESS_VALUE*2-2;
+    const Sint32 FOG_MAX = MAX_LEVEL << 16;
+
+    int n, level;
+    while(x0 < x1)
+    {
+        // Pixels until the level changes
+        n = x1-x0;
+        if(fog < 0)
+        {
+            level = 0;
+            if(dfog > 0) n = (-fog + dfog-1) / dfog;
+        }
+        else if(fog >= FOG_MAX)
+        {
+            level = MAX_LEVEL;
+            if(dfog < 0) n = (fog - FOG_MAX) / -dfog + 1;
+        }
+        else
+        {
+            level = fog >> 16;
+            if(dfog > 0) n = (((level+1) << 16) - fog + dfog-1) / dfog;
+            else if(dfog < 0) n = (fog - (level << 16)) / -dfog + 1;
+        }
+        n = vm_max(1,vm_min(n,x1-x0));
+
+        draw_tex_span(y,x0,x0+n,u,v,du,dv,base+level);
+
+        x0 += n;
+        u = (Sint32)((Uint32)u + (Uint32)n*(Uint32)du);
+        v = (Sint32)((Uint32)v + (Uint32)n*(Uint32)dv);
+        fog += n*dfog;
+    }
+}
+
+
+// Generate fog gradient for a triangle
+static void gen_fog_gradient(int x1, int y1, int x2, int y2, int x3, int y3)
 {
+    float det = (float)( (x2-x1)*(y3-y1) - (x3-x1)*(y2-y1) );
+    float f1 = (float)vertexFog[0];
+    float f2 = (float)vertexFog[1] - f1;
+    float f3 = (float)vertexFog[2] - f1;
+
+    fogBase = f1;
+    fogDx = (f2*(y3-y1) - f3*(y2-y1)) / det;
+    fogDy = ((x2-x1)*f3 - (x3-x1)*f2) / det;
+}
 
-    normal = tr_rotate_normal(normal);
 
-    float multiplier = maxf( 0.0f, normal.x*lightDir.x+normal.y*lightDir.y+normal.z*lightDir.z);
+/// Calculate darkness value of lighting
+static int light_value(VEC3 normal)
+{
+    float multiplier = vm_maxf( 0.0f, vm_dot(normal,lightDir));
     multiplier = (1.0f-lightMag) + lightMag * multiplier;
 
-    return (int)floor( (1.0f-multiplier) / (1.0f/ ( (float)2*MAX_DARKNESS_VALUE)) );
+    return (int)floorf( (1.0f-multiplier) / (1.0f/ ( (float)2*MAX_DARKNESS_VALUE)) );
+}
+
+
+// Calculate lighting value, for a normal in model space
+static int calculate_ligthing_value(VEC3 normal)
+{
+    return light_value(tr_rotate_normal(normal));
 }
 
 
@@ -208,7 +506,7 @@ static void gen_matrix(int x1, int y1, int x2, int y2, int x3, int y3)
         (uv3.x-uv1.x), (uv2.x-uv1.x),
         (uv3.y-uv1.y), (uv2.y-uv1.y)
     );
-    MAT2 uvInv = mat2_inverse(uv);
+    MAT2 uvInv = vm_mat2_inverse(uv);
 
     // U ja V vectors
     VEC2 u = vec2((x3-x1),(y3-y1));
@@ -229,11 +527,11 @@ static void gen_matrix(int x1, int y1, int x2, int y2, int x3, int y3)
     UVtrans = vec2(uv1.x * b->w, uv1.y * b->h);
 
     // Final matrix
-    MAT2 m = mat2_mul(basis,uvInv);
-    m = mat2_mul(scale,m);
+    MAT2 m = vm_mat2_mul(basis,uvInv);
+    m = vm_mat2_mul(scale,m);
 
     // Inverse matrix
-    invM = mat2_inverse(m);
+    invM = vm_mat2_inverse(m);
 }
 
 
@@ -318,39 +616,7 @@ void clear_frame(Uint8 index)
 // Draw a non-scaled bitmap
 void draw_bitmap(BITMAP* b, int dx, int dy, int flip)
 {
-    dx += transX;
-    dy += transY;
-
-    int x; // Screen X
-    int y = dy; // Screen Y
-    int px = 0; // Pixel X
-    int py = 0; // Pixel Y
-
-    if(dx+b->w < 0 || dx >= gframe->w || dy + b->h < 0 || dy >= gframe->h) return;
-
-    // Go though every pixel and put them to a frame
-    for(; y < dy+b->h; y++)
-    {
-        if(y < 0)
-        {
-            ++ py;
-            continue;
-        }
-
-        for(x = dx; x < min(gframe->w,dx+b->w); x++)
-        {
-            if(x < 0)
-            {
-                ++ px;
-                continue;
-            }
-
-            ppfunc(x,y, (b->data[py*b->w +px]));
-            px ++;
-        }
-        py ++;
-        px = 0;
-    } 
+    draw_bitmap_region(b,0,0,b->w,b->h,dx,dy,flip);
 }
 
 
@@ -372,7 +638,7 @@ void draw_inverted_bitmap(BITMAP* b, int dx, int dy, int flip)
     {
         for(x = dx; x < dx+b->w; x++)
         {
-            index = b->data[py*b->w +px];
+            index = bmp_texel(b,px,py);
             index = ~index;
             index = index & 0b00111111;
 
@@ -388,8 +654,6 @@ void draw_inverted_bitmap(BITMAP* b, int dx, int dy, int flip)
 // Draw a rotated bitmap area
 void draw_rotated_bitmap_area(BITMAP* b,  float trx, float try, int skip, float angle)
 {
-    skip ++;
-
     // Rotation matrix B
     float b11 = cos(angle), b21 = -sin(angle);
     float b12 = sin(angle), b22 = cos(angle);
@@ -397,55 +661,140 @@ void draw_rotated_bitmap_area(BITMAP* b,  float trx, float try, int skip, float
     // Inverse of determinant of B
     float detInv = 1.0f / (b11 * b22 - b12 * b21);
 
-    // The inverse of matrix B
-    float ib11 = detInv * (b22), ib21 = detInv * -b21;
-    float ib12 = detInv * -(b12), ib22 = detInv * b22;
+    // The inverse of matrix B, rotated
+    // around the center of the frame
+    AFFINE_PARAMS p;
+    p.a = detInv * (b22); p.b = detInv * -b21;
+    p.c = detInv * -(b12); p.d = detInv * b22;
+    p.tx = trx;
+    p.ty = try;
+    p.cx = gframe->w / 2;
+    p.cy = gframe->h / 2;
+
+    draw_affine_layer(b,p,NULL,NULL,skip);
+}
 
-    // Texture coordinates in bitmap
-    int tx = 0;
-    int ty = 0;
 
-    // "gframe" stands for "global frame",
-    // so cx and cy point to the center of
-    // the frame where this thing is drawn to
-    int cx = gframe->w / 2;
-    int cy = gframe->h / 2;
+// Draw an affine layer
+void draw_affine_layer(BITMAP* b, AFFINE_PARAMS p, AFFINE_LINE_FUNC line, void* user, int skip)
+{
+    draw_affine_layer_rows(b,p,line,user,skip,0,gframe->h);
+}
 
-    // Translated coordinates
-    int xx, yy;
 
-    // Coordinates
-    int x,y;
+// Draw a range of rows of an affine layer
+void draw_affine_layer_rows(BITMAP* b, AFFINE_PARAMS p, AFFINE_LINE_FUNC line, void* user, int skip, int y0, int y1)
+{
+    const float FIXED_ONE = 65536.0f;
 
-    // Color, obviously
-    Uint8 color;
+    skip ++;
 
-    // Draw pixels
-    for(x = 0; x < gframe->w; x++)
+    int w = b->w;
+    int h = b->h;
+    bool pow2 = (w & (w-1)) == 0 && (h & (h-1)) == 0;
+
+    // Texture size in fixed point (non-power-of-two
+    // textures are wrapped by comparison)
+    Sint32 fw = w << 16;
+    Sint32 fh = h << 16;
+
+    AFFINE_PARAMS rp = p;
+    Uint32 u, v;
+    Sint32 du, dv;
+    Sint32 su, sv;
+    float fu, fv;
+    int x, y;
+    int i;
+    Uint8 col;
+    Uint8* out;
+
+    // Skipped rows are not drawn at all
+    y0 = vm_max(0,y0);
+    if(y0 % skip != 0) y0 += skip - y0 % skip;
+    y1 = vm_min(gframe->h,y1);
+
+    for(y = y0; y < y1; y += skip)
     {
-        for(y = 0; y < gframe->h; y++)
+        if(line != NULL)
         {
-            if(!(skip == 0 || (x % skip == 0 && y % skip == 0) ) )
-                continue;
+            rp = p;
+            line(y,&rp,user);
+        }
 
-            // Translate point
-            xx = x - cx;
-            yy = y - cy;
+        // Texture coordinates at the beginning of the row,
+        // wrapped so that they fit in fixed point
+        fu = rp.a * -rp.cx + rp.b * (y-rp.cy) + rp.tx;
+        fv = rp.c * -rp.cx + rp.d * (y-rp.cy) + rp.ty;
+        fu = fmodf(fu,(float)w); if(fu < 0.0f) fu += w;
+        fv = fmodf(fv,(float)h); if(fv < 0.0f) fv += h;
+        // Tiny negative values round up to the size
+        if(fu >= w) fu -= w;
+        if(fv >= h) fv -= h;
 
-            // Get texture coordinates
-            tx = (int)(ib11 * xx + ib21 * yy +trx);
-            ty = (int)(ib12 * xx + ib22 * yy +try);
+        u = (Uint32)(fu * FIXED_ONE);
+        v = (Uint32)(fv * FIXED_ONE);
+        du = (Sint32)(rp.a * skip * FIXED_ONE);
+        dv = (Sint32)(rp.c * skip * FIXED_ONE);
 
-            // If texture coords are outside the
-            // texture area, force them back!
-            while(tx >= b->w) tx -= b->w;
-            while(ty >= b->h) ty -= b->h;
-            while(tx < 0) tx += b->w;
-            while(ty < 0) ty += b->h;
+        out = gframe->colorData + y*gframe->w;
 
-            
-            color = b->data[ty*b->w +tx];
-            ppfunc(x,y, color);
+        if(pow2 && b->packed != NULL)
+        {
+            for(x = 0; x < gframe->w; x += skip)
+            {
+                i = BMP_TILE_INDEX(w, (u >> 16) & (w-1), (v >> 16) & (h-1));
+                i = (b->packed[i >> 1] >> ((i & 1) << 2)) & 15;
+                if(i != b->packedAlpha)
+                    out[x] = b->subPalette[i];
+
+                u += du;
+                v += dv;
+            }
+        }
+        else if(b->tiles != NULL)
+        {
+            for(x = 0; x < gframe->w; x += skip)
+            {
+                col = b->tiles[ BMP_TILE_INDEX(w, (u >> 16) & (w-1), (v >> 16) & (h-1)) ];
+                if(col != alpha)
+                    out[x] = col;
+
+                u += du;
+                v += dv;
+            }
+        }
+        else if(pow2)
+        {
+            for(x = 0; x < gframe->w; x += skip)
+            {
+                col = b->data[ ((v >> 16) & (h-1)) * w + ((u >> 16) & (w-1)) ];
+                if(col != alpha)
+                    out[x] = col;
+
+                u += du;
+                v += dv;
+            }
+        }
+        else
+        {
+            su = (Sint32)u;
+            sv = (Sint32)v;
+            for(x = 0; x < gframe->w; x += skip)
+            {
+                // Wrapped before sampling, the conversion to
+                // fixed point can round up to the size too
+                while(su >= fw) su -= fw;
+                while(su < 0) su += fw;
+                while(sv >= fh) sv -= fh;
+                while(sv < 0) sv += fh;
+
+                col = bmp_texel(b,su >> 16,sv >> 16);
+                if(col != alpha)
+                    out[x] = col;
+
+                su += du;
+                sv += dv;
+            }
         }
     } 
 }
@@ -457,48 +806,74 @@ void draw_bitmap_region(BITMAP* b, int sx, int sy, int sw, int sh, int dx, int d
     dx += transX;
     dy += transY;
 
-    if(dx+sw < 0 || dx >= gframe->w || dy + sh < 0 || dy-sh >= gframe->h) return;
-
-    int x; // Screen X
-    int y = dy; // Screen Y
-    int px = sx; // Pixel X
-    int py = sy; // Pixel Y
+    // Clip the destination area once
+    int x0 = vm_max(0,dx);
+    int y0 = vm_max(0,dy);
+    int x1 = vm_min(gframe->w,dx+sw);
+    int y1 = vm_min(gframe->h,dy+sh);
+    if(x0 >= x1 || y0 >= y1) return;
+
+    bool flipx = (flip & FLIP_HORIZONTAL) != 0;
+    bool flipy = (flip & FLIP_VERTICAL) != 0;
+
+    int y; // Screen Y
+    int py; // Pixel Y
+    int i;
+    int begin, end; // Source run
+    int start, stop; // Destination run
+    Uint8* out;
+    BMP_SPAN* s;
+
+    // Copy opaque runs and skip transparent
+    // ones wholesale
+    for(y = y0; y < y1; ++ y)
+    {
+        py = flipy ? sy + sh-1 - (y-dy) : sy + (y-dy);
+        if(py < 0 || py >= b->h) continue;
 
-    int beginx = flip == FLIP_NONE ? dx : dx+sw-1;
-    int endx = flip == FLIP_NONE ? dx+sw : dx;
-    int stepx = flip == FLIP_NONE ? 1 : -1;
+        out = gframe->colorData + y*gframe->w;
 
-    // Go though every pixel and put them to a frame
-    for(; y < min(gframe->h,dy+sh); y++)
-    {
-        if(y < 0)
+        for(i = b->rowSpans[py]; i < b->rowSpans[py+1]; ++ i)
         {
-            ++ py;
-            continue;
-        }
+            s = &b->spans[i];
+            if(s->x >= sx+sw) break;
 
-        for(x = beginx; x != endx; x += stepx)
-        {
-            if(stepx > 0)
+            begin = vm_max(s->x,sx);
+            end = vm_min(s->x+s->len,sx+sw);
+            if(begin >= end) continue;
+
+            if(!flipx)
             {
-                if( x < 0)
+                start = dx + begin-sx;
+                stop = dx + end-sx;
+                if(start < x0)
                 {
-                    ++ px;
-                    continue;
+                    begin += x0-start;
+                    start = x0;
                 }
-                else if(x >= gframe->w)
+                if(stop > x1) stop = x1;
+                if(start >= stop) continue;
+
+                bmp_read_row(b,begin,py,stop-start,out+start);
+            }
+            else
+            {
+                start = dx + sx+sw - end;
+                stop = dx + sx+sw - begin;
+                if(start < x0)
                 {
-                    break;
+                    end -= x0-start;
+                    start = x0;
                 }
-            }
-
-            ppfunc(x,y, b->data[py*b->w +px]);
+                if(stop > x1) stop = x1;
 
-            px ++;
+                for(; start < stop; ++ start)
+                {
+                    out[start] = bmp_texel(b,-- end,py);
+                }
+            }
         }
-        py ++;
-        px = sx;
-    } 
+    }
 }
 
 
@@ -530,7 +905,7 @@ void draw_skipped_bitmap_region(BITMAP* b, int sx, int sy, int sw, int sh, int d
             
             if(skipx == 0 || (skipxCount % skipx != 0 && (skipy == 0 || skipyCount % skipy != 0) ))
             {
-                ppfunc(x,y, b->data[py*b->w +px]);
+                ppfunc(x,y, bmp_texel(b,px,py));
             }
 
             px ++;
@@ -543,45 +918,122 @@ void draw_skipped_bitmap_region(BITMAP* b, int sx, int sy, int sw, int sh, int d
 }
 
 
-// Draw a scaled bitmap line
+// Draw a bitmap region scaled by an integer factor,
+// the destination area is expected to be clipped
+static void draw_scaled_bitmap_region_int(BITMAP* b, int sx, int sy, int sw, int sh, int dx, int dy, int k,
+    int x0, int y0, int x1, int y1)
+{
+    int y; // Screen Y
+    int py; // Pixel Y
+    int px; // Pixel X
+    int d; // Destination X
+    int i, end;
+    Uint8 col;
+    Uint8* out;
+    BMP_SPAN* s;
+
+    for(y = y0; y < y1; ++ y)
+    {
+        py = sy + (y-dy) / k;
+        if(py < 0 || py >= b->h) continue;
+
+        out = gframe->colorData + y*gframe->w;
+
+        // Expand the opaque runs of the source row
+        for(i = b->rowSpans[py]; i < b->rowSpans[py+1]; ++ i)
+        {
+            s = &b->spans[i];
+            if(s->x >= sx+sw) break;
+
+            px = vm_max(s->x,sx);
+            end = vm_min(s->x+s->len,sx+sw);
+            d = dx + (px-sx)*k;
+
+            for(; px < end; ++ px, d += k)
+            {
+                col = bmp_texel(b,px,py);
+                if(d >= x0 && d+k <= x1)
+                {
+                    switch(k)
+                    {
+                    case 4: out[d+3] = col; // Fall through
+                    case 3: out[d+2] = col; // Fall through
+                    default:
+                        out[d+1] = col;
+                        out[d] = col;
+                        break;
+                    }
+                }
+                else if(d+k > x0 && d < x1)
+                {
+                    memset(out + vm_max(d,x0),col,vm_min(d+k,x1)-vm_max(d,x0));
+                }
+            }
+        }
+    }
+}
+
+
+// Draw a scaled bitmap region
 void draw_scaled_bitmap_region(BITMAP* b, int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh)
 {
     dx += transX;
     dy += transY;
 
-    int x; // Screen X
-    int y = dy; // Screen Y
-    int px = sx; // Pixel X
-    int py = sy; // Pixel Y
-    float pxf = (float)sx; // Pixel X (float)
-    float pyf = (float)sy; // Pixel Y (float)
+    if(sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0) return;
 
-    float ssx = (float)dw/(float)sw;
-    float ssy = (float)dh/(float)sh;
+    // Clip the destination area once
+    int x0 = vm_max(0,dx);
+    int y0 = vm_max(0,dy);
+    int x1 = vm_min(gframe->w,dx+dw);
+    int y1 = vm_min(gframe->h,dy+dh);
+    if(x0 >= x1 || y0 >= y1) return;
 
-    // Go though every pixel and put them to a frame
-    // if pixel is not out of frame range
-    for(; y < dy+ (int)floor(dh ); y++)
+    // Integer scales (2x, 3x, 4x) expand opaque runs
+    int k = dw / sw;
+    if(k >= 2 && k <= 4 && dw == sw*k && dh == sh*k)
+    {
+        draw_scaled_bitmap_region_int(b,sx,sy,sw,sh,dx,dy,k,x0,y0,x1,y1);
+        return;
+    }
+
+    // Source steps in 16.16 fixed point
+    Uint32 stepx = ((Uint32)sw << 16) / (Uint32)dw;
+    Uint32 stepy = ((Uint32)sh << 16) / (Uint32)dh;
+    Uint32 ustart = ((Uint32)sx << 16) + (x0-dx)*stepx;
+    Uint32 v = ((Uint32)sy << 16) + (y0-dy)*stepy;
+    Uint32 u;
+
+    int x; // Screen X
+    int y; // Screen Y
+    Uint8 col;
+    Uint8* out;
+    Uint8* src;
+
+    for(y = y0; y < y1; ++ y, v += stepy)
     {
-        for(x = dx; x < dx+ (int)floor(dw ); x++)
+        out = gframe->colorData + y*gframe->w;
+        u = ustart;
+
+        // Row-major rows are read directly
+        if(b->data != NULL)
         {
-            if(x < -1)
+            src = b->data + (v >> 16)*b->w;
+            for(x = x0; x < x1; ++ x, u += stepx)
             {
-                pxf += 1.0f/ssx * abs(x);
-                x = -1;
-                continue;
+                col = src[u >> 16];
+                if(col != alpha)
+                    out[x] = col;
             }
-            else if(x >= gframe->w)
-                break;
-
-            px = (int)(pxf);
-            py = (int)(pyf);
+            continue;
+        }
 
-            ppfunc(x,y, b->data[py*b->w +px]);
-            pxf += 1.0f/ssx;
+        for(x = x0; x < x1; ++ x, u += stepx)
+        {
+            col = bmp_texel(b,u >> 16,v >> 16);
+            if(col != alpha)
+                out[x] = col;
         }
-        pyf += 1.0f/ssy;
-        pxf = (float)sx;
     } 
 }
 
@@ -592,37 +1044,20 @@ void draw_text(BITMAP* b, Uint8* text, int len, int dx, int dy, int xoff, int yo
     dx += transX;
     dy += transY;
 
-    int x = dx;
-    int y = dy;
     int cw = b->w / 16;
-    int ch = cw; //  b->h / 16;
-    int i=0;
-    Uint8 c;
-    int sx;
-    int sy;
+    int firstx = 0;
+    int ox, oy;
 
     if(center)
     {
-        x -= (int) ( ((float)len+1)/2.0f * (float)(cw+xoff) );
+        firstx = -(int) ( ((float)len+1)/2.0f * (float)(cw+xoff) );
     }
 
-    for(; i < len && text[i] != '\0'; i++)
-    {
-        c = text[i];
-        if(c == '\n')
-        {
-            x = dx;
-            y += yoff;
-            continue;
-        }
-
-        sx = c % 16;
-        sy = c / 16;
+    // Draw the whole string as one pre-rasterized bitmap
+    BITMAP* str = tc_get_text(b,text,len,xoff,yoff,firstx,&ox,&oy);
+    if(str == NULL) return;
 
-        draw_bitmap_region(b,sx*cw,sy*ch,cw,ch,x,y,0);
-
-        x += cw + xoff;
-    }
+    draw_bitmap(str,dx+ox,dy+oy,0);
 }
 
 
@@ -632,15 +1067,19 @@ void fill_rect(int x, int y, int w, int h, Uint8 index)
     x += transX;
     y += transY;
 
-    int dx = x;
-    int dy = y;
+    if(index == alpha) return;
 
-    for(; dy < y+h; dy++)
+    // Clip once
+    int x0 = vm_max(0,x);
+    int y0 = vm_max(0,y);
+    int x1 = vm_min(gframe->w,x+w);
+    int y1 = vm_min(gframe->h,y+h);
+    if(x0 >= x1 || y0 >= y1) return;
+
+    int dy = y0;
+    for(; dy < y1; ++ dy)
     {
-        for(dx = x; dx < x+w; dx++)
-        {
-            ppfunc(dx,dy,index);
-        }
+        memset(gframe->colorData + dy*gframe->w + x0, index, x1-x0);
     }
 }
 
@@ -648,53 +1087,167 @@ void fill_rect(int x, int y, int w, int h, Uint8 index)
 // Fill a skipped rectangle
 void fill_skipped_rect(int x, int y, int w, int h, int skipx, int skipy, Uint8 index)
 {
-        x += transX;
+    x += transX;
     y += transY;
 
-    int dx = x;
-    int dy = y;
-
-    int skipxCount = 0;
-    int skipyCount = 0;
-
-    // Go though every pixel and put them to a frame
-    for(; dy < y+h; dy++)
+    if(skipx == 0)
+    {
+        fill_rect(x-transX,y-transY,w,h,index);
+        return;
+    }
+    if(index == alpha) return;
+
+    // Clip once
+    int x0 = vm_max(0,x);
+    int y0 = vm_max(0,y);
+    int x1 = vm_min(gframe->w,x+w);
+    int y1 = vm_min(gframe->h,y+h);
+    if(x0 >= x1 || y0 >= y1) return;
+
+    int dx, dy;
+    int skipxCount;
+    Uint8* out;
+
+    // Skipped columns are written with strided
+    // stores, skipped rows are jumped over
+    for(dy = y0; dy < y1; ++ dy)
     {
-        for(dx = x; dx < x+w; dx++)
+        if(skipy != 0 && (dy-y) % skipy == 0)
+            continue;
+
+        out = gframe->colorData + dy*gframe->w;
+        skipxCount = (x0-x) % skipx;
+        for(dx = x0; dx < x1; ++ dx)
         {
-            
-            if(skipx == 0 || (skipxCount % skipx != 0 && (skipy == 0 || skipyCount % skipy != 0) ))
-            {
-                ppfunc(dx,dy,index);
-            }
-            skipxCount ++;
+            if(skipxCount != 0)
+                out[dx] = index;
+
+            if(++ skipxCount == skipx)
+                skipxCount = 0;
         }
-        skipyCount ++;
     } 
 }
 
 
-// Draw a line
-void draw_line(int x1, int y1, int x2, int y2, Uint8 color)
+// Cohen-Sutherland outcode
+static int line_outcode(int x, int y)
 {
-    x1 += transX;
-    y1 += transY;
-    x2 += transX;
-    y2 += transY;
+    int code = 0;
 
-    // Bresenham's line algorithm
-    int dx = abs(x2-x1), sx = x1<x2 ? 1 : -1;
-    int dy = abs(y2-y1), sy = y1<y2 ? 1 : -1; 
-    int err = (dx>dy ? dx : -dy)/2, e2;
-     
-    for(;;)
-    {
-        ppfunc(x1,y1, color);
+    if(x < 0) code |= 1;
+    else if(x >= gframe->w) code |= 2;
+    if(y < 0) code |= 4;
+    else if(y >= gframe->h) code |= 8;
+
+    return code;
+}
+
+
+// Clip a line against the frame (Cohen-Sutherland)
+static bool clip_line(int* x1, int* y1, int* x2, int* y2)
+{
+    int c1 = line_outcode(*x1,*y1);
+    int c2 = line_outcode(*x2,*y2);
+    int c;
+    float x = 0.0f, y = 0.0f;
+
+    float dx, dy;
+
+    while(true)
+    {
+        if((c1 | c2) == 0) return true;
+        if((c1 & c2) != 0) return false;
+
+        dx = (float)(*x2 - *x1);
+        dy = (float)(*y2 - *y1);
+
+        // Move the outside point to the frame edge
+        c = c1 != 0 ? c1 : c2;
+        if(c & 8)
+        {
+            y = gframe->h-1;
+            x = *x1 + dx * (y - *y1) / dy;
+        }
+        else if(c & 4)
+        {
+            y = 0;
+            x = *x1 + dx * (y - *y1) / dy;
+        }
+        else if(c & 2)
+        {
+            x = gframe->w-1;
+            y = *y1 + dy * (x - *x1) / dx;
+        }
+        else if(c & 1)
+        {
+            x = 0;
+            y = *y1 + dy * (x - *x1) / dx;
+        }
+
+        if(c == c1)
+        {
+            *x1 = (int)roundf(x);
+            *y1 = (int)roundf(y);
+            c1 = line_outcode(*x1,*y1);
+        }
+        else
+        {
+            *x2 = (int)roundf(x);
+            *y2 = (int)roundf(y);
+            c2 = line_outcode(*x2,*y2);
+        }
+    }
+}
+
+
+// Draw a line
+void draw_line(int x1, int y1, int x2, int y2, Uint8 color)
+{
+    x1 += transX;
+    y1 += transY;
+    x2 += transX;
+    y2 += transY;
+
+    if(color == alpha || !clip_line(&x1,&y1,&x2,&y2)) return;
+
+    int w = gframe->w;
+    Uint8* out;
+
+    // Horizontal line
+    if(y1 == y2)
+    {
+        memset(gframe->colorData + y1*w + vm_min(x1,x2), color, abs(x2-x1)+1);
+        return;
+    }
+
+    // Vertical line
+    if(x1 == x2)
+    {
+        out = gframe->colorData + vm_min(y1,y2)*w + x1;
+        int i = abs(y2-y1);
+        for(; i >= 0; -- i)
+        {
+            *out = color;
+            out += w;
+        }
+        return;
+    }
+
+    // Bresenham's line algorithm
+    int dx = abs(x2-x1), sx = x1<x2 ? 1 : -1;
+    int dy = abs(y2-y1), sy = y1<y2 ? w : -w; 
+    int err = (dx>dy ? dx : -dy)/2, e2;
+    int n = vm_max(dx,dy);
+
+    out = gframe->colorData + y1*w + x1;
+    for(;;)
+    {
+        *out = color;
         
-        if (x1==x2 && y1==y2) break;
+        if (n -- == 0) break;
         e2 = err;
-        if (e2 >-dx) { err -= dy; x1 += sx; }
-        if (e2 < dy) { err += dx; y1 += sy; }
+        if (e2 >-dx) { err -= dy; out += sx; }
+        if (e2 < dy) { err += dx; out += sy; }
     }
 }
 
@@ -702,15 +1255,13 @@ void draw_line(int x1, int y1, int x2, int y2, Uint8 color)
 // Draw a textured triangle
 static void _draw_triangle(int x1, int y1, int x2, int y2, int x3, int y3, int spc)
 {
-    int dmodif = 0;
-
     BITMAP* b = gtex;
 
     // Calculate minimums & maximums
-    int maxy = max(y1,max(y2,y3));
-    int miny = min(y1,min(y2,y3));
-    int maxx = max(x1,max(x2,x3));
-    int minx = min(x1,min(x2,x3));
+    int maxy = vm_max(y1,vm_max(y2,y3));
+    int miny = vm_min(y1,vm_min(y2,y3));
+    int maxx = vm_max(x1,vm_max(x2,x3));
+    int minx = vm_min(x1,vm_min(x2,x3));
 
     // Do not draw if not visible
     if(maxx < 0 || minx >= gframe->w || maxy < 0 || miny >= gframe->h 
@@ -754,70 +1305,64 @@ static void _draw_triangle(int x1, int y1, int x2, int y2, int x3, int y3, int s
     float step2 = (py3 != py1) ? (float) (px3 - px1) / (float) (py3 - py1) : (px3-px1);
     float step3 = (py3 != py2) ? (float) (px3 - px2) / (float) (py3 - py2) : (px3-px2);
 
-    int x,y;
+    int y;
     float startx = px1;
     float endx = px1;
 
     // Is the top or bottom flat
     bool flat = py1 == py2 || py2 == py3 || py1 == py3;
 
-    Uint8 col = 63;
-
-    // Texture coordinates in bitmap
-    int tx = 0;
-    int ty = 0;
+    // Span limits
+    int xs, xe;
 
     // Translated coordinates
     int xx, yy;
 
-    float depth = 0.0f;
-    float dstep = 0.0f;
-    if(darknessEnabled)
+    // Pick a mipmap level so that a pixel step covers
+    // less than two texels
+    float scale = 1.0f;
+    float rho = vm_maxf(invM.m11*invM.m11 + invM.m12*invM.m12, invM.m21*invM.m21 + invM.m22*invM.m22);
+    while(b->mip != NULL && rho >= 4.0f)
     {
-        depth = depthDirection == 1 ? depthMin : depthMax;
-        dstep = depthStep / (float) (maxy-miny);
+        b = b->mip;
+        scale *= 0.5f;
+        rho *= 0.25f;
     }
+    spanTex = b;
+
+    // Texture coordinate steps per pixel
+    Sint32 du = step_fixed(invM.m11 * scale);
+    Sint32 dv = step_fixed(invM.m12 * scale);
+
+    // Fog step per pixel
+    Sint32 dfog = darknessEnabled ? (Sint32)fogDx : 0;
+    // Light level is added on top of fog
+    int base = lightVal;
 
     // Draw visible pixels
-    for(y = miny; y <= min(maxy,gframe->h); y++)
+    for(y = miny; y <= vm_min(maxy,gframe->h-1); y++)
     {
-        if(darknessEnabled)
+        xs = vm_max(0,(int)startx);
+        xe = vm_min(gframe->w-1,(int)endx);
+        if(y >= 0 && xs <= xe)
         {
-            if(depth >= darkBegin)
+            // Translate point
+            xx = xs - x1;
+            yy = y - y1;
+
+            if(darknessEnabled)
             {
-                lightVal = dmodif + floor( (2*MAX_DARKNESS_VALUE) * (depth - darkBegin) / (darkEnd-darkBegin) ) ;
-                if(lightVal > MAX_DARKNESS_VALUE*2-2) lightVal = MAX_DARKNESS_VALUE*2-2;
+                draw_fog_span(y,xs,xe+1,
+                    tex_fixed((invM.m11 * xx + invM.m21 * yy + UVtrans.x) * scale, b->w),
+                    tex_fixed((invM.m12 * xx + invM.m22 * yy + UVtrans.y) * scale, b->h),
+                    du,dv, (Sint32)(fogBase + fogDx * xx + fogDy * yy), dfog, base);
             }
             else
             {
-                lightVal = dmodif;
-            }
-        }
-
-        if(y >= 0)
-        {
-            for(x = max(0,(int)startx); x <= min(gframe->w,(int)endx); ++ x)
-            {
-                // Translate point
-                xx = x - x1;
-                yy = y - y1;
-
-                // Get texture coordinates
-                tx = (int)(invM.m11 * xx + invM.m21 * yy);
-                ty = (int)(invM.m12 * xx + invM.m22 * yy);
-
-                tx += UVtrans.x;
-                ty += UVtrans.y;
-
-                // If texture coords are outside the
-                // texture area, force them back!
-                while(tx >= b->w) tx -= b->w;
-                while(ty >= b->h) ty -= b->h;
-                while(tx < 0) tx += b->w;
-                while(ty < 0) ty += b->h;
-
-                col = b->data[ty*b->w +tx];
-                ppfunc(x,y,col);
+                draw_tex_span(y,xs,xe+1,
+                    tex_fixed((invM.m11 * xx + invM.m21 * yy + UVtrans.x) * scale, b->w),
+                    tex_fixed((invM.m12 * xx + invM.m22 * yy + UVtrans.y) * scale, b->h),
+                    du,dv, base);
             }
         }
 
@@ -837,10 +1382,79 @@ static void _draw_triangle(int x1, int y1, int x2, int y2, int x3, int y3, int s
             _draw_triangle(x1,y1,x2,y2,x3,y3,spc+1);
             return;
         }
+    }
+}
+
+
+// Draw a triangle that covers only a few pixels. The
+// whole triangle gets the color of the texel at its
+// centroid, so no texture mapping setup is needed
+static void draw_small_triangle(int x1, int y1, int x2, int y2, int x3, int y3)
+{
+    int minx = vm_max(0,vm_min(x1,vm_min(x2,x3)));
+    int maxx = vm_min(gframe->w-1,vm_max(x1,vm_max(x2,x3)));
+    int miny = vm_max(0,vm_min(y1,vm_min(y2,y3)));
+    int maxy = vm_min(gframe->h-1,vm_max(y1,vm_max(y2,y3)));
+    if(minx > maxx || miny > maxy)
+        return;
+
+    int area = (x2-x1)*(y3-y1) - (x3-x1)*(y2-y1);
+    int sign = area > 0 ? 1 : -1;
+
+    // Pick a mipmap level from the texel/pixel area ratio
+    BITMAP* b = gtex;
+    float rho = fabsf( (uv2.x-uv1.x)*(uv3.y-uv1.y) - (uv3.x-uv1.x)*(uv2.y-uv1.y) ) 
+        * b->w * b->h / (float)abs(area);
+    while(b->mip != NULL && rho >= 4.0f)
+    {
+        b = b->mip;
+        rho *= 0.25f;
+    }
+
+    // Centroid texel
+    int tx = (int)floorf( (uv1.x+uv2.x+uv3.x)/3.0f * b->w) % b->w;
+    int ty = (int)floorf( (uv1.y+uv2.y+uv3.y)/3.0f * b->h) % b->h;
+    if(tx < 0) tx += b->w;
+    if(ty < 0) ty += b->h;
 
-         depth += dstep; 
+    Uint8 col = bmp_texel(b,tx,ty);
+    if(col == alpha)
+        return;
+
+    // Darkness from the light level and the average fog
+    int level = lightVal;
+    if(darknessEnabled)
+        level += vm_max(0, (vertexFog[0]+vertexFog[1]+vertexFog[2]) / 3) >> 16;
+    if(level > MAX_DARKNESS_VALUE*2-2) level = MAX_DARKNESS_VALUE*2-2;
+
+    // Colors for both checkerboard cells
+    Uint8 cols[2] = {col, col};
+    if(level > 0)
+    {
+        cols[0] = lpalettes[level/2][col];
+        cols[1] = (level % 2 == 0) ? cols[0] : lpalettes[level/2+1][col];
+    }
+
+    // Scan the bounding box with edge functions
+    Uint8* out;
+    int x, y;
+    for(y = miny; y <= maxy; ++ y)
+    {
+        out = gframe->colorData + y*gframe->w;
+        for(x = minx; x <= maxx; ++ x)
+        {
+            if(sign * ( (x2-x1)*(y-y1) - (y2-y1)*(x-x1) ) >= 0 &&
+               sign * ( (x3-x2)*(y-y2) - (y3-y2)*(x-x2) ) >= 0 &&
+               sign * ( (x1-x3)*(y-y3) - (y1-y3)*(x-x3) ) >= 0 &&
+               ((pixelMask >> (((y & 1) << 1) | (x & 1))) & 1))
+            {
+                out[x] = cols[(x+y) & 1];
+            }
+        }
     }
 }
+
+
 // Draw a textured triangle (actual definition)
 void draw_triangle(int x1, int y1, int x2, int y2, int x3, int y3)
 {
@@ -853,7 +1467,17 @@ void draw_triangle(int x1, int y1, int x2, int y2, int x3, int y3)
 
     if(ux*vy - uy * vx == 0) return;
 
+    // Tiny triangles skip the texture mapping setup
+    if(vm_max(x1,vm_max(x2,x3)) - vm_min(x1,vm_min(x2,x3)) < SMALL_TRIANGLE_SIZE &&
+       vm_max(y1,vm_max(y2,y3)) - vm_min(y1,vm_min(y2,y3)) < SMALL_TRIANGLE_SIZE)
+    {
+        draw_small_triangle(x1,y1,x2,y2,x3,y3);
+        return;
+    }
+
     gen_matrix(x1,y1,x2,y2,x3,y3);
+    if(darknessEnabled)
+        gen_fog_gradient(x1,y1,x2,y2,x3,y3);
 
     _draw_triangle(x1,y1,x2,y2,x3,y3,0);
 }
@@ -882,13 +1506,9 @@ void draw_triangle_float(float x1, float y1, float x2, float y2, float x3, float
 }
 
 
-// Draw a filled triangle in 3D space
-void draw_triangle_3d(VEC3 a, VEC3 b, VEC3 c, VEC2 tA, VEC2 tB, VEC2 tC, VEC3 n)
+// Push a transformed triangle to the triangle buffer
+static void push_triangle(VEC3 ta, VEC3 tb, VEC3 tc, VEC2 tA, VEC2 tB, VEC2 tC, int light)
 {
-    VEC3 ta = tr_use_transform(a);
-    VEC3 tb = tr_use_transform(b);
-    VEC3 tc = tr_use_transform(c);
-
     if(ta.z < nearPlane && tb.z < nearPlane && tc.z < nearPlane)
         return;
 
@@ -909,10 +1529,10 @@ void draw_triangle_3d(VEC3 a, VEC3 b, VEC3 c, VEC2 tA, VEC2 tB, VEC2 tC, VEC3 n)
     tc.x /= tc.z; tc.y /= tc.z;
 
     // Calculate minimums & maximums
-    float maxy = maxf(ta.y,maxf(tb.y,tc.y));
-    float miny = minf(ta.y,minf(tb.y,tc.y));
-    float maxx = maxf(ta.x,maxf(tb.x,tc.x));
-    float minx = minf(ta.x,minf(tb.x,tc.x));
+    float maxy = vm_maxf(ta.y,vm_maxf(tb.y,tc.y));
+    float miny = vm_minf(ta.y,vm_minf(tb.y,tc.y));
+    float maxx = vm_maxf(ta.x,vm_maxf(tb.x,tc.x));
+    float minx = vm_minf(ta.x,vm_minf(tb.x,tc.x));
 
     float ratio = (float)gframe->w / (float) gframe->h;
 
@@ -922,12 +1542,43 @@ void draw_triangle_3d(VEC3 a, VEC3 b, VEC3 c, VEC2 tA, VEC2 tB, VEC2 tC, VEC3 n)
         return;
     }
 
+    // Grow the buffer if needed
+    if(tindex >= tcapacity)
+    {
+        int cap = tcapacity == 0 ? TBUFFER_SIZE : tcapacity*2;
+        _TRIANGLE* buf = (_TRIANGLE*)realloc(tbuffer,sizeof(_TRIANGLE) * cap);
+        if(buf == NULL) return;
+        tbuffer = buf;
+
+        int* order = (int*)realloc(torder,sizeof(int) * cap);
+        if(order == NULL) return;
+        torder = order;
+
+        tcapacity = cap;
+    }
+
     float depth = (ta.z+tb.z+tc.z)/3.0f;
-    tbuffer[tindex] = (_TRIANGLE){ta,tb,tc,tA,tB,tC,gtex, depth,lightEnabled,darknessEnabled, n};
+    tbuffer[tindex] = (_TRIANGLE){ta,tb,tc,tA,tB,tC,gtex, depth,light,darknessEnabled, 0,0,0, pushMask};
+
+    // Fog is computed per vertex
+    if(darknessEnabled)
+    {
+        tbuffer[tindex].fogA = get_fog_level(ta.z);
+        tbuffer[tindex].fogB = get_fog_level(tb.z);
+        tbuffer[tindex].fogC = get_fog_level(tc.z);
+    }
     tindex ++;
 }
 
 
+// Draw a filled triangle in 3D space
+void draw_triangle_3d(VEC3 a, VEC3 b, VEC3 c, VEC2 tA, VEC2 tB, VEC2 tC, VEC3 n)
+{
+    push_triangle(tr_use_transform(a),tr_use_transform(b),tr_use_transform(c),
+        tA,tB,tC, lightEnabled ? calculate_ligthing_value(n) : 0);
+}
+
+
 // "Clear" triangle buffer
 void clear_triangle_buffer()
 {
@@ -935,93 +1586,55 @@ void clear_triangle_buffer()
 }
 
 
+// Compare triangle depths (for sorting)
+static int compare_depth(const void* a, const void* b)
+{
+    int i1 = *(const int*)a;
+    int i2 = *(const int*)b;
+    float d1 = tbuffer[i1].depth;
+    float d2 = tbuffer[i2].depth;
+
+    if(d1 > d2) return -1;
+    if(d1 < d2) return 1;
+    return i1 - i2;
+}
+
+
 // Draw triangle buffer
 void draw_triangle_buffer()
 {
-    // Sort triangles by depth and draw
+    // Sort triangles by depth, far ones first. Equal depths
+    // keep the submission order
     int i = 0;
-    _TRIANGLE t;
-
     for(; i < tindex; ++ i)
     {
-        tdrawn[i] = false;
-        t = tbuffer[i];
+        torder[i] = i;
     }
+    qsort(torder,tindex,sizeof(int),compare_depth);
 
-    float maxDepth = 0.0f;
-    int drawIndex = 0;
-    int count = 0;
-
-    int minIndex = 0;
-    int maxIndex = tindex;
-
-    while(true)
+    _TRIANGLE t;
+    for(i = 0; i < tindex; ++ i)
     {
-        count = 0;
-        maxDepth = 0.0f;
-        for(int i = minIndex; i < maxIndex; ++ i)
-        {
-            t = tbuffer[i];
-            if(!tdrawn[i] && t.depth > maxDepth)
-            {
-                maxDepth = t.depth;
-                drawIndex = i;
-                count ++;
-            }
-        }
+        t = tbuffer[torder[i]];
 
-        if(count == 0)
+        darknessEnabled = t.darkness;
+        if(darknessEnabled)
         {
-            break;
+            vertexFog[0] = t.fogA;
+            vertexFog[1] = t.fogB;
+            vertexFog[2] = t.fogC;
         }
-        else
-        {
-            if(drawIndex == minIndex)
-                ++ minIndex;
-
-            if(drawIndex == maxIndex -1)
-                -- maxIndex;
-
-            t = tbuffer[drawIndex];
-
-            darknessEnabled = t.darkness;
-            if(darknessEnabled)
-            {
-                depthMin = minf(t.A.z,minf(t.B.z,t.C.z));
-                depthMax = maxf(t.A.z,maxf(t.B.z,t.C.z));
-                depthStep = fabs(depthMax - depthMin);
-                depthDirection = 1;
-
-                float miny = minf(t.A.y,minf(t.B.y,t.C.y));
-                if(fabs(miny-t.A.y) < 0.001f)
-                {
-                    depthDirection = (t.A.z <= depthMin) ? 1 : -1;        
-                }
-                else if(fabs(miny-t.B.y) < 0.001f)
-                {
-                    depthDirection = (t.B.z <= depthMin) ? 1 : -1;        
-                }
-                else if(fabs(miny-t.C.y) < 0.001f)
-                {
-                    depthDirection = (t.C.z <= depthMin) ? 1 : -1;   
-                }
-
-                depthStep *= depthDirection;
-            }
 
-            ppfunc = (lightEnabled || darknessEnabled) ? put_pixel_dark : put_pixel;
-            lightVal = calculate_ligthing_value(t.normal);
-            bind_texture(t.tex);
-            set_uv(t.tA.x,t.tA.y,t.tB.x,t.tB.y,t.tC.x,t.tC.y);
-            draw_triangle_float(t.A.x,t.A.y, t.B.x,t.B.y, t.C.x,t.C.y);
-
-            tdrawn[drawIndex] = true;
-        }
+        lightVal = t.light;
+        pixelMask = t.mask;
+        bind_texture(t.tex);
+        set_uv(t.tA.x,t.tA.y,t.tB.x,t.tB.y,t.tC.x,t.tC.y);
+        draw_triangle_float(t.A.x,t.A.y, t.B.x,t.B.y, t.C.x,t.C.y);
     }
     usedNormal = NULL;
     lightVal = 0;
+    pixelMask = DITHER_FULL;
     darknessEnabled = false;
-    ppfunc = put_pixel;
     
 }
 
@@ -1070,7 +1683,7 @@ void set_uv(float x1, float y1, float x2, float y2, float x3, float y3)
     float vx = (x3-x1);
     float vy = (y3-y1);
 
-    if(fabs(ux*vy - uy * vx) < DELTA)
+    if(fabsf(ux*vy - uy * vx) < DELTA)
     {
         uv1 = vec2(0.0f,0.0f);
         uv2 = vec2(0.0001f,0.0f);  
@@ -1079,27 +1692,329 @@ void set_uv(float x1, float y1, float x2, float y2, float x3, float y3)
 }
 
 
+// Update the cached light levels of a mesh. Only
+// valid for meshes that are not rotated
+static bool update_mesh_light(MESH* m)
+{
+    if(m->lightLevels != NULL && m->lightGen == lightGen)
+        return true;
+
+    if(m->lightLevels == NULL)
+    {
+        m->lightLevels = (Uint8*)malloc(sizeof(Uint8) * (m->elementCount/3));
+        if(m->lightLevels == NULL)
+            return false;
+    }
+
+    int i = 0;
+    float* n;
+    for(; i < m->elementCount; i += 3)
+    {
+        n = m->normals + m->indices[i]*3;
+        m->lightLevels[i/3] = (Uint8)light_value(vec3(n[0],n[1],n[2]));
+    }
+    m->lightGen = lightGen;
+
+    return true;
+}
+
+
+// Get the mesh bounding sphere after a transformation.
+// The radius is in x & y units, depth has the fov in it
+static void get_mesh_sphere(MESH* m, const float* mat, VEC3* c, float* r)
+{
+    VEC3 p = vec3((m->minV.x + m->maxV.x) / 2,(m->minV.y + m->maxV.y) / 2,
+        (m->minV.z + m->maxV.z) / 2);
+    c->x = mat[0]*p.x + mat[3]*p.y + mat[6]*p.z + mat[9];
+    c->y = mat[1]*p.x + mat[4]*p.y + mat[7]*p.z + mat[10];
+    c->z = mat[2]*p.x + mat[5]*p.y + mat[8]*p.z + mat[11];
+
+    // Largest scale of the model axes
+    float fov = tr_get_fov();
+    float s2 = 0.0f, l2;
+    int i = 0;
+    for(; i < 3; ++ i)
+    {
+        l2 = mat[i*3]*mat[i*3] + mat[i*3+1]*mat[i*3+1] + mat[i*3+2]*mat[i*3+2] / (fov*fov);
+        if(l2 > s2) s2 = l2;
+    }
+    *r = m->radius * sqrtf(s2);
+}
+
+
+// Pick a detail level from the projected size of the
+// mesh bounding sphere. Without the previous level
+// (negative) there is no hysteresis
+static int pick_mesh_lod(MESH* m, const float* mat, int prev)
+{
+    VEC3 c;
+    float r;
+    get_mesh_sphere(m,mat,&c,&r);
+    if(c.z <= nearPlane) return 0;
+
+    // Screen y spans from -1 to 1
+    float size = r / c.z * gframe->h / 2;
+
+    int level = 0;
+    float t = LOD_SIZE;
+    int i = 0;
+    for(; i < m->lodCount-1; ++ i, t /= 2)
+    {
+        if(prev < 0)
+        {
+            if(size < t) level = i+1;
+        }
+        else if(size < t * (i < prev ? 1.0f + LOD_HYSTERESIS : 1.0f - LOD_HYSTERESIS))
+        {
+            level = i+1;
+        }
+    }
+
+    return level;
+}
+
+
+// Is there room for a number of transformed vertices
+static bool reserve_tverts(Uint32 count)
+{
+    if(count > tvertCount)
+    {
+        float* p = (float*)realloc(tverts, sizeof(float) * count * 3);
+        if(p == NULL)
+        {
+            printf("Memory allocation error!\n");
+            return false;
+        }
+        tverts = p;
+        tvertCount = count;
+    }
+    return true;
+}
+
+
+// Push the triangles of a transformed mesh. Without a
+// rotation the current model rotation is used
+static void push_mesh(MESH* m, const float* tv, const TR_ROTATION* r, bool rotated)
+{
+    int i = 0;
+    const float* v;
+    float* uv;
+    float* n;
+    int light = 0;
+
+    // Light levels do not depend on the model position,
+    // so they can be cached if the model is not rotated
+    bool cached = lightEnabled && !rotated && update_mesh_light(m);
+
+    for(; i < m->elementCount; i += 3)
+    {
+        v = tv + m->indices[i]*3;
+        uv = m->uvs + m->indices[i]*2;
+
+        if(cached)
+        {
+            light = m->lightLevels[i/3];
+        }
+        else if(lightEnabled)
+        {
+            n = m->normals + m->indices[i]*3;
+            light = r == NULL ? calculate_ligthing_value(vec3(n[0],n[1],n[2]))
+                : light_value(tr_rotate_with(r,vec3(n[0],n[1],n[2])));
+        }
+
+        push_triangle(
+            vec3(v[0],v[1],v[2]), vec3(v[3],v[4],v[5]), vec3(v[6],v[7],v[8]),
+            vec2(uv[0],uv[1]), vec2(uv[2],uv[3]), vec2(uv[4],uv[5]),
+            light);
+    }
+}
+
+
+// Draw a mesh with a matrix
+static void draw_mesh_matrix(MESH* m, const float* mat)
+{
+    // Transform all the vertices at once
+    if(!reserve_tverts(m->elementCount))
+        return;
+    kr_transform(mat,m->vertices,tverts,m->elementCount);
+
+    push_mesh(m,tverts,NULL,tr_model_rotated());
+}
+
+
 // Draw mesh
 void draw_mesh(MESH* m)
 {
     if(m == NULL) return;
 
+    float mat[12];
+    tr_get_matrix(mat);
+
+    if(m->lodCount > 1)
+        m = mesh_get_lod(m,pick_mesh_lod(m,mat,-1));
+
+    draw_mesh_matrix(m,mat);
+}
+
+
+// Draw mesh with hysteresis
+void draw_mesh_lod(MESH* m, Uint8* level)
+{
+    if(m == NULL) return;
+
+    float mat[12];
+    tr_get_matrix(mat);
+
+    if(m->lodCount > 1)
+    {
+        *level = (Uint8)pick_mesh_lod(m,mat,*level);
+        m = mesh_get_lod(m,*level);
+    }
+
+    draw_mesh_matrix(m,mat);
+}
+
+
+// Instance job context
+typedef struct
+{
+    MESH* m;
+    const INSTANCE* inst;
+    float world[12];
+}
+INSTANCE_JOB;
+
+
+// Set up instances: matrix, culling & detail level
+static void instance_setup_job(int start, int end, void* user)
+{
+    INSTANCE_JOB* job = (INSTANCE_JOB*)user;
+    const INSTANCE* in;
+    TR_ROTATION r;
+    float* mat;
+    float ratio = (float)gframe->w / (float)gframe->h;
+    float fov = tr_get_fov();
+    VEC3 c;
+    float rad, dz;
+
+    int i = start;
+    for(; i < end; ++ i)
+    {
+        in = job->inst + i;
+        mat = instMats + i*12;
+        r = tr_get_rotation(in->angle);
+        tr_get_model_matrix(job->world,in->pos,&r,in->scale,mat);
+
+        // Cull the bounding sphere (as a box) against the
+        // near & far planes and the view sides
+        get_mesh_sphere(job->m,mat,&c,&rad);
+        dz = rad * fov;
+        if(c.z + dz < nearPlane || c.z - dz > farPlane
+        || c.x - rad > ratio * (c.z + dz) || c.x + rad < -ratio * (c.z + dz)
+        || c.y - rad > c.z + dz || c.y + rad < -(c.z + dz))
+        {
+            instLevels[i] = INSTANCE_CULLED;
+            continue;
+        }
+
+        instLevels[i] = 0;
+        if(job->m->lodCount > 1)
+        {
+            instLevels[i] = (Uint8)pick_mesh_lod(job->m,mat,in->lod != NULL ? *in->lod : -1);
+            if(in->lod != NULL)
+                *in->lod = instLevels[i];
+        }
+    }
+}
+
+
+// Transform instance vertices
+static void instance_transform_job(int start, int end, void* user)
+{
+    INSTANCE_JOB* job = (INSTANCE_JOB*)user;
+    MESH* lm;
+
+    int i = start;
+    for(; i < end; ++ i)
+    {
+        if(instLevels[i] == INSTANCE_CULLED) continue;
+
+        lm = mesh_get_lod(job->m,instLevels[i]);
+        kr_transform(instMats + i*12,lm->vertices,tverts + instStart[i]*3,lm->elementCount);
+    }
+}
+
+
+// Draw mesh instances
+void draw_mesh_instanced(MESH* m, BITMAP* tex, const INSTANCE* inst, int count)
+{
+    if(m == NULL || count <= 0) return;
+
+    // Grow the instance buffers
+    if(count > instCapacity)
+    {
+        float* mats = (float*)realloc(instMats,sizeof(float) * 12 * count);
+        if(mats == NULL)
+        {
+            printf("Memory allocation error!\n");
+            return;
+        }
+        instMats = mats;
+        Uint8* levels = (Uint8*)realloc(instLevels,sizeof(Uint8) * count);
+        if(levels == NULL)
+        {
+            printf("Memory allocation error!\n");
+            return;
+        }
+        instLevels = levels;
+        Uint32* starts = (Uint32*)realloc(instStart,sizeof(Uint32) * count);
+        if(starts == NULL)
+        {
+            printf("Memory allocation error!\n");
+            return;
+        }
+        instStart = starts;
+        instCapacity = count;
+    }
+
+    INSTANCE_JOB job;
+    job.m = m;
+    job.inst = inst;
+    tr_get_world_matrix(job.world);
+
+    wk_run(instance_setup_job,&job,count,INSTANCE_GRAIN);
+
+    // Room for the vertices of every instance drawn
+    Uint32 total = 0;
     int i = 0;
+    for(; i < count; ++ i)
+    {
+        instStart[i] = total;
+        if(instLevels[i] != INSTANCE_CULLED)
+            total += mesh_get_lod(m,instLevels[i])->elementCount;
+    }
+    if(total == 0 || !reserve_tverts(total))
+        return;
 
-    for(; i < m->elementCount; i += 3)
+    wk_run(instance_transform_job,&job,count,INSTANCE_GRAIN);
+
+    // The triangle buffer is not shared, so the pushing
+    // happens here
+    BITMAP* oldTex = gtex;
+    TR_ROTATION r;
+    bool rotated;
+    for(i = 0; i < count; ++ i)
     {
-        draw_triangle_3d(
-            vec3(m->vertices[m->indices[i]*3],m->vertices[m->indices[i]*3 +1],m->vertices[m->indices[i]*3+2]),
-            vec3(m->vertices[m->indices[i]*3 +3],m->vertices[m->indices[i]*3 +4],m->vertices[m->indices[i]*3+5]),
-            vec3(m->vertices[m->indices[i]*3 +6],m->vertices[m->indices[i]*3 +7],m->vertices[m->indices[i]*3+8]),
+        if(instLevels[i] == INSTANCE_CULLED) continue;
 
-            vec2(m->uvs[m->indices[i]*2],m->uvs[m->indices[i]*2 +1]),
-            vec2(m->uvs[m->indices[i]*2 + 2],m->uvs[m->indices[i]*2 +3]),
-            vec2(m->uvs[m->indices[i]*2 + 4],m->uvs[m->indices[i]*2 + 5]),
+        gtex = inst[i].tex != NULL ? inst[i].tex : tex;
+        rotated = inst[i].angle.x != 0.0f || inst[i].angle.y != 0.0f || inst[i].angle.z != 0.0f;
+        if(lightEnabled)
+            r = tr_get_rotation(inst[i].angle);
 
-            vec3(m->normals[m->indices[i]*3],m->normals[m->indices[i]*3 +1],m->normals[m->indices[i]*3+2])
-        );
+        push_mesh(mesh_get_lod(m,instLevels[i]),tverts + instStart[i]*3,&r,rotated);
     }
+    gtex = oldTex;
 }
 
 
@@ -1113,11 +2028,34 @@ void toggle_lighting(bool state)
 /// Set lighting
 void set_ligthing(VEC3 dir, float mag)
 {
+    if(dir.x != lightDir.x || dir.y != lightDir.y || dir.z != lightDir.z || mag != lightMag)
+        ++ lightGen;
+
     lightDir = dir;
     lightMag = mag;
 }
 
 
+// Get a screen-door mask
+Uint8 get_dither_mask(int coverage)
+{
+    // Pixels in the order they are added: the diagonals
+    // first, so half coverage is a checkerboard
+    const Uint8 MASKS[5] = {0x0, 0x1, 0x9, 0xB, 0xF};
+
+    if(coverage <= 0) return MASKS[0];
+    if(coverage >= 4) return MASKS[4];
+    return MASKS[coverage];
+}
+
+
+// Set screen-door mask
+void set_dither_mask(Uint8 mask)
+{
+    pushMask = mask;
+}
+
+
 // Toggle darkness
 void toggle_darkness(bool state)
 {
@@ -1129,6 +2067,8 @@ void set_darkness(float min, float max)
 {
     darkBegin = min;
     darkEnd = max;
+
+    gen_fog_table();
 }
 
 
@@ -1140,15 +2080,25 @@ void set_near_far_planes(float near, float far)
 }
 
 
+// Get near plane
+float get_near_plane()
+{
+    return nearPlane;
+}
+
+
+// Get far plane
+float get_far_plane()
+{
+    return farPlane;
+}
+
+
 // Darken the active frame
 void darken_frame(int amount)
 {
     if(amount <= 0) return;
     if(amount >= MAX_DARKNESS_VALUE) amount = MAX_DARKNESS_VALUE-1;
 
-    int i = 0;
-    for(; i < gframe->w*gframe->h; ++ i)
-    {
-        gframe->colorData[i] = lpalettes[amount][gframe->colorData[i]];
-    }
+    kr_darken(gframe->colorData,gframe->w*gframe->h,amount);
 }
\ No newline at end of file
@@ -23,6 +23,26 @@ enum
     FLIP_BOTH = 3,
 };
 
+/// Affine layer parameters. Maps screen coordinates
+/// to texture coordinates:
+/// u = a*(x-cx) + b*(y-cy) + tx
+/// v = c*(x-cx) + d*(y-cy) + ty
+typedef struct
+{
+    float a, b; /// First row of the inverse matrix
+    float c, d; /// Second row of the inverse matrix
+    float tx, ty; /// Texture translation
+    float cx, cy; /// Screen-space origin
+}
+AFFINE_PARAMS;
+
+/// Scanline callback for affine layers. Can modify the
+/// parameters per row (perspective floors, skies etc)
+/// < y Screen row
+/// < p Parameters to modify
+/// < user User data
+typedef void (*AFFINE_LINE_FUNC) (int y, AFFINE_PARAMS* p, void* user);
+
 /// Initialize graphics
 void init_graphics();
 
@@ -82,6 +102,26 @@ void draw_inverted_bitmap(BITMAP* b, int dx, int dy, int flip);
 /// < angle Rotation angle
 void draw_rotated_bitmap_area(BITMAP* b, float trx, float _try, int skip, float angle);
 
+/// Draw an affine-transformed, wrapping bitmap layer
+/// over the whole frame
+/// < b Bitmap to be drawn
+/// < p Parameters
+/// < line Scanline callback, NULL if not used
+/// < user User data passed to the callback
+/// < skip Skipping value
+void draw_affine_layer(BITMAP* b, AFFINE_PARAMS p, AFFINE_LINE_FUNC line, void* user, int skip);
+
+/// Draw a range of rows of an affine layer. Rows
+/// are independent, so ranges can be drawn in parallel
+/// < b Bitmap to be drawn
+/// < p Parameters
+/// < line Scanline callback, NULL if not used
+/// < user User data passed to the callback
+/// < skip Skipping value
+/// < y0 First row
+/// < y1 Last row (exclusive)
+void draw_affine_layer_rows(BITMAP* b, AFFINE_PARAMS p, AFFINE_LINE_FUNC line, void* user, int skip, int y0, int y1);
+
 /// Draw a bitmap region
 /// < b Bitmap to be drawn
 /// < sx Source X
@@ -215,10 +255,40 @@ void bind_texture(BITMAP* tex);
 /// < y3 Y coordinate 3
 void set_uv(float x1, float y1, float x2, float y2, float x3, float y3);
 
-/// Draw mesh
+/// Draw mesh. A mesh with detail levels is drawn at the
+/// level that fits its projected size
 /// < m Mesh to drawW
 void draw_mesh(MESH* m);
 
+/// Draw mesh, choosing the detail level with hysteresis,
+/// so an object near a level switch does not flicker
+/// between the levels
+/// < m Mesh to draw
+/// < level Level of the object last time, updated
+void draw_mesh_lod(MESH* m, Uint8* level);
+
+/// Mesh instance
+typedef struct
+{
+    VEC3 pos; /// Model translation
+    VEC3 angle; /// Model angles (as in tr_rotate_model)
+    VEC3 scale; /// Model scale
+    BITMAP* tex; /// Texture, NULL for the shared one
+    Uint8* lod; /// Detail level state (see draw_mesh_lod), may be NULL
+}
+INSTANCE;
+
+/// Draw many copies of a mesh. Uses the current world
+/// transformation, the model one is ignored. Instances
+/// are set up & transformed on the worker pool, and their
+/// triangles pushed in order. Instances out of the view
+/// are skipped
+/// < m Mesh
+/// < tex Shared texture
+/// < inst Instances
+/// < count Instance count
+void draw_mesh_instanced(MESH* m, BITMAP* tex, const INSTANCE* inst, int count);
+
 /// Toggle lighting
 /// < state On/off state
 void toggle_lighting(bool state);
@@ -228,6 +298,22 @@ void toggle_lighting(bool state);
 /// < mag Magnitude
 void set_ligthing(VEC3 dir, float mag);
 
+/// Screen-door mask that draws every pixel
+#define DITHER_FULL 0xF
+
+/// Get a screen-door mask that draws a part of the pixels.
+/// A mask with more coverage draws the pixels of the ones
+/// with less, and ~mask & DITHER_FULL draws the rest
+/// < coverage Pixels drawn in every 2x2 block (0-4)
+/// > Mask
+Uint8 get_dither_mask(int coverage);
+
+/// Set the screen-door mask of the triangles pushed from
+/// now on. Bit (y%2)*2 + x%2 tells if a pixel of a 2x2
+/// block is drawn
+/// < mask Mask, DITHER_FULL for every pixel
+void set_dither_mask(Uint8 mask);
+
 /// Toggle darkness
 /// < state On/off state
 void toggle_darkness(bool state);
@@ -242,6 +328,14 @@ void set_darkness(float min, float max);
 /// < far Far
 void set_near_far_planes(float near, float far);
 
+/// Get near plane
+/// > Near plane
+float get_near_plane();
+
+/// Get far plane
+/// > Far plane
+float get_far_plane();
+
 /// Darken the active frame
 /// < amount Amount 
 void darken_frame(int amount);
@@ -0,0 +1,168 @@
+/// Uniform grid, hashed (source)
+/// (c) 2018 Jani Nykänen
+
+#include "grid.h"
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "math.h"
+
+/// Minimum hash table size
+#define GRID_MIN_TABLE 16
+
+
+// Hash a cell
+static Uint32 hash_cell(GRID* g, int x, int y, int z)
+{
+    return ((Uint32)x*73856093u ^ (Uint32)y*19349663u ^ (Uint32)z*83492791u)
+        & (g->tableSize-1);
+}
+
+
+// Cell coordinate
+static int cell_of(GRID* g, float v)
+{
+    return (int)floorf(v * g->invCell);
+}
+
+
+// Create a grid
+GRID* grid_create(float cellSize)
+{
+    GRID* g = (GRID*)malloc(sizeof(GRID));
+    if(g == NULL)
+    {
+        printf("Memory allocation error!\n");
+        return NULL;
+    }
+
+    g->cellSize = cellSize;
+    g->invCell = 1.0f / cellSize;
+    g->start = NULL;
+    g->tableSize = 0;
+    g->items = NULL;
+    g->hashes = NULL;
+    g->capacity = 0;
+    g->count = 0;
+
+    return g;
+}
+
+
+// Build the grid
+int grid_build(GRID* g, const float* x, const float* y, const float* z, Uint32 count)
+{
+    // Grow
+    if(count > g->capacity)
+    {
+        Uint32 cap = g->capacity == 0 ? GRID_MIN_TABLE : g->capacity;
+        while(cap < count) cap *= 2;
+
+        Uint32* items = (Uint32*)realloc(g->items,sizeof(Uint32) * cap);
+        if(items == NULL)
+        {
+            printf("Memory allocation error!\n");
+            return 1;
+        }
+        g->items = items;
+
+        Uint32* hashes = (Uint32*)realloc(g->hashes,sizeof(Uint32) * cap);
+        if(hashes == NULL)
+        {
+            printf("Memory allocation error!\n");
+            return 1;
+        }
+        g->hashes = hashes;
+
+        Uint32* start = (Uint32*)realloc(g->start,sizeof(Uint32) * (cap*2 +1));
+        if(start == NULL)
+        {
+            printf("Memory allocation error!\n");
+            return 1;
+        }
+        g->start = start;
+
+        g->capacity = cap;
+    }
+
+    g->count = count;
+    g->tableSize = GRID_MIN_TABLE;
+    while(g->tableSize < count*2) g->tableSize *= 2;
+
+    // Count points per bucket
+    memset(g->start,0,sizeof(Uint32) * (g->tableSize+1));
+    Uint32 i = 0;
+    Uint32 h;
+    for(; i < count; ++ i)
+    {
+        h = hash_cell(g,cell_of(g,x[i]),cell_of(g,y[i]),cell_of(g,z[i]));
+        g->hashes[i] = h;
+        ++ g->start[h];
+    }
+
+    // Bucket ends, then fill backwards so they become starts
+    for(i = 1; i < g->tableSize; ++ i)
+    {
+        g->start[i] += g->start[i-1];
+    }
+    g->start[g->tableSize] = count;
+
+    for(i = count; i > 0; -- i)
+    {
+        g->items[-- g->start[g->hashes[i-1]]] = i-1;
+    }
+
+    return 0;
+}
+
+
+// Query
+void grid_query(GRID* g, float x, float y, float z, GRID_FUNC f, void* user)
+{
+    if(g->count == 0) return;
+
+    int cx = cell_of(g,x);
+    int cy = cell_of(g,y);
+    int cz = cell_of(g,z);
+
+    // Hashes already visited, neighbour cells may share one
+    Uint32 seen[27];
+    int seenCount = 0;
+
+    Uint32 h, k;
+    int dx, dy, dz, s;
+    for(dz = -1; dz <= 1; ++ dz)
+    {
+        for(dy = -1; dy <= 1; ++ dy)
+        {
+            for(dx = -1; dx <= 1; ++ dx)
+            {
+                h = hash_cell(g,cx+dx,cy+dy,cz+dz);
+                for(s = 0; s < seenCount; ++ s)
+                {
+                    if(seen[s] == h) break;
+                }
+                if(s < seenCount) continue;
+                seen[seenCount ++] = h;
+
+                for(k = g->start[h]; k < g->start[h+1]; ++ k)
+                {
+                    f(g->items[k],user);
+                }
+            }
+        }
+    }
+}
+
+
+// Destroy a grid
+void grid_destroy(GRID* g)
+{
+    if(g == NULL) return;
+
+    free(g->start);
+    free(g->items);
+    free(g->hashes);
+    free(g);
+}
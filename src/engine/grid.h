@@ -0,0 +1,60 @@
+/// Uniform grid, hashed (header)
+/// (c) 2018 Jani Nykänen
+
+#ifndef __GRID__
+#define __GRID__
+
+#include "SDL2/SDL.h"
+
+/// Grid type. Points are bucketed by cell, cells are
+/// hashed into a table twice the size of the point count
+typedef struct
+{
+    float cellSize;
+    float invCell;
+
+    Uint32* start; /// Bucket start indices (tableSize+1)
+    Uint32 tableSize;
+    Uint32* items; /// Point indices, ordered by bucket
+    Uint32* hashes; /// Bucket per point
+    Uint32 capacity;
+    Uint32 count;
+}
+GRID;
+
+/// Point callback
+/// < index Point index
+/// < user User data
+typedef void (*GRID_FUNC) (Uint32 index, void* user);
+
+/// Create a grid
+/// < cellSize Cell size. Should be at least the largest
+///   query distance
+/// > A new grid
+GRID* grid_create(float cellSize);
+
+/// Rebuild the grid from points
+/// < g Grid
+/// < x X coordinates
+/// < y Y coordinates
+/// < z Z coordinates
+/// < count Point count
+/// > 0 on success, 1 on memory error
+int grid_build(GRID* g, const float* x, const float* y, const float* z, Uint32 count);
+
+/// Call a function for the points in the cells around a
+/// point. Includes every point within cellSize, and some
+/// that are further away
+/// < g Grid
+/// < x X coordinate
+/// < y Y coordinate
+/// < z Z coordinate
+/// < f Callback
+/// < user User data passed to the callback
+void grid_query(GRID* g, float x, float y, float z, GRID_FUNC f, void* user);
+
+/// Destroy a grid
+/// < g Grid
+void grid_destroy(GRID* g);
+
+#endif // __GRID__
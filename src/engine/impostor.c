@@ -0,0 +1,176 @@
+/// Impostor (source)
+/// (c) 2018 Jani Nykänen
+
+#include "impostor.h"
+
+#include "graphics.h"
+#include "transform.h"
+#include "mathext.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+
+// Camera distance, in picture extents. The pictures are
+// taken from far away with a narrow view, so they are
+// nearly orthographic
+#define IMP_DISTANCE 100.0f
+
+
+// Take a picture of a mesh from an angle
+static int take_picture(IMPOSTOR* imp, MESH* m, BITMAP* tex, int k, int size)
+{
+    BITMAP* b = create_bitmap(size,size,get_alpha());
+    if(b == NULL)
+    {
+        printf("Memory allocation error!\n");
+        return 1;
+    }
+    imp->views[k] = b;
+
+    FRAME fr;
+    fr.w = size;
+    fr.h = size;
+    fr.colorData = b->data;
+    fr.size = size*size;
+    fr.depth = NULL;
+    fr.data = NULL;
+    fr.tex = NULL;
+    bind_frame(&fr);
+
+    // Look at the center from the view angle, the same
+    // way the camera does
+    float angle = 2.0f * (float)M_PI * k / imp->viewCount;
+    float s, c;
+    fast_sincos(angle,&s,&c);
+    float dist = imp->extent * IMP_DISTANCE;
+
+    clear_triangle_buffer();
+    tr_identity();
+    tr_translate(-(imp->center.x - s*dist),-imp->center.y,-(imp->center.z - c*dist));
+    tr_rotate_world(angle,0.0f);
+
+    bind_texture(tex);
+    draw_mesh(m);
+    draw_triangle_buffer();
+    clear_triangle_buffer();
+
+    if(bmp_gen_spans(b) == 1 || bmp_make_texture(b) == 1)
+    {
+        printf("Memory allocation error!\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+// Create an impostor
+IMPOSTOR* imp_create(MESH* m, BITMAP* tex, int views, int size)
+{
+    if(m == NULL || size < 4 || (size & (size-1)) != 0)
+    {
+        printf("Bad impostor settings!\n");
+        return NULL;
+    }
+    if(views < 1) views = 1;
+    if(views > IMP_MAX_VIEWS) views = IMP_MAX_VIEWS;
+
+    IMPOSTOR* imp = (IMPOSTOR*)malloc(sizeof(IMPOSTOR));
+    if(imp == NULL)
+    {
+        printf("Memory allocation error!\n");
+        return NULL;
+    }
+    memset(imp,0,sizeof(IMPOSTOR));
+
+    // The bounding sphere fits in every picture
+    imp->viewCount = views;
+    imp->center = vec3((m->minV.x + m->maxV.x) / 2,(m->minV.y + m->maxV.y) / 2,
+        (m->minV.z + m->maxV.z) / 2);
+    imp->extent = m->radius > 0.0f ? m->radius : 1.0f;
+
+    // The extent fills the picture, so its depth after the
+    // fov is the extent itself
+    FRAME* oldFrame = get_current_frame();
+    float oldFov = tr_get_fov();
+    float oldNear = get_near_plane();
+    float oldFar = get_far_plane();
+
+    tr_set_fov(1.0f / IMP_DISTANCE);
+    set_near_far_planes(imp->extent*0.5f,imp->extent*2.0f);
+    toggle_darkness(false);
+    toggle_lighting(false);
+    set_dither_mask(DITHER_FULL);
+
+    int k = 0;
+    int err = 0;
+    for(; k < views && err == 0; ++ k)
+    {
+        err = take_picture(imp,m,tex,k,size);
+    }
+
+    bind_frame(oldFrame);
+    tr_set_fov(oldFov);
+    set_near_far_planes(oldNear,oldFar);
+    tr_identity();
+
+    if(err != 0)
+    {
+        imp_destroy(imp);
+        return NULL;
+    }
+
+    return imp;
+}
+
+
+// Draw an impostor
+void imp_draw(IMPOSTOR* imp, VEC3 pos, VEC3 scale, VEC2 eye, VEC2 right)
+{
+    VEC3 c = vec3(pos.x + imp->center.x*scale.x,pos.y + imp->center.y*scale.y,
+        pos.z + imp->center.z*scale.z);
+
+    // Picture taken closest to the direction from the eye
+    float angle = fast_atan2(c.x - eye.x,c.z - eye.y);
+    int k = (int)floorf(angle / (2.0f * (float)M_PI) * imp->viewCount + 0.5f) % imp->viewCount;
+    if(k < 0) k += imp->viewCount;
+
+    // The quad is parallel to the screen, so its corners
+    // have the same depth and the affine texture mapping
+    // does not bend it
+    float hw = imp->extent * scale.x;
+    float hh = imp->extent * scale.y;
+
+    VEC3 a = vec3(c.x - right.x*hw,c.y - hh,c.z - right.y*hw);
+    VEC3 b = vec3(c.x + right.x*hw,c.y - hh,c.z + right.y*hw);
+    VEC3 e = vec3(c.x + right.x*hw,c.y + hh,c.z + right.y*hw);
+    VEC3 f = vec3(c.x - right.x*hw,c.y + hh,c.z - right.y*hw);
+
+    // Sample texel centers at the edges
+    float t0 = 0.5f / imp->views[k]->w;
+    float t1 = 1.0f - t0;
+
+    tr_translate_model(0.0f,0.0f,0.0f);
+    tr_rotate_model(0.0f,0.0f,0.0f);
+    tr_scale_model(1.0f,1.0f,1.0f);
+
+    bind_texture(imp->views[k]);
+    draw_triangle_3d(a,b,e,vec2(t0,t0),vec2(t1,t0),vec2(t1,t1),vec3(0,0,1));
+    draw_triangle_3d(e,f,a,vec2(t1,t1),vec2(t0,t1),vec2(t0,t0),vec3(0,0,1));
+}
+
+
+// Destroy an impostor
+void imp_destroy(IMPOSTOR* imp)
+{
+    if(imp == NULL) return;
+
+    int i = 0;
+    for(; i < imp->viewCount; ++ i)
+    {
+        destroy_bitmap(imp->views[i]);
+    }
+    free(imp);
+}
@@ -0,0 +1,48 @@
+/// Impostor (header)
+/// (c) 2018 Jani Nykänen
+
+#ifndef __IMPOSTOR__
+#define __IMPOSTOR__
+
+#include "bitmap.h"
+#include "mesh.h"
+#include "vector.h"
+
+/// Maximum view count
+#define IMP_MAX_VIEWS 16
+
+/// Impostor, pictures of a mesh taken from around it. Drawn
+/// in place of the mesh far away
+typedef struct
+{
+    BITMAP* views[IMP_MAX_VIEWS]; /// View k is taken from angle 2*pi*k/viewCount
+    int viewCount;
+    VEC3 center; /// Center of the pictures, mesh space
+    float extent; /// Half size of the pictures, mesh space
+}
+IMPOSTOR;
+
+/// Create an impostor by drawing a mesh from around it.
+/// Uses the triangle buffer, so call when nothing is
+/// waiting in it. Turns the darkness and lighting off
+/// < m Mesh
+/// < tex Mesh texture
+/// < views View count, around the y axis
+/// < size Picture size, a power of two
+/// > A new impostor, NULL on error
+IMPOSTOR* imp_create(MESH* m, BITMAP* tex, int views, int size);
+
+/// Draw an impostor, a quad parallel to the screen with
+/// the picture taken closest to the eye direction
+/// < imp Impostor
+/// < pos Model translation of the mesh
+/// < scale Model scale of the mesh, x and z should be equal
+/// < eye Eye position on XZ
+/// < right Camera right vector on XZ, unit length
+void imp_draw(IMPOSTOR* imp, VEC3 pos, VEC3 scale, VEC2 eye, VEC2 right);
+
+/// Destroy an impostor
+/// < imp Impostor
+void imp_destroy(IMPOSTOR* imp);
+
+#endif // __IMPOSTOR__
@@ -0,0 +1,548 @@
+/// Kernels (source)
+/// (c) 2018 Jani Nykänen
+
+#include "kernels.h"
+
+#include "stdio.h"
+#include "string.h"
+#include "stdbool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KR_X86
+#include "immintrin.h"
+#endif
+
+/// Kernel table
+typedef struct
+{
+    const char* name;
+    void (*expand) (const Uint8* in, Uint8* out, int count);
+    void (*darken) (Uint8* data, int count, int amount);
+    void (*quantize) (const Uint8* in, Uint8* out, int count, Uint8 alpha);
+    void (*transform) (const float* m, const float* in, float* out, int count);
+}
+_KERNELS;
+
+/// Expansion lookup, bytes in memory order
+static Uint32 expandLUT[256];
+/// Red, green and blue channels per component value
+static Uint8 redTable[16] __attribute__((aligned(16)));
+static Uint8 greenTable[16] __attribute__((aligned(16)));
+static Uint8 blueTable[16] __attribute__((aligned(16)));
+
+
+/// Expand, scalar
+static void expand_scalar(const Uint8* in, Uint8* out, int count)
+{
+    Uint32* o = (Uint32*)out;
+    int i = 0;
+    for(; i < count; ++ i)
+    {
+        o[i] = expandLUT[in[i]];
+    }
+}
+
+/// Darken, scalar
+static void darken_scalar(Uint8* data, int count, int amount)
+{
+    // Generate a lookup for this amount
+    Uint8 lut[256];
+    int i = 0;
+    int r, g, b;
+    for(; i < 256; ++ i)
+    {
+        r = (i >> 5) - amount; if(r < 0) r = 0;
+        g = ((i >> 2) & 7) - amount; if(g < 0) g = 0;
+        b = (i & 3) - amount/2; if(b < 0) b = 0;
+
+        lut[i] = (r << 5) | (g << 2) | b;
+    }
+
+    for(i = 0; i < count; ++ i)
+    {
+        data[i] = lut[data[i]];
+    }
+}
+
+/// Quantize, scalar
+static void quantize_scalar(const Uint8* in, Uint8* out, int count, Uint8 alpha)
+{
+    int i = 0;
+    Uint8 er, eg, eb;
+    for(; i < count; ++ i)
+    {
+        if(in[i*4 +3] < 255)
+        {
+            out[i] = alpha;
+            continue;
+        }
+
+        er = (Uint8) (in[i*4 +2] / 36.428f);
+        eg = (Uint8) (in[i*4 +1] / 36.428f);
+        eb = in[i*4] / 85;
+
+        out[i] = (er << 5) | (eg << 2) | eb;
+    }
+}
+
+/// Transform, scalar
+static void transform_scalar(const float* m, const float* in, float* out, int count)
+{
+    int i = 0;
+    float x, y, z;
+    for(; i < count; ++ i)
+    {
+        x = in[i*3]; y = in[i*3 +1]; z = in[i*3 +2];
+
+        out[i*3] = m[0]*x + m[3]*y + m[6]*z + m[9];
+        out[i*3 +1] = m[1]*x + m[4]*y + m[7]*z + m[10];
+        out[i*3 +2] = m[2]*x + m[5]*y + m[8]*z + m[11];
+    }
+}
+
+
+#ifdef KR_X86
+
+/// Expand, SSE2. No byte shuffles, so the lookup is
+/// read four pixels at a time
+__attribute__((target("sse2")))
+static void expand_sse2(const Uint8* in, Uint8* out, int count)
+{
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        _mm_storeu_si128((__m128i*)(out + i*4), _mm_set_epi32(
+            expandLUT[in[i+3]], expandLUT[in[i+2]],
+            expandLUT[in[i+1]], expandLUT[in[i]]));
+    }
+    expand_scalar(in + i, out + i*4, count - i);
+}
+
+/// Darken, SSE2. Channels are separated with shifts and
+/// masks and darkened with a saturating subtraction
+__attribute__((target("sse2")))
+static void darken_sse2(Uint8* data, int count, int amount)
+{
+    const __m128i m7 = _mm_set1_epi8(7);
+    const __m128i m3 = _mm_set1_epi8(3);
+    const __m128i a = _mm_set1_epi8(amount);
+    const __m128i ab = _mm_set1_epi8(amount/2);
+
+    __m128i x, r, g, b;
+    int i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        x = _mm_loadu_si128((__m128i*)(data + i));
+
+        r = _mm_and_si128(_mm_srli_epi16(x,5), m7);
+        g = _mm_and_si128(_mm_srli_epi16(x,2), m7);
+        b = _mm_and_si128(x, m3);
+
+        r = _mm_subs_epu8(r, a);
+        g = _mm_subs_epu8(g, a);
+        b = _mm_subs_epu8(b, ab);
+
+        x = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(r,5), _mm_slli_epi16(g,2)), b);
+        _mm_storeu_si128((__m128i*)(data + i), x);
+    }
+    darken_scalar(data + i, count - i, amount);
+}
+
+/// Quantize four pixels, SSE2. Divisions by 36.428 and 85
+/// are done with 16-bit multiplications that give the same
+/// results for all 8-bit inputs
+__attribute__((target("sse2")))
+static inline __m128i quantize4_sse2(const Uint8* in, __m128i alpha)
+{
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    const __m128i kr = _mm_set1_epi32(1800);
+    const __m128i kb = _mm_set1_epi32(772);
+
+    __m128i p = _mm_loadu_si128((__m128i*)in);
+    __m128i er = _mm_mulhi_epu16(_mm_and_si128(_mm_srli_epi32(p,16),mask), kr);
+    __m128i eg = _mm_mulhi_epu16(_mm_and_si128(_mm_srli_epi32(p,8),mask), kr);
+    __m128i eb = _mm_mulhi_epu16(_mm_and_si128(p,mask), kb);
+    __m128i opaque = _mm_cmpeq_epi32(_mm_srli_epi32(p,24), mask);
+
+    __m128i idx = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(er,5), _mm_slli_epi32(eg,2)), eb);
+    return _mm_or_si128(_mm_and_si128(opaque,idx), _mm_andnot_si128(opaque,alpha));
+}
+
+/// Quantize, SSE2
+__attribute__((target("sse2")))
+static void quantize_sse2(const Uint8* in, Uint8* out, int count, Uint8 alpha)
+{
+    const __m128i av = _mm_set1_epi32(alpha);
+
+    __m128i a, b, c, d;
+    int i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        a = quantize4_sse2(in + i*4, av);
+        b = quantize4_sse2(in + i*4 + 16, av);
+        c = quantize4_sse2(in + i*4 + 32, av);
+        d = quantize4_sse2(in + i*4 + 48, av);
+
+        _mm_storeu_si128((__m128i*)(out + i),
+            _mm_packus_epi16(_mm_packs_epi32(a,b), _mm_packs_epi32(c,d)));
+    }
+    quantize_scalar(in + i*4, out + i, count - i, alpha);
+}
+
+/// Transform, SSE2. The last point is done separately
+/// since every store writes four floats
+__attribute__((target("sse2")))
+static void transform_sse2(const float* m, const float* in, float* out, int count)
+{
+    const __m128 c0 = _mm_set_ps(0.0f, m[2], m[1], m[0]);
+    const __m128 c1 = _mm_set_ps(0.0f, m[5], m[4], m[3]);
+    const __m128 c2 = _mm_set_ps(0.0f, m[8], m[7], m[6]);
+    const __m128 c3 = _mm_set_ps(0.0f, m[11], m[10], m[9]);
+
+    __m128 p;
+    int i = 0;
+    for(; i + 1 < count; ++ i)
+    {
+        p = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(c0,_mm_set1_ps(in[i*3])), _mm_mul_ps(c1,_mm_set1_ps(in[i*3 +1]))),
+            _mm_add_ps(_mm_mul_ps(c2,_mm_set1_ps(in[i*3 +2])), c3));
+        _mm_storeu_ps(out + i*3, p);
+    }
+    transform_scalar(m, in + i*3, out + i*3, count - i);
+}
+
+/// Expand, SSSE3. Channels of 16 pixels are looked up at
+/// once with byte shuffles, then interleaved
+__attribute__((target("ssse3")))
+static void expand_ssse3(const Uint8* in, Uint8* out, int count)
+{
+    const __m128i rt = _mm_load_si128((__m128i*)redTable);
+    const __m128i gt = _mm_load_si128((__m128i*)greenTable);
+    const __m128i bt = _mm_load_si128((__m128i*)blueTable);
+    const __m128i m7 = _mm_set1_epi8(7);
+    const __m128i m3 = _mm_set1_epi8(3);
+    const __m128i ff = _mm_set1_epi8((char)0xFF);
+
+    __m128i x, r, g, b, fr, gb;
+    int i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        x = _mm_loadu_si128((__m128i*)(in + i));
+
+        r = _mm_shuffle_epi8(rt, _mm_and_si128(_mm_srli_epi16(x,5), m7));
+        g = _mm_shuffle_epi8(gt, _mm_and_si128(_mm_srli_epi16(x,2), m7));
+        b = _mm_shuffle_epi8(bt, _mm_and_si128(x, m3));
+
+        fr = _mm_unpacklo_epi8(ff, r);
+        gb = _mm_unpacklo_epi8(g, b);
+        _mm_storeu_si128((__m128i*)(out + i*4), _mm_unpacklo_epi16(fr,gb));
+        _mm_storeu_si128((__m128i*)(out + i*4 + 16), _mm_unpackhi_epi16(fr,gb));
+
+        fr = _mm_unpackhi_epi8(ff, r);
+        gb = _mm_unpackhi_epi8(g, b);
+        _mm_storeu_si128((__m128i*)(out + i*4 + 32), _mm_unpacklo_epi16(fr,gb));
+        _mm_storeu_si128((__m128i*)(out + i*4 + 48), _mm_unpackhi_epi16(fr,gb));
+    }
+    expand_scalar(in + i, out + i*4, count - i);
+}
+
+/// Quantize, SSE4.1. Channels of 16 pixels are gathered
+/// with byte shuffles and divided in 16-bit lanes
+__attribute__((target("sse4.1")))
+static void quantize_sse41(const Uint8* in, Uint8* out, int count, Uint8 alpha)
+{
+    // Groups the channels of four pixels: b0-3, g0-3, r0-3, a0-3
+    const __m128i shuf = _mm_setr_epi8(0,4,8,12, 1,5,9,13, 2,6,10,14, 3,7,11,15);
+    const __m128i kr = _mm_set1_epi16(1800);
+    const __m128i kb = _mm_set1_epi16(772);
+    const __m128i av = _mm_set1_epi8(alpha);
+    const __m128i ff = _mm_set1_epi8((char)0xFF);
+
+    __m128i p0, p1, p2, p3, t0, t1, t2, t3;
+    __m128i b, g, r, a, lo, hi, idx, opaque;
+    int i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        p0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(in + i*4)), shuf);
+        p1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(in + i*4 + 16)), shuf);
+        p2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(in + i*4 + 32)), shuf);
+        p3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(in + i*4 + 48)), shuf);
+
+        // Transpose 4x4 dwords so that each register
+        // holds one channel of all 16 pixels
+        t0 = _mm_unpacklo_epi32(p0,p1);
+        t1 = _mm_unpacklo_epi32(p2,p3);
+        t2 = _mm_unpackhi_epi32(p0,p1);
+        t3 = _mm_unpackhi_epi32(p2,p3);
+        b = _mm_unpacklo_epi64(t0,t1);
+        g = _mm_unpackhi_epi64(t0,t1);
+        r = _mm_unpacklo_epi64(t2,t3);
+        a = _mm_unpackhi_epi64(t2,t3);
+
+        // Red and green
+        lo = _mm_mulhi_epu16(_mm_cvtepu8_epi16(r), kr);
+        hi = _mm_mulhi_epu16(_mm_cvtepu8_epi16(_mm_srli_si128(r,8)), kr);
+        idx = _mm_slli_epi16(_mm_packus_epi16(lo,hi), 5);
+
+        lo = _mm_mulhi_epu16(_mm_cvtepu8_epi16(g), kr);
+        hi = _mm_mulhi_epu16(_mm_cvtepu8_epi16(_mm_srli_si128(g,8)), kr);
+        idx = _mm_or_si128(idx, _mm_slli_epi16(_mm_packus_epi16(lo,hi), 2));
+
+        // Blue
+        lo = _mm_mulhi_epu16(_mm_cvtepu8_epi16(b), kb);
+        hi = _mm_mulhi_epu16(_mm_cvtepu8_epi16(_mm_srli_si128(b,8)), kb);
+        idx = _mm_or_si128(idx, _mm_packus_epi16(lo,hi));
+
+        opaque = _mm_cmpeq_epi8(a, ff);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_blendv_epi8(av, idx, opaque));
+    }
+    quantize_scalar(in + i*4, out + i, count - i, alpha);
+}
+
+/// Expand, AVX2. Same as the SSSE3 version, but lanes
+/// need to be put back in order at the end
+__attribute__((target("avx2")))
+static void expand_avx2(const Uint8* in, Uint8* out, int count)
+{
+    const __m256i rt = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i*)redTable));
+    const __m256i gt = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i*)greenTable));
+    const __m256i bt = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i*)blueTable));
+    const __m256i m7 = _mm256_set1_epi8(7);
+    const __m256i m3 = _mm256_set1_epi8(3);
+    const __m256i ff = _mm256_set1_epi8((char)0xFF);
+
+    __m256i x, r, g, b, frl, frh, gbl, gbh, p0, p1, p2, p3;
+    int i = 0;
+    for(; i + 32 <= count; i += 32)
+    {
+        x = _mm256_loadu_si256((__m256i*)(in + i));
+
+        r = _mm256_shuffle_epi8(rt, _mm256_and_si256(_mm256_srli_epi16(x,5), m7));
+        g = _mm256_shuffle_epi8(gt, _mm256_and_si256(_mm256_srli_epi16(x,2), m7));
+        b = _mm256_shuffle_epi8(bt, _mm256_and_si256(x, m3));
+
+        frl = _mm256_unpacklo_epi8(ff, r);
+        frh = _mm256_unpackhi_epi8(ff, r);
+        gbl = _mm256_unpacklo_epi8(g, b);
+        gbh = _mm256_unpackhi_epi8(g, b);
+
+        // Pixels 0-3 | 16-19, 4-7 | 20-23, 8-11 | 24-27, 12-15 | 28-31
+        p0 = _mm256_unpacklo_epi16(frl, gbl);
+        p1 = _mm256_unpackhi_epi16(frl, gbl);
+        p2 = _mm256_unpacklo_epi16(frh, gbh);
+        p3 = _mm256_unpackhi_epi16(frh, gbh);
+
+        _mm256_storeu_si256((__m256i*)(out + i*4), _mm256_permute2x128_si256(p0,p1,0x20));
+        _mm256_storeu_si256((__m256i*)(out + i*4 + 32), _mm256_permute2x128_si256(p2,p3,0x20));
+        _mm256_storeu_si256((__m256i*)(out + i*4 + 64), _mm256_permute2x128_si256(p0,p1,0x31));
+        _mm256_storeu_si256((__m256i*)(out + i*4 + 96), _mm256_permute2x128_si256(p2,p3,0x31));
+    }
+    expand_scalar(in + i, out + i*4, count - i);
+}
+
+/// Darken, AVX2
+__attribute__((target("avx2")))
+static void darken_avx2(Uint8* data, int count, int amount)
+{
+    const __m256i m7 = _mm256_set1_epi8(7);
+    const __m256i m3 = _mm256_set1_epi8(3);
+    const __m256i a = _mm256_set1_epi8(amount);
+    const __m256i ab = _mm256_set1_epi8(amount/2);
+
+    __m256i x, r, g, b;
+    int i = 0;
+    for(; i + 32 <= count; i += 32)
+    {
+        x = _mm256_loadu_si256((__m256i*)(data + i));
+
+        r = _mm256_and_si256(_mm256_srli_epi16(x,5), m7);
+        g = _mm256_and_si256(_mm256_srli_epi16(x,2), m7);
+        b = _mm256_and_si256(x, m3);
+
+        r = _mm256_subs_epu8(r, a);
+        g = _mm256_subs_epu8(g, a);
+        b = _mm256_subs_epu8(b, ab);
+
+        x = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi16(r,5), _mm256_slli_epi16(g,2)), b);
+        _mm256_storeu_si256((__m256i*)(data + i), x);
+    }
+    darken_sse2(data + i, count - i, amount);
+}
+
+/// Quantize eight pixels, AVX2
+__attribute__((target("avx2")))
+static inline __m256i quantize8_avx2(const Uint8* in, __m256i alpha)
+{
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    const __m256i kr = _mm256_set1_epi32(1800);
+    const __m256i kb = _mm256_set1_epi32(772);
+
+    __m256i p = _mm256_loadu_si256((__m256i*)in);
+    __m256i er = _mm256_mulhi_epu16(_mm256_and_si256(_mm256_srli_epi32(p,16),mask), kr);
+    __m256i eg = _mm256_mulhi_epu16(_mm256_and_si256(_mm256_srli_epi32(p,8),mask), kr);
+    __m256i eb = _mm256_mulhi_epu16(_mm256_and_si256(p,mask), kb);
+    __m256i opaque = _mm256_cmpeq_epi32(_mm256_srli_epi32(p,24), mask);
+
+    __m256i idx = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(er,5), _mm256_slli_epi32(eg,2)), eb);
+    return _mm256_blendv_epi8(alpha, idx, opaque);
+}
+
+/// Quantize, AVX2
+__attribute__((target("avx2")))
+static void quantize_avx2(const Uint8* in, Uint8* out, int count, Uint8 alpha)
+{
+    const __m256i av = _mm256_set1_epi32(alpha);
+    const __m256i order = _mm256_setr_epi32(0,4,1,5,2,6,3,7);
+
+    __m256i a, b, c, d, x;
+    int i = 0;
+    for(; i + 32 <= count; i += 32)
+    {
+        a = quantize8_avx2(in + i*4, av);
+        b = quantize8_avx2(in + i*4 + 32, av);
+        c = quantize8_avx2(in + i*4 + 64, av);
+        d = quantize8_avx2(in + i*4 + 96, av);
+
+        // Packing works per lane, so the dwords are
+        // shuffled back in order
+        x = _mm256_packus_epi16(_mm256_packs_epi32(a,b), _mm256_packs_epi32(c,d));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_permutevar8x32_epi32(x, order));
+    }
+    quantize_sse41(in + i*4, out + i, count - i, alpha);
+}
+
+#endif // KR_X86
+
+
+/// Variants, from the worst to the best
+static const _KERNELS variants[] = {
+    {"scalar", expand_scalar, darken_scalar, quantize_scalar, transform_scalar},
+#ifdef KR_X86
+    {"sse2", expand_sse2, darken_sse2, quantize_sse2, transform_sse2},
+    {"ssse3", expand_ssse3, darken_sse2, quantize_sse2, transform_sse2},
+    {"sse41", expand_ssse3, darken_sse2, quantize_sse41, transform_sse2},
+    {"avx2", expand_avx2, darken_avx2, quantize_avx2, transform_sse2},
+#endif
+};
+/// Variant count
+static const int VARIANT_COUNT = sizeof(variants) / sizeof(_KERNELS);
+
+/// Kernels in use
+static const _KERNELS* kernels = &variants[0];
+
+
+/// Is a variant supported by the CPU
+static bool is_supported(int index)
+{
+#ifdef KR_X86
+    switch(index)
+    {
+    case 1: return SDL_HasSSE2();
+    case 2: return SDL_HasSSE2() && SDL_HasSSE3() && SDL_HasSSSE3();
+    case 3: return SDL_HasSSE2() && SDL_HasSSSE3() && SDL_HasSSE41();
+    case 4: return SDL_HasSSE41() && SDL_HasAVX2();
+    default:
+        break;
+    }
+#endif
+    return index == 0;
+}
+
+/// Initialize kernels
+void kr_init(const char* force)
+{
+    int i = VARIANT_COUNT-1;
+    kernels = &variants[0];
+
+    // Forced variant
+    if(force != NULL && force[0] != '\0' && strcmp(force,"auto") != 0)
+    {
+        for(; i >= 0; -- i)
+        {
+            if(strcmp(variants[i].name,force) == 0)
+                break;
+        }
+
+        if(i < 0)
+        {
+            printf("Unknown kernel variant %s, using the best available\n",force);
+        }
+        else if(!is_supported(i))
+        {
+            printf("Kernel variant %s is not supported by the CPU\n",force);
+        }
+        else
+        {
+            kernels = &variants[i];
+            return;
+        }
+        i = VARIANT_COUNT-1;
+    }
+
+    // Best supported
+    for(; i > 0; -- i)
+    {
+        if(is_supported(i))
+            break;
+    }
+    kernels = &variants[i];
+}
+
+/// Get variant name
+const char* kr_get_name()
+{
+    return kernels->name;
+}
+
+/// Set palette
+void kr_set_palette(const Uint8* pal)
+{
+    int i = 0;
+    Uint8 b[4];
+    for(; i < 256; ++ i)
+    {
+        b[0] = 255;
+        b[1] = pal[i*3 +2];
+        b[2] = pal[i*3 +1];
+        b[3] = pal[i*3];
+        memcpy(&expandLUT[i],b,4);
+    }
+
+    // Channels depend only on their own bits
+    memset(redTable,0,16);
+    memset(greenTable,0,16);
+    memset(blueTable,0,16);
+    for(i = 0; i < 8; ++ i)
+    {
+        redTable[i] = pal[(i << 5)*3 +2];
+        greenTable[i] = pal[(i << 2)*3 +1];
+    }
+    for(i = 0; i < 4; ++ i)
+    {
+        blueTable[i] = pal[i*3];
+    }
+}
+
+/// Expand
+void kr_expand(const Uint8* in, Uint8* out, int count)
+{
+    kernels->expand(in,out,count);
+}
+
+/// Darken
+void kr_darken(Uint8* data, int count, int amount)
+{
+    kernels->darken(data,count,amount);
+}
+
+/// Quantize
+void kr_quantize(const Uint8* in, Uint8* out, int count, Uint8 alpha)
+{
+    kernels->quantize(in,out,count,alpha);
+}
+
+/// Transform
+void kr_transform(const float* m, const float* in, float* out, int count)
+{
+    kernels->transform(m,in,out,count);
+}
@@ -0,0 +1,50 @@
+/// Kernels (header)
+/// (c) 2018 Jani Nykänen
+
+#ifndef __KERNELS__
+#define __KERNELS__
+
+#include "SDL2/SDL.h"
+
+/// Initialize kernels. Picks the best variant the CPU
+/// supports
+/// < force Name of the variant to force ("scalar", "sse2",
+///   "ssse3", "sse41" or "avx2"), NULL or "auto" if not forced
+void kr_init(const char* force);
+
+/// Get the name of the variant in use
+/// > Name
+const char* kr_get_name();
+
+/// Set the palette used in expansion
+/// < pal Palette, 3 bytes per color (blue, green, red)
+void kr_set_palette(const Uint8* pal);
+
+/// Expand palette indices to RGBA8888 pixels
+/// < in Palette indices
+/// < out Output pixels (4 bytes each)
+/// < count Pixel count
+void kr_expand(const Uint8* in, Uint8* out, int count);
+
+/// Darken palette indices. Red and green lose amount
+/// steps, blue loses amount/2 steps
+/// < data Palette indices
+/// < count Pixel count
+/// < amount Amount
+void kr_darken(Uint8* data, int count, int amount);
+
+/// Quantize 32-bit pixels to palette indices
+/// < in Input pixels (4 bytes each)
+/// < out Palette indices
+/// < count Pixel count
+/// < alpha Index used for non-opaque pixels
+void kr_quantize(const Uint8* in, Uint8* out, int count, Uint8 alpha);
+
+/// Transform points with a 3x4 matrix
+/// < m Matrix, column by column (12 values)
+/// < in Input points (3 floats each)
+/// < out Output points (3 floats each)
+/// < count Point count
+void kr_transform(const float* m, const float* in, float* out, int count);
+
+#endif // __KERNELS__
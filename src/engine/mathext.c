@@ -2,50 +2,211 @@
 /// (c) 2018 Jani Nykänen
 
 #include "mathext.h"
+#include "vecmath.h"
 
 #include "stdlib.h"
 #include "math.h"
 #include "stdio.h"
+#include "string.h"
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include "emmintrin.h"
+#define MATH_SSE2
+#endif
 
-/// Max float
-float maxf(float a, float b)
+// Constants for the fast trigonometry. Pi/2 is split in
+// three parts so the range reduction keeps its precision
+#define PIO2_1 1.5703125f
+#define PIO2_2 4.837512969970703125e-4f
+#define PIO2_3 7.54978995489188216e-8f
+#define TWO_OVER_PI 0.636619772367581343f
+#define PI_F 3.14159265358979323846f
+
+
+/// Is inside triangle
+bool inside_triangle(float px, float py, float x1, float y1, float x2, float y2, float x3, float y3)
 {
-    return a >= b ? a : b;
+    return vm_inside_triangle(px,py,x1,y1,x2,y2,x3,y3);
 }
 
-/// Max int
-int max(int a, int b)
+
+// Sine & cosine polynomials for |r| <= pi/4
+static void sincos_poly(float r, float* s, float* c)
 {
-    return a >= b ? a : b;
+    float r2 = r*r;
+    *s = r + r*r2*(-1.0f/6.0f + r2*(1.0f/120.0f + r2*(-1.0f/5040.0f + r2*(1.0f/362880.0f))));
+    *c = 1.0f + r2*(-0.5f + r2*(1.0f/24.0f + r2*(-1.0f/720.0f + r2*(1.0f/40320.0f))));
 }
 
-/// Min float
-float minf(float a, float b)
+
+/// Fast sine & cosine
+void fast_sincos(float a, float* s, float* c)
 {
-    return a <= b ? a : b;
+    // Reduce to [-pi/4,pi/4] and remember the quadrant
+    float fq = floorf(a * TWO_OVER_PI + 0.5f);
+    float r = ((a - fq*PIO2_1) - fq*PIO2_2) - fq*PIO2_3;
+    int q = (int)fq;
+
+    float ps, pc;
+    sincos_poly(r,&ps,&pc);
+
+    switch(q & 3)
+    {
+    case 0: *s = ps; *c = pc; break;
+    case 1: *s = pc; *c = -ps; break;
+    case 2: *s = -ps; *c = -pc; break;
+    default: *s = -pc; *c = ps; break;
+    }
 }
 
-/// Min integer
-int min(int a, int b)
+
+/// Fast sine & cosine for an array
+void fast_sincos_n(const float* a, float* s, float* c, int count)
 {
-    return a <= b ? a : b;
+    int i = 0;
+
+#ifdef MATH_SSE2
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128i one_i = _mm_set1_epi32(1);
+    const __m128i two_i = _mm_set1_epi32(2);
+
+    for(; i + 4 <= count; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(a + i);
+
+        // Quadrant (rounded to nearest) & reduced angle
+        __m128i q = _mm_cvtps_epi32(_mm_mul_ps(x,_mm_set1_ps(TWO_OVER_PI)));
+        __m128 fq = _mm_cvtepi32_ps(q);
+
+        __m128 r = _mm_sub_ps(x,_mm_mul_ps(fq,_mm_set1_ps(PIO2_1)));
+        r = _mm_sub_ps(r,_mm_mul_ps(fq,_mm_set1_ps(PIO2_2)));
+        r = _mm_sub_ps(r,_mm_mul_ps(fq,_mm_set1_ps(PIO2_3)));
+        __m128 r2 = _mm_mul_ps(r,r);
+
+        // Polynomials
+        __m128 ps = _mm_add_ps(_mm_set1_ps(-1.0f/5040.0f),_mm_mul_ps(r2,_mm_set1_ps(1.0f/362880.0f)));
+        ps = _mm_add_ps(_mm_set1_ps(1.0f/120.0f),_mm_mul_ps(r2,ps));
+        ps = _mm_add_ps(_mm_set1_ps(-1.0f/6.0f),_mm_mul_ps(r2,ps));
+        ps = _mm_add_ps(r,_mm_mul_ps(_mm_mul_ps(r,r2),ps));
+
+        __m128 pc = _mm_add_ps(_mm_set1_ps(-1.0f/720.0f),_mm_mul_ps(r2,_mm_set1_ps(1.0f/40320.0f)));
+        pc = _mm_add_ps(_mm_set1_ps(1.0f/24.0f),_mm_mul_ps(r2,pc));
+        pc = _mm_add_ps(_mm_set1_ps(-0.5f),_mm_mul_ps(r2,pc));
+        pc = _mm_add_ps(one,_mm_mul_ps(r2,pc));
+
+        // Swap in odd quadrants, negate as needed
+        __m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(q,one_i),one_i));
+        __m128 vs = _mm_or_ps(_mm_and_ps(swap,pc),_mm_andnot_ps(swap,ps));
+        __m128 vc = _mm_or_ps(_mm_and_ps(swap,ps),_mm_andnot_ps(swap,pc));
+
+        __m128 negs = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(q,two_i),30));
+        __m128 negc = _mm_castsi128_ps(_mm_slli_epi32(
+            _mm_and_si128(_mm_add_epi32(q,one_i),two_i),30));
+        vs = _mm_xor_ps(vs,_mm_and_ps(negs,sign));
+        vc = _mm_xor_ps(vc,_mm_and_ps(negc,sign));
+
+        _mm_storeu_ps(s + i,vs);
+        _mm_storeu_ps(c + i,vc);
+    }
+#endif
+
+    for(; i < count; ++ i)
+    {
+        fast_sincos(a[i],&s[i],&c[i]);
+    }
 }
 
-/// Is inside triangle
-bool inside_triangle(float px, float py, float x1, float y1, float x2, float y2, float x3, float y3)
+
+/// Fast atan2
+float fast_atan2(float y, float x)
+{
+    float ax = fabsf(x);
+    float ay = fabsf(y);
+    float mx = ax >= ay ? ax : ay;
+    float mn = ax >= ay ? ay : ax;
+    if(mx == 0.0f) return 0.0f;
+
+    // Abramowitz & Stegun 4.4.49 on [0,1]
+    float t = mn / mx;
+    float t2 = t*t;
+    float r = t*(0.9998660f + t2*(-0.3302995f + t2*(0.1801410f
+        + t2*(-0.0851330f + t2*0.0208351f))));
+
+    if(ay > ax) r = PI_F/2.0f - r;
+    if(x < 0.0f) r = PI_F - r;
+    if(y < 0.0f) r = -r;
+
+    return r;
+}
+
+
+/// Fast reciprocal square root
+float fast_rsqrt(float x)
 {
-    /*
-     * Explanation: https://stackoverflow.com/a/9755252
-    */
-
-    float as_x = px-x1;
-    float as_y = py-y1;
- 
-    bool s_ab = (x2-x1)*as_y-(y2-y1)*as_x > 0;
- 
-    if( ((x3-x1)*as_y-(y3-y1)*as_x > 0) == s_ab) return false;
-    if( ((x3-x2)*(py-y2)-(y3-y2)*(px-x2) > 0) != s_ab) return false;
- 
-    return true;
-}
\ No newline at end of file
+#ifdef MATH_SSE2
+    float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return y * (1.5f - 0.5f*x*y*y);
+#else
+    unsigned int i;
+    float y;
+    memcpy(&i,&x,sizeof(i));
+    i = 0x5f375a86 - (i >> 1);
+    memcpy(&y,&i,sizeof(y));
+    y = y * (1.5f - 0.5f*x*y*y);
+    return y * (1.5f - 0.5f*x*y*y);
+#endif
+}
+
+
+/// Fast reciprocal square root for an array
+void fast_rsqrt_n(const float* in, float* out, int count)
+{
+    int i = 0;
+
+#ifdef MATH_SSE2
+    const __m128 h = _mm_set1_ps(0.5f);
+    const __m128 t = _mm_set1_ps(1.5f);
+    for(; i + 4 <= count; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(in + i);
+        __m128 y = _mm_rsqrt_ps(x);
+        y = _mm_mul_ps(y,_mm_sub_ps(t,_mm_mul_ps(_mm_mul_ps(h,x),_mm_mul_ps(y,y))));
+        _mm_storeu_ps(out + i,y);
+    }
+#endif
+
+    for(; i < count; ++ i)
+    {
+        out[i] = fast_rsqrt(in[i]);
+    }
+}
+
+
+// Make a generator state
+Uint32 rand_seed(Uint32 seed)
+{
+    // Mix the bits (murmur3 finalizer) so that
+    // consecutive seeds do not start out correlated
+    Uint32 h = seed + 0x9E3779B9u;
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+
+    return h == 0 ? 0x9E3779B9u : h;
+}
+
+
+// Next random number
+Uint32 rand_next(Uint32* state)
+{
+    Uint32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return x;
+}
@@ -4,27 +4,11 @@
 #ifndef __MATH_EXT__
 #define __MATH_EXT__
 
+#include "SDL2/SDL.h"
+
 #include "math.h"
 #include "stdbool.h"
 
-/// Determine which one is bigger, a or b
-/// a Number a
-/// b Number b
-/// Returns the bigger number
-float maxf(float a, float b);
-
-/// Same as maxf, but with integers
-int max(int a, int b);
-
-/// Determine which one is smaller, a or b
-/// a Number a
-/// b Number b
-/// Returns the smaller number
-float minf(float a, float b);
-
-/// Same as minf, but with integers
-int min(int a, int b);
-
 /// Is point inside a triangle
 /// < px Point x
 /// < py Point y
@@ -37,4 +21,52 @@ int min(int a, int b);
 /// > True, if inside
 bool inside_triangle(float px, float py, float x1, float y1, float x2, float y2, float x3, float y3);
 
+/// Fast sine & cosine. Absolute error is below 2e-7
+/// for |a| < 8192 and grows slowly past that
+/// < a Angle
+/// < s Sine
+/// < c Cosine
+void fast_sincos(float a, float* s, float* c);
+
+/// Fast sine & cosine for an array of angles, four at
+/// a time with SSE2. Same error bound as fast_sincos
+/// < a Angles
+/// < s Sines
+/// < c Cosines
+/// < count Angle count
+void fast_sincos_n(const float* a, float* s, float* c, int count);
+
+/// Fast atan2. Absolute error is below 2e-5 radians.
+/// Returns 0 when both x and y are 0
+/// < y Y component
+/// < x X component
+/// > Angle in [-pi,pi]
+float fast_atan2(float y, float x);
+
+/// Fast reciprocal square root. Relative error is below
+/// 5e-6, x must be positive
+/// < x Value
+/// > 1/sqrt(x)
+float fast_rsqrt(float x);
+
+/// Fast reciprocal square root for an array. Same error
+/// bound as fast_rsqrt
+/// < in Values
+/// < out Results
+/// < count Value count
+void fast_rsqrt_n(const float* in, float* out, int count);
+
+/// Make a random number generator state from a seed.
+/// Nearby seeds give unrelated sequences
+/// < seed Seed
+/// > Generator state, never 0
+Uint32 rand_seed(Uint32 seed);
+
+/// Next random number (xorshift32). Each state is its
+/// own sequence, so separate states can be used from
+/// separate threads
+/// < state Generator state
+/// > Random number
+Uint32 rand_next(Uint32* state);
+
 #endif // __MATH_EXT__
\ No newline at end of file
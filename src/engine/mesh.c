@@ -7,12 +7,14 @@
  */
 
 #include "mesh.h"
+#include "vecmath.h"
 
 #include "../lib/parseword.h"
 
 #include "stdio.h"
 #include "stdlib.h"
 #include "string.h"
+#include "math.h"
 
 
 // Count occurrances of a word in a word data
@@ -119,6 +121,48 @@ static void read_int_3_3(WORDDATA* w, Uint32* arr, Uint32 start, Uint32 length)
 }
 
 
+// Compute the bounds of a mesh and reset its detail levels
+// and collision hierarchy
+static void mesh_finish(MESH* m)
+{
+    m->minV = vec3(9999,9999,9999);
+    m->maxV = vec3(-9999,-9999,-9999);
+
+    int i = 0;
+    for(; i < m->elementCount; ++ i)
+    {
+        if(m->vertices[i*3] < m->minV.x) m->minV.x = m->vertices[i*3];
+        if(m->vertices[i*3 +1] < m->minV.y) m->minV.y = m->vertices[i*3 +1];
+        if(m->vertices[i*3 +2] < m->minV.z) m->minV.z = m->vertices[i*3 +2];
+
+        if(m->vertices[i*3] > m->maxV.x) m->maxV.x = m->vertices[i*3];
+        if(m->vertices[i*3 +1] > m->maxV.y) m->maxV.y = m->vertices[i*3 +1];
+        if(m->vertices[i*3 +2] > m->maxV.z) m->maxV.z = m->vertices[i*3 +2];
+    }
+
+    // Bounding sphere around the bounds center
+    VEC3 c = vec3((m->minV.x + m->maxV.x) / 2,(m->minV.y + m->maxV.y) / 2,
+        (m->minV.z + m->maxV.z) / 2);
+    float r2 = 0.0f;
+    float dx, dy, dz;
+    for(i = 0; i < m->elementCount; ++ i)
+    {
+        dx = m->vertices[i*3] - c.x;
+        dy = m->vertices[i*3 +1] - c.y;
+        dz = m->vertices[i*3 +2] - c.z;
+        if(dx*dx + dy*dy + dz*dz > r2)
+            r2 = dx*dx + dy*dy + dz*dz;
+    }
+    m->radius = sqrtf(r2);
+
+    for(i = 0; i < MESH_MAX_LOD-1; ++ i)
+        m->lod[i] = NULL;
+    m->lodCount = 1;
+
+    m->bvh = NULL;
+}
+
+
 // Load mesh
 MESH* load_mesh(const char* path)
 {
@@ -179,8 +223,8 @@ MESH* load_mesh(const char* path)
     m->normalCount = elementCount * 3;
     m->elementCount = elementCount;
 
-    m->minV = vec3(9999,9999,9999);
-    m->maxV = vec3(-9999,-9999,-9999);
+    m->lightLevels = NULL;
+    m->lightGen = 0;
 
     // Store indexed data
     int i = 0;
@@ -190,14 +234,6 @@ MESH* load_mesh(const char* path)
         m->vertices[i*3 +1] = vertices[ (indices[i*3]-1)*3 +1];
         m->vertices[i*3 +2] = vertices[ (indices[i*3]-1)*3 +2];
 
-        if(m->vertices[i*3] < m->minV.x) m->minV.x = m->vertices[i*3];
-        if(m->vertices[i*3 +1] < m->minV.y) m->minV.y = m->vertices[i*3 +1];
-        if(m->vertices[i*3 +2] < m->minV.z) m->minV.z = m->vertices[i*3 +2];
-
-        if(m->vertices[i*3] > m->maxV.x) m->maxV.x = m->vertices[i*3];
-        if(m->vertices[i*3 +1] > m->maxV.y) m->maxV.y = m->vertices[i*3 +1];
-        if(m->vertices[i*3 +2] > m->maxV.z) m->maxV.z = m->vertices[i*3 +2];
-
         m->uvs[i*2] = uvs[ (indices[i*3 +1] -1)*2];
         m->uvs[i*2 +1] = 1.0f- uvs[ (indices[i*3 +1] -1)*2 +1];
 
@@ -207,6 +243,7 @@ MESH* load_mesh(const char* path)
 
         m->indices[i] = i;
     }
+    mesh_finish(m);
 
     // Free data that is no longer needed
     free(vertices);
@@ -218,15 +255,196 @@ MESH* load_mesh(const char* path)
 }
 
 
+// Create a mesh from raw data
+MESH* create_mesh(const float* vertices, const float* uvs, const float* normals, Uint32 count)
+{
+    MESH * m = (MESH*)malloc(sizeof(MESH));
+    if(m == NULL)
+    {
+        printf("Memory allocation error!\n");
+        return NULL;
+    }
+    m->vertices = (float*)malloc(sizeof(float) * count * 3);
+    m->uvs = (float*)malloc(sizeof(float) * count * 2);
+    m->normals = (float*)malloc(sizeof(float) * count * 3);
+    m->indices = (Uint32*)malloc(sizeof(Uint32) * count);
+    if(m->vertices == NULL || m->uvs == NULL || m->normals == NULL || m->indices == NULL)
+    {
+        free(m->vertices);
+        free(m->uvs);
+        free(m->normals);
+        free(m->indices);
+        free(m);
+        printf("Memory allocation error!\n");
+        return NULL;
+    }
+
+    memcpy(m->vertices,vertices,sizeof(float) * count * 3);
+    memcpy(m->uvs,uvs,sizeof(float) * count * 2);
+    memcpy(m->normals,normals,sizeof(float) * count * 3);
+
+    m->vertexCount = count * 3;
+    m->uvCount = count * 2;
+    m->normalCount = count * 3;
+    m->elementCount = count;
+
+    m->lightLevels = NULL;
+    m->lightGen = 0;
+
+    int i = 0;
+    for(; i < count; ++ i)
+    {
+        m->indices[i] = i;
+    }
+    mesh_finish(m);
+
+    return m;
+}
+
+
+// Build the collision hierarchy
+int mesh_build_bvh(MESH* m)
+{
+    if(m->bvh != NULL || m->elementCount < 3)
+        return 0;
+
+    m->bvh = bvh_create(m->vertices,m->normals,m->elementCount/3);
+    if(m->bvh == NULL)
+    {
+        printf("Memory allocation error!\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+// Simplify by vertex clustering
+MESH* mesh_simplify(MESH* m, int cells)
+{
+    if(cells < 1) cells = 1;
+
+    VEC3 size = vec3(m->maxV.x - m->minV.x,m->maxV.y - m->minV.y,m->maxV.z - m->minV.z);
+    float cellSize = vm_maxf(size.x,vm_maxf(size.y,size.z)) / cells;
+    if(cellSize <= 0.0f) return NULL;
+
+    int cx = (int)(size.x / cellSize) + 1;
+    int cy = (int)(size.y / cellSize) + 1;
+    int cz = (int)(size.z / cellSize) + 1;
+
+    // Cell of each vertex, and the position sums of the cells
+    Uint32 count = m->elementCount;
+    int* cell = (int*)malloc(sizeof(int) * count);
+    float* sum = (float*)calloc(cx*cy*cz*4,sizeof(float));
+    float* v = (float*)malloc(sizeof(float) * count * 3);
+    float* uv = (float*)malloc(sizeof(float) * count * 2);
+    float* n = (float*)malloc(sizeof(float) * count * 3);
+    if(cell == NULL || sum == NULL || v == NULL || uv == NULL || n == NULL)
+    {
+        printf("Memory allocation error!\n");
+        free(cell); free(sum); free(v); free(uv); free(n);
+        return NULL;
+    }
+
+    int i = 0;
+    int x, y, z;
+    float* p;
+    for(; i < count; ++ i)
+    {
+        p = m->vertices + m->indices[i]*3;
+        x = (int)((p[0] - m->minV.x) / cellSize);
+        y = (int)((p[1] - m->minV.y) / cellSize);
+        z = (int)((p[2] - m->minV.z) / cellSize);
+        if(x >= cx) x = cx-1;
+        if(y >= cy) y = cy-1;
+        if(z >= cz) z = cz-1;
+
+        cell[i] = (z*cy + y)*cx + x;
+        sum[cell[i]*4] += p[0];
+        sum[cell[i]*4 +1] += p[1];
+        sum[cell[i]*4 +2] += p[2];
+        sum[cell[i]*4 +3] += 1.0f;
+    }
+
+    // Keep the triangles that still have three corners,
+    // with the corners moved to the cell averages
+    Uint32 out = 0;
+    int k, c;
+    for(i = 0; i+2 < count; i += 3)
+    {
+        if(cell[i] == cell[i+1] || cell[i+1] == cell[i+2] || cell[i] == cell[i+2])
+            continue;
+
+        for(k = 0; k < 3; ++ k, ++ out)
+        {
+            c = cell[i+k];
+            v[out*3] = sum[c*4] / sum[c*4 +3];
+            v[out*3 +1] = sum[c*4 +1] / sum[c*4 +3];
+            v[out*3 +2] = sum[c*4 +2] / sum[c*4 +3];
+
+            uv[out*2] = m->uvs[m->indices[i+k]*2];
+            uv[out*2 +1] = m->uvs[m->indices[i+k]*2 +1];
+
+            n[out*3] = m->normals[m->indices[i+k]*3];
+            n[out*3 +1] = m->normals[m->indices[i+k]*3 +1];
+            n[out*3 +2] = m->normals[m->indices[i+k]*3 +2];
+        }
+    }
+
+    MESH* ret = NULL;
+    if(out > 0)
+        ret = create_mesh(v,uv,n,out);
+
+    free(cell);
+    free(sum);
+    free(v);
+    free(uv);
+    free(n);
+
+    return ret;
+}
+
+
+// Add a detail level
+int mesh_add_lod(MESH* m, MESH* lod)
+{
+    if(m->lodCount >= MESH_MAX_LOD)
+        return 1;
+
+    m->lod[m->lodCount-1] = lod;
+    ++ m->lodCount;
+
+    return 0;
+}
+
+
+// Get a detail level
+MESH* mesh_get_lod(MESH* m, int level)
+{
+    if(level <= 0) return m;
+    if(level >= m->lodCount) level = m->lodCount-1;
+
+    return m->lod[level-1];
+}
+
+
 // Destroy
 void destroy_mesh(MESH* m)
 {
     if(m == NULL) return;
 
+    int i = 0;
+    for(; i < m->lodCount-1; ++ i)
+    {
+        destroy_mesh(m->lod[i]);
+    }
+
     free(m->vertices);
     free(m->uvs);
     free(m->normals);
     free(m->indices);
+    free(m->lightLevels);
+    bvh_destroy(m->bvh);
 
     free(m);
 }
\ No newline at end of file
@@ -7,9 +7,13 @@
 #include "SDL2/SDL.h"
 
 #include "vector.h"
+#include "bvh.h"
+
+/// Maximum detail level count, the full mesh included
+#define MESH_MAX_LOD 4
 
 /** Mesh type */
-typedef struct
+typedef struct _MESH
 {
     float* vertices;
     float* uvs;
@@ -23,14 +27,58 @@ typedef struct
 
     VEC3 minV;
     VEC3 maxV;
+
+    Uint8* lightLevels;
+    Uint32 lightGen;
+
+    BVH* bvh; /// Collision hierarchy, in mesh space
+
+    float radius; /// Bounding sphere radius, around the bounds center
+    struct _MESH* lod[MESH_MAX_LOD-1]; /// Lower detail levels, coarsest last
+    int lodCount; /// Detail level count, the mesh itself included
 }
 MESH;
 
-/// Load a mesh
+/// Load a mesh. No collision hierarchy is built
 /// < path File path
 /// > A new mesh
 MESH* load_mesh(const char* path);
 
+/// Create a mesh from non-indexed triangle data. The data
+/// is copied. No collision hierarchy is built
+/// < vertices Vertices, 3 values each
+/// < uvs UV coordinates, 2 values each
+/// < normals Normals, 3 values each
+/// < count Vertex count (three per triangle)
+/// > A new mesh
+MESH* create_mesh(const float* vertices, const float* uvs, const float* normals, Uint32 count);
+
+/// Build the collision hierarchy of a mesh, if it does
+/// not have one yet
+/// < m Mesh
+/// > 0 on success, 1 on error
+int mesh_build_bvh(MESH* m);
+
+/// Simplify a mesh by vertex clustering. Vertices in the
+/// same grid cell are merged and collapsed triangles dropped
+/// < m Mesh
+/// < cells Cell count along the longest bounds axis
+/// > A new mesh without a collision hierarchy, NULL if
+///   nothing was left
+MESH* mesh_simplify(MESH* m, int cells);
+
+/// Add a lower detail level. The mesh owns it afterwards
+/// < m Mesh
+/// < lod Detail level, less detailed than the previous ones
+/// > 0 on success, 1 if there is no room left
+int mesh_add_lod(MESH* m, MESH* lod);
+
+/// Get a detail level
+/// < m Mesh
+/// < level Level, 0 is the mesh itself. Clamped
+/// > Mesh of the level
+MESH* mesh_get_lod(MESH* m, int level);
+
 /// Destroy a mesh
 /// < m Mesh
 void destroy_mesh(MESH* m);
@@ -0,0 +1,201 @@
+/// Text cache (source)
+/// (c) 2018 Jani Nykänen
+
+#include "textcache.h"
+
+#include "graphics.h"
+#include "vecmath.h"
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+
+// Cache entry
+typedef struct
+{
+    BITMAP* font; // Font
+    Uint8* text; // Text (copy)
+    int len; // Text length
+    int xoff; // X offset
+    int yoff; // Y offset
+    int firstx; // First line x
+
+    BITMAP* bmp; // Rasterized text
+    int ox; // Bitmap x
+    int oy; // Bitmap y
+
+    Uint32 lastUse; // Last use "time"
+}
+_TEXT_ENTRY;
+
+// Cache entries
+static _TEXT_ENTRY entries[TEXT_CACHE_SIZE];
+// Use counter
+static Uint32 useCount;
+
+
+// Free an entry
+static void free_entry(_TEXT_ENTRY* e)
+{
+    if(e->text != NULL) free(e->text);
+    destroy_bitmap(e->bmp);
+
+    e->text = NULL;
+    e->bmp = NULL;
+    e->font = NULL;
+}
+
+
+// Walk through the glyphs of a string. If dest is NULL,
+// only the bounds are calculated
+static void layout_text(BITMAP* font, Uint8* text, int len, int xoff, int yoff, int firstx, 
+    BITMAP* dest, int* minx, int* miny, int* maxx, int* maxy)
+{
+    int cw = font->w / 16;
+    int ch = cw;
+    int x = firstx;
+    int y = 0;
+    int i = 0;
+    int px, py;
+    int sx, sy;
+    Uint8 c, col;
+    Uint8 alpha = get_alpha();
+    Uint8* out;
+
+    for(; i < len; ++ i)
+    {
+        c = text[i];
+        if(c == '\n')
+        {
+            x = 0;
+            y += yoff;
+            continue;
+        }
+
+        if(dest == NULL)
+        {
+            *minx = vm_min(*minx,x);
+            *miny = vm_min(*miny,y);
+            *maxx = vm_max(*maxx,x+cw);
+            *maxy = vm_max(*maxy,y+ch);
+        }
+        else
+        {
+            sx = (c % 16) * cw;
+            sy = (c / 16) * ch;
+
+            // Copy the opaque pixels of the glyph
+            for(py = 0; py < ch && sy+py < font->h; ++ py)
+            {
+                out = dest->data + (y-*miny+py)*dest->w + (x-*minx);
+                for(px = 0; px < cw; ++ px)
+                {
+                    col = bmp_texel(font,sx+px,sy+py);
+                    if(col != alpha)
+                        out[px] = col;
+                }
+            }
+        }
+
+        x += cw + xoff;
+    }
+}
+
+
+// Rasterize a string to an entry
+static bool rasterize_text(_TEXT_ENTRY* e)
+{
+    int minx = 0, miny = 0;
+    int maxx = 0, maxy = 0;
+
+    layout_text(e->font,e->text,e->len,e->xoff,e->yoff,e->firstx,NULL,&minx,&miny,&maxx,&maxy);
+    if(maxx <= minx || maxy <= miny) 
+        return false;
+
+    e->bmp = create_bitmap(maxx-minx,maxy-miny,get_alpha());
+    if(e->bmp == NULL)
+        return false;
+
+    layout_text(e->font,e->text,e->len,e->xoff,e->yoff,e->firstx,e->bmp,&minx,&miny,&maxx,&maxy);
+    if(bmp_gen_spans(e->bmp) == 1)
+    {
+        destroy_bitmap(e->bmp);
+        e->bmp = NULL;
+        return false;
+    }
+
+    e->ox = minx;
+    e->oy = miny;
+
+    return true;
+}
+
+
+// Get a pre-rasterized string
+BITMAP* tc_get_text(BITMAP* font, Uint8* text, int len, int xoff, int yoff, int firstx, int* ox, int* oy)
+{
+    // Actual length
+    int l = 0;
+    while(l < len && text[l] != '\0') ++ l;
+    if(l == 0) return NULL;
+
+    ++ useCount;
+
+    // Find the string, or the least recently used entry
+    _TEXT_ENTRY* e;
+    _TEXT_ENTRY* lru = &entries[0];
+    int i = 0;
+    for(; i < TEXT_CACHE_SIZE; ++ i)
+    {
+        e = &entries[i];
+        if(e->font == font && e->len == l && e->xoff == xoff && e->yoff == yoff 
+           && e->firstx == firstx && memcmp(e->text,text,l) == 0)
+        {
+            e->lastUse = useCount;
+            *ox = e->ox;
+            *oy = e->oy;
+            return e->bmp;
+        }
+
+        if(e->lastUse < lru->lastUse)
+            lru = &entries[i];
+    }
+
+    // Not found, evict & rasterize
+    e = lru;
+    free_entry(e);
+
+    e->text = (Uint8*)malloc(sizeof(Uint8) * l);
+    if(e->text == NULL)
+        return NULL;
+    memcpy(e->text,text,l);
+
+    e->font = font;
+    e->len = l;
+    e->xoff = xoff;
+    e->yoff = yoff;
+    e->firstx = firstx;
+    e->lastUse = useCount;
+
+    if(!rasterize_text(e))
+    {
+        free_entry(e);
+        return NULL;
+    }
+
+    *ox = e->ox;
+    *oy = e->oy;
+    return e->bmp;
+}
+
+
+// Clear the text cache
+void tc_clear()
+{
+    int i = 0;
+    for(; i < TEXT_CACHE_SIZE; ++ i)
+    {
+        free_entry(&entries[i]);
+        entries[i].lastUse = 0;
+    }
+}
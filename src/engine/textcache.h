@@ -0,0 +1,28 @@
+/// Text cache (header)
+/// (c) 2018 Jani Nykänen
+
+#ifndef __TEXT_CACHE__
+#define __TEXT_CACHE__
+
+#include "bitmap.h"
+
+/// Amount of cached strings
+#define TEXT_CACHE_SIZE 32
+
+/// Get a pre-rasterized string. The string is rasterized
+/// and stored if it is not in the cache yet
+/// < font Bitmap font
+/// < text Text
+/// < len Text length
+/// < xoff X offset
+/// < yoff Y offset
+/// < firstx Starting x of the first line, relative to the other lines
+/// < ox Horizontal position of the bitmap, relative to the text origin
+/// < oy Vertical position of the bitmap, relative to the text origin
+/// > Rasterized text, NULL if nothing to draw
+BITMAP* tc_get_text(BITMAP* font, Uint8* text, int len, int xoff, int yoff, int firstx, int* ox, int* oy);
+
+/// Clear the text cache
+void tc_clear();
+
+#endif // __TEXT_CACHE__
@@ -6,6 +6,7 @@
 #include <math.h>
 
 #include "transform.h"
+#include "mathext.h"
 
 /// World translation
 static VEC3 tr;
@@ -88,38 +89,74 @@ void tr_rotate_world(float angle1, float angle2)
     worldChanged = true;
 }
 
-/// Rotate a normal (or any) vector
-VEC3 tr_rotate_normal(VEC3 n)
+/// Update sines & cosines
+static void update_sincos()
 {
+    if(worldChanged)
+    {
+        fast_sincos(worldAngle1,&wsc[0],&wsc[1]);
+        fast_sincos(worldAngle2,&wsc[2],&wsc[3]);
+
+        worldChanged = false;
+    }
     if(modelChanged)
     {
-        msc[0] = sin(modelAngle1);
-        msc[1] = cos(modelAngle1);
-        msc[2] = sin(modelAngle2);
-        msc[3] = cos(modelAngle2);
-        msc[4] = sin(modelAngle3);
-        msc[5] = cos(modelAngle3);
+        fast_sincos(modelAngle1,&msc[0],&msc[1]);
+        fast_sincos(modelAngle2,&msc[2],&msc[3]);
+        fast_sincos(modelAngle3,&msc[4],&msc[5]);
 
         modelChanged = false;
     }
+}
 
-    // Rotate model
+/// Rotate a vector with model sines & cosines
+static VEC3 rotate_sc(const float* sc, VEC3 n)
+{
     float x = n.x;
     float z = n.z;
     float y = n.y;
-    n.x = x * msc[1] - z * msc[0];
-    n.z = x * msc[0] + z * msc[1] ;
+    n.x = x * sc[1] - z * sc[0];
+    n.z = x * sc[0] + z * sc[1] ;
     z = n.z;
-    n.y = y * msc[3] - z * msc[2];
-    n.z = y * msc[2] + z * msc[3] ;
+    n.y = y * sc[3] - z * sc[2];
+    n.z = y * sc[2] + z * sc[3] ;
     x = n.x;
     y = n.y;
-    n.x = x * msc[5] - y * msc[4];
-    n.y = x * msc[4] + y * msc[5] ;
+    n.x = x * sc[5] - y * sc[4];
+    n.y = x * sc[4] + y * sc[5] ;
 
     return n;
 }
 
+/// Rotate a vector with the model angles
+static VEC3 model_rotate(VEC3 n)
+{
+    return rotate_sc(msc,n);
+}
+
+/// Rotate a vector with the world angles
+static VEC3 world_rotate(VEC3 pt)
+{
+    float x = pt.x;
+    float z = pt.z;
+    float y = pt.y;
+    pt.x = x * wsc[1] - z * wsc[0];
+    pt.z = x * wsc[0] + z * wsc[1] ;
+    z = pt.z;
+    pt.y = y * wsc[3] - z * wsc[2];
+    pt.z = y * wsc[2] + z * wsc[3] ;
+
+    return pt;
+}
+
+/// Rotate a normal (or any) vector
+VEC3 tr_rotate_normal(VEC3 n)
+{
+    update_sincos();
+
+    return model_rotate(n);
+}
+
 /// Rotate model
 void tr_rotate_model(float angle1, float angle2, float angle3)
 {
@@ -136,12 +173,24 @@ void tr_scale_model(float x, float y, float z)
     modelScale = vec3(x,y,z);
 }
 
+/// Is the model rotated
+bool tr_model_rotated()
+{
+    return modelAngle1 != 0.0f || modelAngle2 != 0.0f || modelAngle3 != 0.0f;
+}
+
 /// Set FOV value
 void tr_set_fov(float value)
 {
     FOVvalue = value;
 }
 
+/// Get FOV value
+float tr_get_fov()
+{
+    return FOVvalue;
+}
+
 /// Return translation
 VEC3 tr_get_translation()
 {
@@ -157,43 +206,10 @@ float tr_get_worldAngle1()
 /// Use transformations for vector p
 VEC3 tr_use_transform(VEC3 p)
 {
-    // Calculate sines & cosines
-    if(worldChanged)
-    {
-        wsc[0] = sin(worldAngle1);
-        wsc[1] = cos(worldAngle1);
-        wsc[2] = sin(worldAngle2);
-        wsc[3] = cos(worldAngle2);
-
-        worldChanged = false;
-    }
-    if(modelChanged)
-    {
-        msc[0] = sin(modelAngle1);
-        msc[1] = cos(modelAngle1);
-        msc[2] = sin(modelAngle2);
-        msc[3] = cos(modelAngle2);
-        msc[4] = sin(modelAngle3);
-        msc[5] = cos(modelAngle3);
-
-        modelChanged = false;
-    }
+    update_sincos();
 
     // Rotate model
-    float x = p.x;
-    float z = p.z;
-    float y = p.y;
-    p.x = x * msc[1] - z * msc[0];
-    p.z = x * msc[0] + z * msc[1] ;
-    z = p.z;
-    
-    p.y = y * msc[3] - z * msc[2];
-    p.z = y * msc[2] + z * msc[3] ;
-    x = p.x;
-
-    y = p.y;
-    p.x = x * msc[5] - y * msc[4];
-    p.y = x * msc[4] + y * msc[5] ;
+    p = model_rotate(p);
 
     // Scale
     p.x *= modelScale.x;
@@ -204,20 +220,104 @@ VEC3 tr_use_transform(VEC3 p)
     VEC3 pt = vec3(p.x+modelTr.x+tr.x,p.y+modelTr.y+tr.y,p.z+modelTr.z+tr.z);
 
     // Rotate
-    x = pt.x;
-    z = pt.z;
-    y = pt.y;
-    pt.x = x * wsc[1] - z * wsc[0];
-    pt.z = x * wsc[0] + z * wsc[1] ;
-    z = pt.z;
-    pt.y = y * wsc[3] - z * wsc[2];
-    pt.z = y * wsc[2] + z * wsc[3] ;
+    pt = world_rotate(pt);
 
     pt.z *= FOVvalue;
 
     return pt;
 }
 
+/// Return the transformations as a matrix
+void tr_get_matrix(float* m)
+{
+    update_sincos();
+
+    VEC3 axes[3] = {vec3(1,0,0), vec3(0,1,0), vec3(0,0,1)};
+    VEC3 c;
+    int i = 0;
+    for(; i < 3; ++ i)
+    {
+        c = model_rotate(axes[i]);
+        c.x *= modelScale.x;
+        c.y *= modelScale.y;
+        c.z *= modelScale.z;
+        c = world_rotate(c);
+
+        m[i*3] = c.x;
+        m[i*3 +1] = c.y;
+        m[i*3 +2] = c.z * FOVvalue;
+    }
+
+    c = world_rotate(vec3(modelTr.x+tr.x,modelTr.y+tr.y,modelTr.z+tr.z));
+    m[9] = c.x;
+    m[10] = c.y;
+    m[11] = c.z * FOVvalue;
+}
+
+/// Return the world transformations as a matrix
+void tr_get_world_matrix(float* m)
+{
+    update_sincos();
+
+    VEC3 axes[3] = {vec3(1,0,0), vec3(0,1,0), vec3(0,0,1)};
+    VEC3 c;
+    int i = 0;
+    for(; i < 4; ++ i)
+    {
+        c = world_rotate(i < 3 ? axes[i] : tr);
+
+        m[i*3] = c.x;
+        m[i*3 +1] = c.y;
+        m[i*3 +2] = c.z * FOVvalue;
+    }
+}
+
+/// Get a model rotation
+TR_ROTATION tr_get_rotation(VEC3 angle)
+{
+    TR_ROTATION r;
+    fast_sincos(angle.x,&r.sc[0],&r.sc[1]);
+    fast_sincos(angle.y,&r.sc[2],&r.sc[3]);
+    fast_sincos(angle.z,&r.sc[4],&r.sc[5]);
+
+    return r;
+}
+
+/// Rotate a vector with a model rotation
+VEC3 tr_rotate_with(const TR_ROTATION* r, VEC3 n)
+{
+    return rotate_sc(r->sc,n);
+}
+
+/// Combine a world matrix and a model transformation
+void tr_get_model_matrix(const float* world, VEC3 pos, const TR_ROTATION* r, VEC3 scale, float* m)
+{
+    VEC3 axes[3] = {vec3(1,0,0), vec3(0,1,0), vec3(0,0,1)};
+    VEC3 c;
+    int i = 0;
+    for(; i < 4; ++ i)
+    {
+        if(i < 3)
+        {
+            c = rotate_sc(r->sc,axes[i]);
+            c.x *= scale.x;
+            c.y *= scale.y;
+            c.z *= scale.z;
+        }
+        else
+        {
+            c = pos;
+        }
+
+        m[i*3] = world[0]*c.x + world[3]*c.y + world[6]*c.z;
+        m[i*3 +1] = world[1]*c.x + world[4]*c.y + world[7]*c.z;
+        m[i*3 +2] = world[2]*c.x + world[5]*c.y + world[8]*c.z;
+    }
+    m[9] += world[9];
+    m[10] += world[10];
+    m[11] += world[11];
+}
+
 /// Use transform (ytrans only)
 VEC3 tr_use_transform_ytrans(VEC3 p)
 {
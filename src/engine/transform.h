@@ -6,6 +6,15 @@
 
 #include "vector.h"
 
+#include "stdbool.h"
+
+/// Model rotation, sines and cosines of the model angles
+typedef struct
+{
+    float sc[6];
+}
+TR_ROTATION;
+
 /// Identity
 void tr_identity();
 
@@ -43,10 +52,18 @@ VEC3 tr_rotate_normal(VEC3 n);
 /// < z Z scale
 void tr_scale_model(float x, float y, float z);
 
+/// Is the model rotated
+/// > True if any model angle is non-zero
+bool tr_model_rotated();
+
 /// Set FOV value
 /// < value Value (0.75f is default)
 void tr_set_fov(float value);
 
+/// Get FOV value
+/// > Value
+float tr_get_fov();
+
 /// Return translation
 /// > Translation vector
 VEC3 tr_get_translation();
@@ -60,6 +77,37 @@ float tr_get_angle();
 /// > A transformed vector
 VEC3 tr_use_transform(VEC3 p);
 
+/// Return the transformations as a 3x4 matrix, so that
+/// transforming with it equals tr_use_transform
+/// < m Matrix, column by column (12 values)
+void tr_get_matrix(float* m);
+
+/// Return the world transformations (model ones not
+/// included) as a 3x4 matrix
+/// < m Matrix, column by column (12 values)
+void tr_get_world_matrix(float* m);
+
+/// Get a model rotation
+/// < angle Model angles (as in tr_rotate_model)
+/// > Rotation
+TR_ROTATION tr_get_rotation(VEC3 angle);
+
+/// Rotate a vector with a model rotation
+/// < r Rotation
+/// < n Vector
+/// > A rotated vector
+VEC3 tr_rotate_with(const TR_ROTATION* r, VEC3 n);
+
+/// Combine a world matrix and a model transformation, like
+/// tr_get_matrix does with the current ones. Touches no
+/// global state, so any thread may call this
+/// < world World matrix (see tr_get_world_matrix)
+/// < pos Model translation
+/// < r Model rotation
+/// < scale Model scale
+/// < m Matrix (12 values)
+void tr_get_model_matrix(const float* world, VEC3 pos, const TR_ROTATION* r, VEC3 scale, float* m);
+
 /// Use transformation, y translation only
 /// < p Vector
 /// > A transformed vector
@@ -0,0 +1,132 @@
+/// Inline vector math (header only)
+/// (c) 2018 Jani Nykänen
+
+#ifndef __VECMATH__
+#define __VECMATH__
+
+#include "math.h"
+#include "stdbool.h"
+
+#include "vector.h"
+
+/// Max float
+static inline float vm_maxf(float a, float b)
+{
+    return a >= b ? a : b;
+}
+
+/// Min float
+static inline float vm_minf(float a, float b)
+{
+    return a <= b ? a : b;
+}
+
+/// Max int
+static inline int vm_max(int a, int b)
+{
+    return a >= b ? a : b;
+}
+
+/// Min int
+static inline int vm_min(int a, int b)
+{
+    return a <= b ? a : b;
+}
+
+/// Cross product
+static inline VEC3 vm_cross(VEC3 A, VEC3 B)
+{
+    return vec3(
+        A.y*B.z - A.z*B.y,
+        -(A.x*B.z-A.z*B.x),
+        A.x*B.y - A.y*B.x
+    );
+}
+
+/// Addition operator
+static inline VEC3 vm_add_vec3(VEC3 A, VEC3 B)
+{
+    return vec3(A.x+B.x,A.y+B.y,A.z+B.z);
+}
+
+/// Decrease operator
+static inline VEC3 vm_dec_vec3(VEC3 A, VEC3 B)
+{
+    return vec3(A.x-B.x,A.y-B.y,A.z-B.z);
+}
+
+/// Dot product
+static inline float vm_dot(VEC3 A, VEC3 B)
+{
+    return A.x*B.x + A.y*B.y + A.z*B.z;
+}
+
+/// Normalize
+static inline VEC3 vm_normalize(VEC3 A)
+{
+    float l = 1.0f / sqrtf(A.x*A.x + A.y*A.y + A.z*A.z);
+    return vec3(A.x*l,A.y*l,A.z*l);
+}
+
+/// Normalize a vector 2
+static inline VEC2 vm_vec2_normalize(VEC2 A)
+{
+    float l = 1.0f / sqrtf(A.x*A.x + A.y*A.y);
+    return vec2(A.x*l,A.y*l);
+}
+
+/// Calculate determinant
+static inline float vm_mat2_det(MAT2 m)
+{
+    return m.m11 * m.m22 - m.m12 * m.m21;
+}
+
+/// Inverse matrix
+static inline MAT2 vm_mat2_inverse(MAT2 m)
+{
+    float d = 1.0f / vm_mat2_det(m);
+    MAT2 i;
+    i.m11 = d * (m.m22); i.m21 = d * -m.m21;
+    i.m12 = d * -(m.m12); i.m22 = d * m.m11;
+    return i;
+}
+
+/// Matrix multiplication
+static inline MAT2 vm_mat2_mul(MAT2 a, MAT2 b)
+{
+    MAT2 r;
+    r.m11 =  a.m11 * b.m11 + a.m21 * b.m12;
+    r.m21 =  a.m11 * b.m21 + a.m21 * b.m22;
+    r.m12 =  a.m12 * b.m11 + a.m22 * b.m12;
+    r.m22 =  a.m12 * b.m21 + a.m22 * b.m22;
+    return r;
+}
+
+/// Multiply matrix with a vector
+static inline VEC2 vm_mat2_mul_vec2(MAT2 m, VEC2 v)
+{
+    VEC2 r;
+    r.x =  m.m11 * v.x + m.m21 * v.y;
+    r.y =  m.m12 * v.x + m.m22 * v.y;
+    return r;
+}
+
+/// Is point inside a triangle (see mathext.h)
+static inline bool vm_inside_triangle(float px, float py, float x1, float y1, float x2, float y2, float x3, float y3)
+{
+    /*
+     * Explanation: https://stackoverflow.com/a/9755252
+    */
+
+    float as_x = px-x1;
+    float as_y = py-y1;
+
+    bool s_ab = (x2-x1)*as_y-(y2-y1)*as_x > 0;
+
+    if( ((x3-x1)*as_y-(y3-y1)*as_x > 0) == s_ab) return false;
+    if( ((x3-x2)*(py-y2)-(y3-y2)*(px-x2) > 0) != s_ab) return false;
+
+    return true;
+}
+
+#endif // __VECMATH__
@@ -0,0 +1,176 @@
+/// Worker threads (source)
+/// (c) 2018 Jani Nykänen
+
+#include "workers.h"
+
+#include "stdio.h"
+#include "stdbool.h"
+
+// Threads (the calling thread is not in the list)
+static SDL_Thread* threads[WK_MAX_THREADS];
+// Thread count, the calling thread included
+static int threadCount = 1;
+
+// Lock for everything below
+static SDL_mutex* lock;
+// Signaled when a job is posted
+static SDL_cond* jobPosted;
+// Signaled when the last worker is done
+static SDL_cond* jobDone;
+// Job number, workers wait for it to change
+static int generation;
+// Workers still busy with the current job
+static int busy;
+// Should the workers quit
+static bool quit;
+
+// Current job
+static WK_FUNC jobFunc;
+static void* jobUser;
+static int jobCount;
+static int jobGrain;
+// Next item to hand out
+static SDL_atomic_t next;
+
+
+// Take pieces of the current job until it runs out
+static void wk_work()
+{
+    int start;
+    while((start = SDL_AtomicAdd(&next,jobGrain)) < jobCount)
+    {
+        jobFunc(start,start + jobGrain < jobCount ? start + jobGrain : jobCount,jobUser);
+    }
+}
+
+
+// Worker thread
+static int wk_thread(void* data)
+{
+    // Generation is 0 when the threads are created
+    int seen = 0;
+    SDL_LockMutex(lock);
+    for(;;)
+    {
+        while(generation == seen && !quit)
+            SDL_CondWait(jobPosted,lock);
+        if(quit) break;
+
+        seen = generation;
+        SDL_UnlockMutex(lock);
+
+        wk_work();
+
+        SDL_LockMutex(lock);
+        if(-- busy == 0)
+            SDL_CondSignal(jobDone);
+    }
+    SDL_UnlockMutex(lock);
+
+    return 0;
+}
+
+
+// Start the workers
+int wk_init(int count)
+{
+    if(count <= 0)
+        count = SDL_GetCPUCount();
+    if(count > WK_MAX_THREADS)
+        count = WK_MAX_THREADS;
+    if(count <= 1)
+    {
+        threadCount = 1;
+        return 0;
+    }
+
+    lock = SDL_CreateMutex();
+    jobPosted = SDL_CreateCond();
+    jobDone = SDL_CreateCond();
+    if(lock == NULL || jobPosted == NULL || jobDone == NULL)
+    {
+        printf("Failed to create a worker lock!\n");
+        return 1;
+    }
+
+    generation = 0;
+    quit = false;
+
+    threadCount = 1;
+    for(; threadCount < count; ++ threadCount)
+    {
+        threads[threadCount-1] = SDL_CreateThread(wk_thread,"worker",NULL);
+        if(threads[threadCount-1] == NULL)
+        {
+            printf("Failed to create a worker thread!\n");
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+// Get thread count
+int wk_get_thread_count()
+{
+    return threadCount;
+}
+
+
+// Run a job
+void wk_run(WK_FUNC f, void* user, int count, int grain)
+{
+    if(count <= 0) return;
+    if(grain < 1) grain = 1;
+
+    // Not worth waking anyone
+    if(threadCount <= 1 || count <= grain)
+    {
+        f(0,count,user);
+        return;
+    }
+
+    SDL_LockMutex(lock);
+    jobFunc = f;
+    jobUser = user;
+    jobCount = count;
+    jobGrain = grain;
+    SDL_AtomicSet(&next,0);
+    busy = threadCount-1;
+    ++ generation;
+    SDL_CondBroadcast(jobPosted);
+    SDL_UnlockMutex(lock);
+
+    wk_work();
+
+    // Wait until every worker has seen the job, so the
+    // next one cannot start under a late worker
+    SDL_LockMutex(lock);
+    while(busy > 0)
+        SDL_CondWait(jobDone,lock);
+    SDL_UnlockMutex(lock);
+}
+
+
+// Stop the workers
+void wk_destroy()
+{
+    if(threadCount <= 1) return;
+
+    SDL_LockMutex(lock);
+    quit = true;
+    SDL_CondBroadcast(jobPosted);
+    SDL_UnlockMutex(lock);
+
+    int i = 0;
+    for(; i < threadCount-1; ++ i)
+    {
+        SDL_WaitThread(threads[i],NULL);
+    }
+    threadCount = 1;
+
+    SDL_DestroyCond(jobDone);
+    SDL_DestroyCond(jobPosted);
+    SDL_DestroyMutex(lock);
+}
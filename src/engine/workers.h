@@ -0,0 +1,42 @@
+/// Worker threads (header)
+/// (c) 2018 Jani Nykänen
+
+#ifndef __WORKERS__
+#define __WORKERS__
+
+#include "SDL2/SDL.h"
+
+/// Maximum thread count, the calling thread included
+#define WK_MAX_THREADS 16
+
+/// Job function, called for a range of items
+/// < start First item
+/// < end One past the last item
+/// < user User data
+typedef void (*WK_FUNC) (int start, int end, void* user);
+
+/// Start the worker threads
+/// < threads Thread count, the calling thread included.
+///   0 for one per CPU core
+/// > 0 on success, 1 on error
+int wk_init(int threads);
+
+/// Get the thread count
+/// > Thread count, the calling thread included
+int wk_get_thread_count();
+
+/// Run a job on every thread and wait for it to finish.
+/// Items are handed out in pieces of grain items in no
+/// particular order, so the job must not depend on which
+/// thread gets what. Runs on the calling thread only if
+/// the workers are not started
+/// < f Job function
+/// < user User data
+/// < count Item count
+/// < grain Items per piece
+void wk_run(WK_FUNC f, void* user, int count, int grain);
+
+/// Stop the worker threads
+void wk_destroy();
+
+#endif // __WORKERS__
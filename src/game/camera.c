@@ -4,6 +4,8 @@
 #include "camera.h"
 
 #include "../engine/transform.h"
+#include "../engine/graphics.h"
+#include "../engine/mathext.h"
 
 #include "stage.h"
 
@@ -81,22 +83,26 @@ void cam_follow_player(CAMERA* cam, PLAYER* pl, float tm)
     }
     pl->outsideCamera = false;
 
-    float dist = hypot(pl->pos.x-cam->pos.x,pl->pos.z-cam->pos.z);
-    float angle = atan2(pl->pos.z-cam->pos.z,pl->pos.x-cam->pos.x);
+    float dx = pl->pos.x-cam->pos.x;
+    float dz = pl->pos.z-cam->pos.z;
+    float d2 = dx*dx + dz*dz;
 
-    if(dist > 0.001f)
+    if(d2 > 0.001f*0.001f)
     {
-        float d = dist - 0.001f;
+        // Cosine & sine of the angle are the normalized
+        // delta, no need for atan2
+        float inv = fast_rsqrt(d2);
+        float d = d2*inv - 0.001f;
 
-        cam->pos.x += cos(angle) * (d/12.0f) *tm;
-        cam->pos.z += sin(angle) * (d/12.0f) *tm;
+        cam->pos.x += dx*inv * (d/12.0f) *tm;
+        cam->pos.z += dz*inv * (d/12.0f) *tm;
         cam->pos.y += (pl->pos.y - cam->pos.y) / 12.0f * tm;
     }    
 
     float targetAngle;
     if(world_ended())
     {
-        targetAngle = (M_PI + atan2(cam->pos.x,cam->pos.z));
+        targetAngle = ((float)M_PI + fast_atan2(cam->pos.x,cam->pos.z));
         if(!angleReached)
         {
             cam->angle.y += (targetAngle - cam->angle.y)/24.0f * tm;
@@ -125,10 +131,53 @@ void cam_follow_player(CAMERA* cam, PLAYER* pl, float tm)
 // Use camera
 void use_camera(CAMERA* cam)
 {
-    cam->vpos.x = cam->pos.x - cos(cam->angle.y - M_PI/2.0f) * cam->dist;
+    float s, c;
+    fast_sincos(cam->angle.y - (float)M_PI/2.0f,&s,&c);
+
+    cam->vpos.x = cam->pos.x - c * cam->dist;
     cam->vpos.y = cam->pos.y - 1.0f;
-    cam->vpos.z = cam->pos.z + sin(cam->angle.y - M_PI/2.0f) * cam->dist;
+    cam->vpos.z = cam->pos.z + s * cam->dist;
 
     tr_translate(-cam->vpos.x,-cam->vpos.y,-cam->vpos.z);
     tr_rotate_world(cam->angle.y,cam->angle.x);
-}
\ No newline at end of file
+}
+
+
+// Get view wedge
+VIEW_WEDGE cam_get_view(CAMERA* cam)
+{
+    // The view is w/h*fov wide at depth 1 (after fov),
+    // and ends at the far plane
+    FRAME* fr = get_current_frame();
+    float fov = tr_get_fov();
+
+    VIEW_WEDGE v;
+    float s, c;
+    fast_sincos(cam->angle.y,&s,&c);
+
+    v.eye = vec2(cam->vpos.x,cam->vpos.z);
+    v.fwd = vec2(s,c);
+    v.right = vec2(c,-s);
+    v.halfTan = (float)fr->w / (float)fr->h * fov;
+    v.invLen = 1.0f / sqrtf(1.0f + v.halfTan*v.halfTan);
+    v.dist = get_far_plane() / fov;
+
+    return v;
+}
+
+
+// Is a circle in view
+bool view_has_circle(VIEW_WEDGE* v, float x, float z, float r)
+{
+    float dx = x - v->eye.x;
+    float dz = z - v->eye.y;
+
+    float vz = dx*v->fwd.x + dz*v->fwd.y;
+    float vx = dx*v->right.x + dz*v->right.y;
+
+    if(vz < -r || vz > v->dist + r) return false;
+    if((v->halfTan*vz - vx) * v->invLen < -r) return false;
+    if((v->halfTan*vz + vx) * v->invLen < -r) return false;
+
+    return true;
+}
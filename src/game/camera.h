@@ -19,6 +19,18 @@ typedef struct
 }
 CAMERA;
 
+/// View wedge on XZ, for culling
+typedef struct
+{
+    VEC2 eye;
+    VEC2 fwd;
+    VEC2 right;
+    float halfTan; /// Tangent of the half view angle
+    float invLen; /// 1/sqrt(1+halfTan^2), side plane scale
+    float dist; /// View distance
+}
+VIEW_WEDGE;
+
 /// Create a new camera
 /// < pos Position
 /// > A new camera
@@ -33,4 +45,18 @@ void cam_follow_player(CAMERA* cam, PLAYER* pl, float tm);
 /// Use camera
 void use_camera(CAMERA* cam);
 
+/// Get the view wedge of the camera. Call after
+/// use_camera, uses the current frame, fov and far plane
+/// < cam Camera
+/// > View wedge
+VIEW_WEDGE cam_get_view(CAMERA* cam);
+
+/// Might a circle on XZ be in the view
+/// < v View wedge
+/// < x Center x
+/// < z Center z
+/// < r Radius
+/// > True, if might be visible
+bool view_has_circle(VIEW_WEDGE* v, float x, float z, float r);
+
 #endif // __CAMERA__
\ No newline at end of file
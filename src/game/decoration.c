@@ -4,6 +4,8 @@
 #include "decoration.h"
 
 #include "../engine/transform.h"
+#include "../engine/mathext.h"
+#include "../engine/vecmath.h"
 
 #include "stdio.h"
 #include "stdlib.h"
@@ -12,6 +14,11 @@
 
 #define IS(s,x) strcmp(s,x) == 0
 
+// Default grid cell size
+#define DEC_CELL_SIZE 8.0f
+// Initial store capacity
+#define DEC_CAPACITY 32
+
 // Create a new decoration
 DECORATION new_decoration(VEC3 pos, VEC3 scale, MESH* m, BITMAP* texture)
 {
@@ -20,10 +27,285 @@ DECORATION new_decoration(VEC3 pos, VEC3 scale, MESH* m, BITMAP* texture)
     d.scale = scale;
     d.mesh = m;
     d.texture = texture;
+    d.lod = 0;
+
+    // Bounds on XZ. Scale might be negative
+    d.minV = vec2(pos.x,pos.z);
+    d.maxV = d.minV;
+    if(m != NULL)
+    {
+        float x1 = pos.x + m->minV.x*scale.x;
+        float x2 = pos.x + m->maxV.x*scale.x;
+        float z1 = pos.z + m->minV.z*scale.z;
+        float z2 = pos.z + m->maxV.z*scale.z;
+        d.minV = vec2(vm_minf(x1,x2),vm_minf(z1,z2));
+        d.maxV = vec2(vm_maxf(x1,x2),vm_maxf(z1,z2));
+    }
+
     return d;
 }
 
 
+// Cell coordinates of a point, clamped to the grid
+static void dec_cell_of(DEC_STORE* s, float x, float z, int* cx, int* cz)
+{
+    *cx = (int)floorf((x - s->originX) / s->cellSize);
+    *cz = (int)floorf((z - s->originZ) / s->cellSize);
+
+    if(*cx < 0) *cx = 0;
+    if(*cx >= s->cellsX) *cx = s->cellsX-1;
+    if(*cz < 0) *cz = 0;
+    if(*cz >= s->cellsZ) *cz = s->cellsZ-1;
+}
+
+
+// Create a store
+DEC_STORE* dec_store_create()
+{
+    DEC_STORE* s = (DEC_STORE*)malloc(sizeof(DEC_STORE));
+    if(s == NULL)
+    {
+        printf("Memory allocation error!\n");
+        return NULL;
+    }
+
+    s->decs = NULL;
+    s->count = 0;
+    s->capacity = 0;
+
+    s->cellSize = DEC_CELL_SIZE;
+    s->originX = 0.0f;
+    s->originZ = 0.0f;
+    s->cellsX = 0;
+    s->cellsZ = 0;
+    s->cellStart = NULL;
+    s->items = NULL;
+    s->reach = 0.0f;
+
+    return s;
+}
+
+
+// Add a decoration
+int dec_store_add(DEC_STORE* s, DECORATION d)
+{
+    if(s->count >= s->capacity)
+    {
+        int cap = s->capacity == 0 ? DEC_CAPACITY : s->capacity*2;
+        DECORATION* decs = (DECORATION*)realloc(s->decs,sizeof(DECORATION) * cap);
+        if(decs == NULL)
+        {
+            printf("Memory allocation error!\n");
+            return 1;
+        }
+        s->decs = decs;
+        s->capacity = cap;
+    }
+
+    s->decs[s->count ++] = d;
+
+    return 0;
+}
+
+
+// Build the index
+int dec_store_build(DEC_STORE* s)
+{
+    free(s->cellStart);
+    free(s->items);
+    s->cellStart = NULL;
+    s->items = NULL;
+    s->cellsX = 0;
+    s->cellsZ = 0;
+    s->reach = 0.0f;
+
+    if(s->count == 0) return 0;
+
+    // Bounds of the centers, and the reach
+    float minX = 0.0f, minZ = 0.0f, maxX = 0.0f, maxZ = 0.0f;
+    float cx, cz;
+    DECORATION* d;
+    int i = 0;
+    for(; i < s->count; ++ i)
+    {
+        d = &s->decs[i];
+        cx = (d->minV.x + d->maxV.x) / 2;
+        cz = (d->minV.y + d->maxV.y) / 2;
+        if(i == 0 || cx < minX) minX = cx;
+        if(i == 0 || cx > maxX) maxX = cx;
+        if(i == 0 || cz < minZ) minZ = cz;
+        if(i == 0 || cz > maxZ) maxZ = cz;
+
+        s->reach = vm_maxf(s->reach,vm_maxf(cx - d->minV.x,cz - d->minV.y));
+    }
+
+    // Keep the cell count in proportion to the
+    // decoration count for sparse layouts
+    int maxCells = s->count*4 < 64 ? 64 : s->count*4;
+    s->cellSize = DEC_CELL_SIZE;
+    for(;;)
+    {
+        s->cellsX = (int)floorf((maxX-minX) / s->cellSize) +1;
+        s->cellsZ = (int)floorf((maxZ-minZ) / s->cellSize) +1;
+        if(s->cellsX * s->cellsZ <= maxCells) break;
+        s->cellSize *= 2.0f;
+    }
+    s->originX = minX;
+    s->originZ = minZ;
+
+    int cellCount = s->cellsX * s->cellsZ;
+    s->cellStart = (int*)calloc(cellCount+1,sizeof(int));
+    s->items = (int*)malloc(sizeof(int) * s->count);
+    int* cells = (int*)malloc(sizeof(int) * s->count);
+    if(s->cellStart == NULL || s->items == NULL || cells == NULL)
+    {
+        printf("Memory allocation error!\n");
+        free(cells);
+
+        // Leave the store without an index, queries
+        // then find nothing
+        free(s->cellStart);
+        free(s->items);
+        s->cellStart = NULL;
+        s->items = NULL;
+        s->cellsX = 0;
+        s->cellsZ = 0;
+        return 1;
+    }
+
+    // Count per cell, then fill backwards so the
+    // bucket ends become starts
+    int x, z;
+    for(i = 0; i < s->count; ++ i)
+    {
+        d = &s->decs[i];
+        dec_cell_of(s,(d->minV.x + d->maxV.x) / 2,(d->minV.y + d->maxV.y) / 2,&x,&z);
+        cells[i] = z * s->cellsX + x;
+        ++ s->cellStart[cells[i]];
+    }
+    for(i = 1; i <= cellCount; ++ i)
+    {
+        s->cellStart[i] += s->cellStart[i-1];
+    }
+    for(i = s->count-1; i >= 0; -- i)
+    {
+        s->items[-- s->cellStart[cells[i]]] = i;
+    }
+
+    free(cells);
+
+    return 0;
+}
+
+
+// Query a box
+void dec_store_query_box(DEC_STORE* s, VEC2 minV, VEC2 maxV, DEC_FUNC f, void* user)
+{
+    if(s->cellStart == NULL) return;
+
+    int sx, sz, ex, ez;
+    dec_cell_of(s,minV.x - s->reach,minV.y - s->reach,&sx,&sz);
+    dec_cell_of(s,maxV.x + s->reach,maxV.y + s->reach,&ex,&ez);
+
+    DECORATION* d;
+    int x, z, k, c;
+    for(z = sz; z <= ez; ++ z)
+    {
+        for(x = sx; x <= ex; ++ x)
+        {
+            c = z * s->cellsX + x;
+            for(k = s->cellStart[c]; k < s->cellStart[c+1]; ++ k)
+            {
+                d = &s->decs[s->items[k]];
+                if(d->maxV.x < minV.x || d->minV.x > maxV.x
+                || d->maxV.y < minV.y || d->minV.y > maxV.y)
+                    continue;
+
+                f(d,user);
+            }
+        }
+    }
+}
+
+
+// View query context
+typedef struct
+{
+    VIEW_WEDGE* v;
+    DEC_FUNC f;
+    void* user;
+}
+VIEW_QUERY;
+
+
+// Test a decoration against the view wedge, as a circle
+static void dec_view_test(DECORATION* d, void* user)
+{
+    VIEW_QUERY* q = (VIEW_QUERY*)user;
+
+    float hx = (d->maxV.x - d->minV.x) / 2;
+    float hz = (d->maxV.y - d->minV.y) / 2;
+
+    if(view_has_circle(q->v,d->minV.x + hx,d->minV.y + hz,sqrtf(hx*hx + hz*hz)))
+        q->f(d,q->user);
+}
+
+
+// Query the view
+void dec_store_query_view(DEC_STORE* s, VIEW_WEDGE* v, DEC_FUNC f, void* user)
+{
+    VIEW_QUERY q;
+    q.v = v;
+    q.f = f;
+    q.user = user;
+
+    // Bounds of the wedge
+    float dist = v->dist;
+    VEC2 a = vec2(v->eye.x + (v->fwd.x + v->right.x*v->halfTan) * dist,
+        v->eye.y + (v->fwd.y + v->right.y*v->halfTan) * dist);
+    VEC2 b = vec2(v->eye.x + (v->fwd.x - v->right.x*v->halfTan) * dist,
+        v->eye.y + (v->fwd.y - v->right.y*v->halfTan) * dist);
+
+    VEC2 minV = vec2(vm_minf(v->eye.x,vm_minf(a.x,b.x)),vm_minf(v->eye.y,vm_minf(a.y,b.y)));
+    VEC2 maxV = vec2(vm_maxf(v->eye.x,vm_maxf(a.x,b.x)),vm_maxf(v->eye.y,vm_maxf(a.y,b.y)));
+
+    dec_store_query_box(s,minV,maxV,dec_view_test,&q);
+}
+
+
+// Get memory used
+size_t dec_store_get_size(DEC_STORE* s)
+{
+    if(s == NULL) return 0;
+
+    size_t size = sizeof(DEC_STORE) + sizeof(DECORATION) * s->capacity;
+    if(s->cellStart != NULL)
+        size += sizeof(int) * (s->cellsX*s->cellsZ +1 + s->count);
+
+    return size;
+}
+
+
+// Remove every decoration
+void dec_store_clear(DEC_STORE* s)
+{
+    s->count = 0;
+    dec_store_build(s);
+}
+
+
+// Destroy a store
+void dec_store_destroy(DEC_STORE* s)
+{
+    if(s == NULL) return;
+
+    free(s->decs);
+    free(s->cellStart);
+    free(s->items);
+    free(s);
+}
+
+
 // Draw a decoration
 void draw_decoration(DECORATION* d)
 {
@@ -32,12 +314,12 @@ void draw_decoration(DECORATION* d)
     
     bind_texture(d->texture);
 
-    draw_mesh(d->mesh);
+    draw_mesh_lod(d->mesh,&d->lod);
 }
 
 
 // Read decorations from a layout file
-int read_decoration_from_layout(ASSET_PACK* ass, WORDDATA* wd, DECORATION* dec)
+int read_decoration_from_layout(ASSET_PACK* ass, WORDDATA* wd, DEC_STORE* s)
 {
     MESH* m = NULL;
     BITMAP* bmp = NULL;
@@ -45,8 +327,6 @@ int read_decoration_from_layout(ASSET_PACK* ass, WORDDATA* wd, DECORATION* dec)
     VEC3 scale = vec3(1,1,1);
     char* w = NULL;
 
-    int decCount = 0;
-
     int i = 0;
     for(; i < wd->wordCount; ++ i)
     {
@@ -75,22 +355,28 @@ int read_decoration_from_layout(ASSET_PACK* ass, WORDDATA* wd, DECORATION* dec)
         }
         else if(IS(w,"add"))
         {
-            dec[decCount] = new_decoration(pos,scale,m,bmp);
-            ++ decCount;
+            if(dec_store_add(s,new_decoration(pos,scale,m,bmp)) == 1)
+                return 1;
         }
 
     }
 
-    return decCount;
+    return dec_store_build(s);
+}
+
+
+// Collide with one decoration
+static void dec_player_collision(DECORATION* d, void* user)
+{
+    pl_mesh_collision((PLAYER*)user,d->mesh,d->pos,d->scale);
 }
 
 
 // Player-decorations collisions
-void player_decoration_collision(PLAYER* pl, DECORATION* dec, int count)
+void player_decoration_collision(PLAYER* pl, DEC_STORE* s)
 {
-    int i = 0;
-    for(; i < count; ++ i)
-    {
-        pl_mesh_collision(pl,dec[i].mesh,dec[i].pos,dec[i].scale);
-    }
+    // Same margin as in pl_mesh_collision
+    float r = pl->radius*2;
+    dec_store_query_box(s,vec2(pl->pos.x-r,pl->pos.z-r),vec2(pl->pos.x+r,pl->pos.z+r),
+        dec_player_collision,pl);
 }
\ No newline at end of file
@@ -11,6 +11,7 @@
 #include "../lib/parseword.h"
 
 #include "player.h"
+#include "camera.h"
 
 /// Decoration type
 typedef struct
@@ -19,16 +20,94 @@ typedef struct
     VEC3 scale;
     MESH* mesh;
     BITMAP* texture;
+
+    VEC2 minV; /// XZ bounds, world space
+    VEC2 maxV;
+
+    Uint8 lod; /// Mesh detail level last drawn
 }
 DECORATION;
 
+/// Decoration store. Decorations are bucketed in a 2D
+/// grid on XZ by the center of their bounds, so a query
+/// only visits the cells around it
+typedef struct
+{
+    DECORATION* decs;
+    int count;
+    int capacity;
+
+    float cellSize;
+    float originX;
+    float originZ;
+    int cellsX;
+    int cellsZ;
+    int* cellStart; /// Bucket start indices (cellsX*cellsZ+1)
+    int* items; /// Decoration indices, ordered by bucket
+    float reach; /// How far a decoration reaches out of its cell
+}
+DEC_STORE;
+
+/// Decoration callback
+/// < d Decoration
+/// < user User data
+typedef void (*DEC_FUNC) (DECORATION* d, void* user);
+
 /// Create a new decoration
 /// < pos Position
 /// < scale Scaling
 /// < m Mesh
 /// < texture Texture
+/// > A new decoration
 DECORATION new_decoration(VEC3 pos, VEC3 scale, MESH* m, BITMAP* texture);
 
+/// Create an empty decoration store
+/// > A new store
+DEC_STORE* dec_store_create();
+
+/// Add a decoration. Not visible to queries before the
+/// next dec_store_build
+/// < s Store
+/// < d Decoration
+/// > 0 on success, 1 on memory error
+int dec_store_add(DEC_STORE* s, DECORATION d);
+
+/// Build the spatial index. On a memory error the store
+/// is left without an index and queries find nothing
+/// < s Store
+/// > 0 on success, 1 on memory error
+int dec_store_build(DEC_STORE* s);
+
+/// Call a function for every decoration whose bounds
+/// overlap a box on XZ
+/// < s Store
+/// < minV Box minimum (x,z)
+/// < maxV Box maximum (x,z)
+/// < f Callback
+/// < user User data passed to the callback
+void dec_store_query_box(DEC_STORE* s, VEC2 minV, VEC2 maxV, DEC_FUNC f, void* user);
+
+/// Call a function for every decoration that might be
+/// in the view
+/// < s Store
+/// < v View wedge
+/// < f Callback
+/// < user User data passed to the callback
+void dec_store_query_view(DEC_STORE* s, VIEW_WEDGE* v, DEC_FUNC f, void* user);
+
+/// Get the memory used by a store
+/// < s Store, can be NULL
+/// > Size in bytes
+size_t dec_store_get_size(DEC_STORE* s);
+
+/// Remove every decoration
+/// < s Store
+void dec_store_clear(DEC_STORE* s);
+
+/// Destroy a store
+/// < s Store
+void dec_store_destroy(DEC_STORE* s);
+
 /// Draw a decoration
 /// < dec Decoration
 void draw_decoration(DECORATION* dec);
@@ -36,14 +115,14 @@ void draw_decoration(DECORATION* dec);
 /// Read decorations from a layout file
 /// < ass Asset pack
 /// < wd Word data
-/// < dec An array of decorations
-/// > Decoration count
-int read_decoration_from_layout(ASSET_PACK* ass, WORDDATA* wd, DECORATION* dec);
+/// < s Store to add the decorations to
+/// > 0 on success, 1 on memory error
+int read_decoration_from_layout(ASSET_PACK* ass, WORDDATA* wd, DEC_STORE* s);
 
-/// Player-decorations collisions
+/// Player-decorations collisions, only for the
+/// decorations near the player
 /// < pl Player
-/// < dec Decorations
-/// < count Decoration count
-void player_decoration_collision(PLAYER* pl, DECORATION* dec, int count);
+/// < s Decoration store
+void player_decoration_collision(PLAYER* pl, DEC_STORE* s);
 
 #endif // __DECORATION__
\ No newline at end of file
@@ -9,7 +9,10 @@
 #include "../engine/controls.h"
 #include "../engine/assets.h"
 #include "../engine/transform.h"
+#include "../engine/mathext.h"
 #include "../engine/mesh.h"
+#include "../engine/grid.h"
+#include "../engine/workers.h"
 
 #include "../lib/parseword.h"
 
@@ -19,14 +22,21 @@
 #include "player.h"
 #include "camera.h"
 #include "stage.h"
+#include "school.h"
+#include "world.h"
 
 #include "stdio.h"
 #include "stdlib.h"
 #include "math.h"
 #include "time.h"
 
-// Maximum fish count
-#define MAX_FISH 16
+// Fish-to-fish reach (radius sum times the collision factor)
+#define FISH_REACH (PL_RADIUS*2*PL_SEPARATION_FACTOR)
+// Grid cell size. Leaves some room for fish moving during
+// a tick, since the grid is built once per tick
+#define FISH_CELL_SIZE (FISH_REACH + 0.5f)
+// Fish per stage collision job piece
+#define FISH_JOB_GRAIN 64
 
 // Bitmap font
 static BITMAP* bmpFont;
@@ -37,8 +47,10 @@ static PLAYER player;
 static CAMERA cam;
 
 // Fish
-static PLAYER fish[MAX_FISH];
-static int fishCount;
+static SCHOOL* school;
+
+// Fish broad phase
+static GRID* fishGrid;
 
 // Time
 static float timer;
@@ -56,29 +68,27 @@ static void make_fish_disappear(float tm)
 {
     const float ULIMIT = -25.0f;
 
-    PLAYER* f;
     int i = 0;
-    float angle;
+    float s, c;
     int above = 0;
-    for(; i < fishCount; ++ i)
+    for(; i < school->count; ++ i)
     {
-        f = &fish[i];
-        angle = atan2(f->pos.z,f->pos.x);
-        f->speed.x -= cos(angle) * 0.05f * tm;
-        f->speed.z -= sin(angle) * 0.05f * tm;
+        fast_sincos(fast_atan2(school->pos.z[i],school->pos.x[i]),&s,&c);
+        school->speed.x[i] -= c * 0.05f * tm;
+        school->speed.z[i] -= s * 0.05f * tm;
 
         if(fishApocTimer > 240.0f)
         {
-            f->speed.y = 0.0f;
-            f->pos.y -= 0.05f * tm;
+            school->speed.y[i] = 0.0f;
+            school->pos.y[i] -= 0.05f * tm;
         }
 
 
-        if(f->pos.y < ULIMIT)
+        if(school->pos.y[i] < ULIMIT)
             ++ above;
     }
 
-    if(above >= fishCount)
+    if(above >= school->count)
     {
         game_start_fading();
     }
@@ -110,6 +120,53 @@ static void draw_timer()
 }
 
 
+// Push a fish to the school. The fish is seeded with
+// its index, the player has seed 0
+static int push_fish(VEC3 pos)
+{
+    PLAYER f = pl_create(pos,(Uint32)school->count + 1);
+    f.control = false;
+
+    float mod = pl_random_speed_mod(&f.rng);
+    f.maxSpeed.x *= mod;
+    f.maxSpeed.y *= mod;
+    f.maxSpeed.z *= mod;
+
+    return school_add(school,&f);
+}
+
+
+// Fish-stage collision job
+static void fish_stage_job(int start, int end, void* user)
+{
+    float tm = *(float*)user;
+
+    PLAYER f;
+    int i = start;
+    for(; i < end; ++ i)
+    {
+        school_get(school,i,&f);
+        stage_player_collision(&f,tm);
+        school_set(school,i,&f);
+    }
+}
+
+
+// Fish-to-fish collision for a grid neighbour
+static void fish_pair_collision(Uint32 index, void* user)
+{
+    int self = *(int*)user;
+    if((int)index == self) return;
+
+    VEC3 a = vec3(school->pos.x[self],school->pos.y[self],school->pos.z[self]);
+    VEC3 b = vec3(school->pos.x[index],school->pos.y[index],school->pos.z[index]);
+    pl_separate(&a,school->radius[self],&b,school->radius[index]);
+
+    school->pos.x[self] = a.x; school->pos.y[self] = a.y; school->pos.z[self] = a.z;
+    school->pos.x[index] = b.x; school->pos.y[index] = b.y; school->pos.z[index] = b.z;
+}
+
+
 // Add NPC fish to the game
 static int add_fish()
 {
@@ -123,6 +180,7 @@ static int add_fish()
     char* w;
 
     VEC3 pos = vec3(0,0,0);
+    Uint32 rng = rand_seed(0);
 
     for(; i < wd->wordCount; ++ i)
     {
@@ -142,20 +200,34 @@ static int add_fish()
         }
         else if(strcmp(w,"add") == 0)
         {
-            fish[fishCount] = pl_create(pos);
-            fish[fishCount].control = false;
-            
-
-            float mod = (float)(rand() % 100) / 100.0f * 0.5f + 0.75f;
-            fish[fishCount].maxSpeed.x *= mod;
-            fish[fishCount].maxSpeed.y *= mod;
-            fish[fishCount].maxSpeed.z *= mod;
-
-            ++ fishCount;
+            if(push_fish(pos) == 1)
+                break;
+        }
+        // "school count spread": add a number of fish
+        // around the current position
+        else if(strcmp(w,"school") == 0)
+        {
+            int count = (int)strtol(get_word(wd,i+1),NULL,10);
+            float spread = strtof(get_word(wd,i+2),NULL);
+            int k = 0;
+            for(; k < count; ++ k)
+            {
+                VEC3 p = vec3(
+                    pos.x + ((float)(rand_next(&rng) % 1000) / 500.0f - 1.0f) * spread,
+                    pos.y + ((float)(rand_next(&rng) % 1000) / 500.0f - 1.0f) * spread,
+                    pos.z + ((float)(rand_next(&rng) % 1000) / 500.0f - 1.0f) * spread);
+                if(push_fish(p) == 1)
+                    break;
+            }
+            if(k < count) break;
         }
     }
 
-    return 0;
+    // Stopped early on an error
+    int ret = i < wd->wordCount ? 1 : 0;
+    destroy_word_data(wd);
+
+    return ret;
 }
 
 
@@ -170,11 +242,15 @@ static int game_init()
     if(init_stage(ass) == 1)
         return 1;
 
-    player = pl_create(vec3(0.0f,-3.0f,-35.0f));
+    player = pl_create(vec3(0.0f,-3.0f,-35.0f),0);
     cam = create_camera(player.pos);
 
-    fishCount = 0;
-    if(add_fish() == 1)
+    school = school_create();
+    if(school == NULL || add_fish() == 1)
+        return 1;
+
+    fishGrid = grid_create(FISH_CELL_SIZE);
+    if(fishGrid == NULL)
         return 1;
 
     timer = 100.0f * 60.0f;
@@ -195,23 +271,29 @@ static void game_update(float tm)
     pl_update(&player,tm);
     stage_player_collision(&player,tm);
     cam_follow_player(&cam,&player,tm);
+    world_update(cam.pos);
 
-    // Update fish
-    int i = 0;
-    int i2 = 0;
-    for(; i < fishCount; ++ i)
+    // Move fish and collide them with the stage. Every
+    // fish only touches itself here, so this runs on
+    // the workers
+    school_update(school,tm);
+    wk_run(fish_stage_job,&tm,school->count,FISH_JOB_GRAIN);
+
+    // Fish-to-player and fish-to-fish collisions move two
+    // fish at once, so they run here, in fish order
+    if(!world_ended())
     {
-        pl_update(&fish[i],tm);
-        stage_player_collision(&fish[i],tm);
+        grid_build(fishGrid,school->pos.x,school->pos.y,school->pos.z,school->count);
 
-        if(!world_ended())
+        VEC3 p;
+        int i = 0;
+        for(; i < school->count; ++ i)
         {
-            player_to_player_collision(&player,&fish[i],tm);
-            for(i2 = 0; i2 < fishCount; ++ i2)
-            {
-                if(i != i2)
-                    player_to_player_collision(&fish[i],&fish[i2],tm);
-            }
+            p = vec3(school->pos.x[i],school->pos.y[i],school->pos.z[i]);
+            pl_separate(&player.pos,player.radius,&p,school->radius[i]);
+            school->pos.x[i] = p.x; school->pos.y[i] = p.y; school->pos.z[i] = p.z;
+
+            grid_query(fishGrid,p.x,p.y,p.z,fish_pair_collision,&i);
         }
     }
 
@@ -262,11 +344,7 @@ static void game_draw()
     draw_stage(&cam);
 
     // Draw other fish
-    int i = 0;
-    for(; i < fishCount; ++ i)
-    {
-        pl_draw(&fish[i]);
-    }
+    school_draw(school);
 
     toggle_darkness(false);
 
@@ -291,7 +369,9 @@ static void game_draw()
 // Destroy game
 static void game_destroy()
 {
-
+    grid_destroy(fishGrid);
+    school_destroy(school);
+    destroy_stage();
 }
 
 
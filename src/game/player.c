@@ -6,6 +6,7 @@
 #include "../engine/graphics.h"
 #include "../engine/transform.h"
 #include "../engine/mathext.h"
+#include "../engine/vecmath.h"
 
 #include "stdio.h"
 #include "stdlib.h"
@@ -126,10 +127,10 @@ static void pl_ai_control(PLAYER* pl, float tm)
     if(pl->swimAngleMod >= MAX_SWIM)
     {
         pl->swimAngleMod -= MAX_SWIM;
-        pl->swimWave = (float)(rand() % 1000) / 1000.0f * SWIMV_MAX + SWIMV_MIN;
-        pl->dir = (rand() % 2 == 0 ? 1.0f : -1.0f);
+        pl->swimWave = pl_random_swim_wave(&pl->rng);
+        pl->dir = pl_random_dir(&pl->rng);
 
-        float mod = (float)(rand() % 100) / 100.0f * 0.5f + 0.75f;
+        float mod = pl_random_speed_mod(&pl->rng);
         pl->maxSpeed.x *= mod;
         pl->maxSpeed.y *= mod;
         pl->maxSpeed.z *= mod;
@@ -137,17 +138,24 @@ static void pl_ai_control(PLAYER* pl, float tm)
     if(pl->swimAngleMod2 >= MAX_SWIM)
     {
         pl->swimAngleMod2 -= MAX_SWIM;
-        pl->swimWave2 = ( (float)(rand() % 1000) / 1000.0f * SWIMV_MAX + SWIMV_MIN );
+        pl->swimWave2 = pl_random_swim_wave(&pl->rng);
     }
 
-    pl->angle.y += 0.01f* pl->dir *sin( pl->swimAngleMod) * M_PI;
-    pl->angle.x += 0.025f* -1.0f * pl->dir *cos(pl->swimAngleMod2) * (M_PI/4.0f);
+    float s1, c1, s2, c2;
+    fast_sincos(pl->swimAngleMod,&s1,&c1);
+    fast_sincos(pl->swimAngleMod2,&s2,&c2);
+
+    pl->angle.y += 0.01f* pl->dir *s1 * (float)M_PI;
+    pl->angle.x += 0.025f* -1.0f * pl->dir *c2 * (float)(M_PI/4.0f);
 
     pl_limit_angle(pl);
 
-    pl->target.x = sin(pl->angle.y) * pl->maxSpeed.x;
-    pl->target.z = cos(pl->angle.y) * pl->maxSpeed.z;
-    pl->target.y = sin(pl->angle.x) * pl->maxSpeed.y;
+    fast_sincos(pl->angle.y,&s1,&c1);
+    fast_sincos(pl->angle.x,&s2,&c2);
+
+    pl->target.x = s1 * pl->maxSpeed.x;
+    pl->target.z = c1 * pl->maxSpeed.z;
+    pl->target.y = s2 * pl->maxSpeed.y;
 }
 
 
@@ -156,10 +164,12 @@ static void pl_control(PLAYER* pl)
 {
     const float END_BORDER = 40.0f;
 
+    float s, c;
     if(!pl->canControl)
     {
-        pl->target.x = sin(pl->angle.y) * pl->maxSpeed.x;
-        pl->target.z = cos(pl->angle.y) * pl->maxSpeed.z;
+        fast_sincos(pl->angle.y,&s,&c);
+        pl->target.x = s * pl->maxSpeed.x;
+        pl->target.z = c * pl->maxSpeed.z;
         return;
     }
 
@@ -192,8 +202,9 @@ static void pl_control(PLAYER* pl)
 
     pl_limit_angle(pl);
 
-    pl->target.x = sin(pl->angle.y) * pl->maxSpeed.x;
-    pl->target.z = cos(pl->angle.y) * pl->maxSpeed.z;
+    fast_sincos(pl->angle.y,&s,&c);
+    pl->target.x = s * pl->maxSpeed.x;
+    pl->target.z = c * pl->maxSpeed.z;
 
     if(!world_ended() && (pl->pos.z < -END_BORDER || pl->pos.z > END_BORDER || pl->pos.x < -END_BORDER || pl->pos.x > END_BORDER))
     {
@@ -229,27 +240,52 @@ static void pl_move(PLAYER* pl, float tm)
 }
 
 
-// Player-triangle collision
-static void pl_triangle_collision(PLAYER* pl, VEC3 A, VEC3 B, VEC3 C, VEC3 N)
+// Mesh collision context
+typedef struct
+{
+    PLAYER* pl;
+    VEC3 tr;
+    VEC3 sc;
+    VEC3 inv; // 1 / scale
+}
+MESH_COLLISION;
+
+
+// Player-triangle collision. The triangle is in mesh space, so
+// the player position is moved there for the tests
+static void pl_triangle_collision(BVH_TRIANGLE* t, void* user)
 {
-    if(!(inside_triangle(pl->pos.x,pl->pos.y,A.x,A.y,B.x,B.y,C.x,C.y)
-    || inside_triangle(pl->pos.x,pl->pos.z,A.x,A.z,B.x,B.z,C.x,C.z)
-    || inside_triangle(pl->pos.y,pl->pos.z,A.y,A.z,B.y,B.z,C.y,C.z)))
+    MESH_COLLISION* c = (MESH_COLLISION*)user;
+    PLAYER* pl = c->pl;
+    VEC3 A = t->A;
+    VEC3 B = t->B;
+    VEC3 C = t->C;
+    VEC3 N = t->N;
+
+    // Scaling the axes does not change the 2D inside tests
+    VEC3 p = vec3((pl->pos.x-c->tr.x) * c->inv.x,
+        (pl->pos.y-c->tr.y) * c->inv.y,
+        (pl->pos.z-c->tr.z) * c->inv.z);
+
+    if(!(vm_inside_triangle(p.x,p.y,A.x,A.y,B.x,B.y,C.x,C.y)
+    || vm_inside_triangle(p.x,p.z,A.x,A.z,B.x,B.z,C.x,C.z)
+    || vm_inside_triangle(p.y,p.z,A.y,A.z,B.y,B.z,C.y,C.z)))
     {
         return;
     }
 
-    float d = -(N.x * A.x + N.y * A.y + N.z * A.z);
-    float dist = (pl->pos.x * N.x + pl->pos.y * N.y + pl->pos.z * N.z + d) 
-            / sqrt( N.x*N.x + N.y*N.y + N.z*N.z);
+    // Distance to the plane of the scaled triangle
+    float dist = (N.x*c->sc.x*(p.x-A.x) + N.y*c->sc.y*(p.y-A.y) + N.z*c->sc.z*(p.z-A.z)) 
+            * t->invLen;
 
     float dir = dist > 0 ? 1.0f : -1.0f;
+    float depth = fabsf(dist);
 
-    if(fabs(dist) < pl->radius)
+    if(depth < pl->radius)
     {
-        pl->pos.x -= dir* N.x * (fabs(dist)-pl->radius);
-        pl->pos.y -= dir* N.y * (fabs(dist)-pl->radius);
-        pl->pos.z -= dir* N.z * (fabs(dist)-pl->radius);
+        pl->pos.x -= dir* N.x * (depth-pl->radius);
+        pl->pos.y -= dir* N.y * (depth-pl->radius);
+        pl->pos.z -= dir* N.z * (depth-pl->radius);
 
         pl->speed.x += dir * N.x  * pl->maxSpeed.x * 0.5f;
         pl->speed.y += dir * N.y  * pl->maxSpeed.y * 0.5f;
@@ -268,14 +304,14 @@ void init_player(ASSET_PACK* ass)
 
 
 // Create
-PLAYER pl_create(VEC3 pos)
+PLAYER pl_create(VEC3 pos, Uint32 seed)
 {
     PLAYER pl;
     pl.pos = pos;
     pl.speed = vec3(0,0,0);
     pl.target = pl.speed;
 
-    pl.radius = 0.5f;
+    pl.radius = PL_RADIUS;
 
     pl.maxSpeed = vec3(MAX_SPEED,MAX_SPEED,MAX_SPEED);
     pl.angleMax = vec3(MAX_ANGLE_XZ,MAX_ANGLE_Y,MAX_ANGLE_XZ);
@@ -286,11 +322,13 @@ PLAYER pl_create(VEC3 pos)
     pl.angle = vec3(0,0,0);
     pl.angleSpeed = vec3(0,0,0);
     pl.angleTarget = vec3(0,0,0);
-    pl.swimAngleMod = (float)(rand() % 1000)/1000.0f * M_PI*2;;
+    pl.rng = rand_seed(seed);
+    pl.swimAngleMod = (float)(rand_next(&pl.rng) % 1000)/1000.0f * M_PI*2;
+    pl.swimAngleMod2 = 0.0f;
 
-    pl.swimWave = (float)(rand() % 1000) / 1000.0f * SWIMV_MAX + SWIMV_MIN;
-    pl.swimWave2 = ( (float)(rand() % 1000) / 1000.0f * SWIMV_MAX + SWIMV_MIN );
-    pl.dir = (rand() % 2 == 0 ? 1.0f : -1.0f);
+    pl.swimWave = pl_random_swim_wave(&pl.rng);
+    pl.swimWave2 = pl_random_swim_wave(&pl.rng);
+    pl.dir = pl_random_dir(&pl.rng);
 
     pl.control = true;
     pl.outsideCamera = false;
@@ -326,58 +364,49 @@ void pl_draw(PLAYER* pl)
 }
 
 
-// Player-mesh collision
-void pl_mesh_collision(PLAYER* pl, MESH* m, VEC3 tr, VEC3 sc)
+// Get the instance of an NPC fish
+INSTANCE pl_get_instance(VEC3 pos, VEC3 angle)
 {
-    if(pl == NULL || m == NULL) return;
-
-    VEC3 minV = m->minV;
-    VEC3 maxV = m->maxV;
-
-    minV.x *= sc.x; minV.x += tr.x;
-    minV.y *= sc.y; minV.y += tr.y;
-    minV.z *= sc.z; minV.z += tr.z;
-
-    maxV.x *= sc.x; maxV.x += tr.x;
-    maxV.y *= sc.y; maxV.y += tr.y;
-    maxV.z *= sc.z; maxV.z += tr.z;
-    
-    minV.x -= pl->radius*2; minV.y -= pl->radius*2; minV.z -= pl->radius*2;
-    maxV.x += pl->radius*2; maxV.y += pl->radius*2; maxV.z += pl->radius*2;
-
-    if(pl->pos.x < minV.x || pl->pos.x > maxV.x
-    || pl->pos.y < minV.y || pl->pos.y > maxV.y
-    || pl->pos.z < minV.z || pl->pos.z > maxV.z) 
-        return;
-
-    VEC3 A;
-    VEC3 B;
-    VEC3 C;
-    VEC3 N;
-
-    int i = 0;
-    for(; i < m->elementCount; i += 3)
-    {
-        A = vec3(m->vertices[m->indices[i]*3],m->vertices[m->indices[i]*3 +1],m->vertices[m->indices[i]*3+2]);
-        B = vec3(m->vertices[m->indices[i]*3 +3],m->vertices[m->indices[i]*3 +4],m->vertices[m->indices[i]*3+5]);
-        C = vec3(m->vertices[m->indices[i]*3 +6],m->vertices[m->indices[i]*3 +7],m->vertices[m->indices[i]*3+8]);
-
-        N = vec3(m->normals[m->indices[i]*3],m->normals[m->indices[i]*3 +1],m->normals[m->indices[i]*3+2]);
+    INSTANCE inst;
+    inst.pos = pos;
+    inst.angle = vec3(-M_PI/2+angle.x,M_PI+angle.y,M_PI/2);
+    inst.scale = vec3(1.0f,1.0f,1.0f);
+    inst.tex = NULL;
+    inst.lod = NULL;
+
+    return inst;
+}
 
-        A.x *= sc.x; A.x += tr.x;
-        A.y *= sc.y; A.y += tr.y;
-        A.z *= sc.z; A.z += tr.z;
 
-        B.x *= sc.x; B.x += tr.x;
-        B.y *= sc.y; B.y += tr.y;
-        B.z *= sc.z; B.z += tr.z;
+// Draw NPC fish
+void pl_draw_instances(const INSTANCE* inst, int count)
+{
+    draw_mesh_instanced(mFish,bmpFish2,inst,count);
+}
 
-        C.x *= sc.x; C.x += tr.x;
-        C.y *= sc.y; C.y += tr.y;
-        C.z *= sc.z; C.z += tr.z;
 
-        pl_triangle_collision(pl,A,B,C,N);
-    }
+// Player-mesh collision
+void pl_mesh_collision(PLAYER* pl, MESH* m, VEC3 tr, VEC3 sc)
+{
+    if(pl == NULL || m == NULL || m->bvh == NULL) return;
+    // A flattened mesh has no mesh space to map to
+    if(sc.x == 0.0f || sc.y == 0.0f || sc.z == 0.0f) return;
+
+    MESH_COLLISION c;
+    c.pl = pl;
+    c.tr = tr;
+    c.sc = sc;
+    c.inv = vec3(1.0f/sc.x,1.0f/sc.y,1.0f/sc.z);
+
+    // Player position & margin in mesh space
+    float r = pl->radius*2;
+    VEC3 p = vec3((pl->pos.x-tr.x) * c.inv.x,
+        (pl->pos.y-tr.y) * c.inv.y,
+        (pl->pos.z-tr.z) * c.inv.z);
+    VEC3 e = vec3(fabsf(r*c.inv.x),fabsf(r*c.inv.y),fabsf(r*c.inv.z));
+
+    bvh_query_box(m->bvh,vec3(p.x-e.x,p.y-e.y,p.z-e.z),vec3(p.x+e.x,p.y+e.y,p.z+e.z),
+        pl_triangle_collision,&c);
 }
 
 
@@ -429,24 +458,65 @@ void pl_fence_collision(PLAYER* pl,float y,float sx, float sz, float ex, float e
     }
 }
 
+// Random swim wave speed
+float pl_random_swim_wave(Uint32* rng)
+{
+    return (float)(rand_next(rng) % 1000) / 1000.0f * SWIMV_MAX + SWIMV_MIN;
+}
+
+
+// Random swimming direction
+float pl_random_dir(Uint32* rng)
+{
+    return rand_next(rng) % 2 == 0 ? 1.0f : -1.0f;
+}
+
+
+// Random max speed modifier
+float pl_random_speed_mod(Uint32* rng)
+{
+    return (float)(rand_next(rng) % 100) / 100.0f * 0.5f + 0.75f;
+}
+
+
 // Player-to-player collision
 void player_to_player_collision(PLAYER* pl, PLAYER* o, float tm)
 {
-    float dist = sqrt( (pl->pos.x-o->pos.x)*(pl->pos.x-o->pos.x) + (pl->pos.y-o->pos.y)*(pl->pos.y-o->pos.y) + (pl->pos.z-o->pos.z)*(pl->pos.z-o->pos.z));
-    float r = (pl->radius+o->radius)*1.6f;
-    if(dist < r)
+    pl_separate(&pl->pos,pl->radius,&o->pos,o->radius);
+}
+
+
+// Push two overlapping spheres apart
+void pl_separate(VEC3* pa, float ra, VEC3* pb, float rb)
+{
+    float dx = pa->x-pb->x;
+    float dy = pa->y-pb->y;
+    float dz = pa->z-pb->z;
+    float d2 = dx*dx + dy*dy + dz*dz;
+    float r = (ra+rb)*PL_SEPARATION_FACTOR;
+    if(d2 < r*r)
     {
-        float angle = atan2(pl->pos.z-o->pos.z,pl->pos.x-o->pos.x);
+        float dist = d2 > 0.0f ? d2 * fast_rsqrt(d2) : 0.0f;
+
+        // Sine & cosine of the angle in the xz plane
+        float s = 0.0f, c = 1.0f;
+        float h2 = dx*dx + dz*dz;
+        if(h2 > 0.0f)
+        {
+            float inv = fast_rsqrt(h2);
+            s = dz * inv;
+            c = dx * inv;
+        }
         
-        o->pos.x += sin(angle) * (r-dist) / 2;
-        o->pos.z += cos(angle) * (r-dist) / 2;
+        pb->x += s * (r-dist) / 2;
+        pb->z += c * (r-dist) / 2;
 
-        pl->pos.x -= sin(angle) * (r-dist) / 2;
-        pl->pos.z -= cos(angle) * (r-dist) / 2;
+        pa->x -= s * (r-dist) / 2;
+        pa->z -= c * (r-dist) / 2;
 
-        float delta = (pl->pos.y-o->pos.y);
+        float delta = (pa->y-pb->y);
 
-        o->pos.y -= delta / 4;
-        pl->pos.y += delta / 4;
+        pb->y -= delta / 4;
+        pa->y += delta / 4;
     }
 }
\ No newline at end of file
@@ -7,9 +7,16 @@
 #include "../engine/vector.h"
 #include "../engine/assets.h"
 #include "../engine/mesh.h"
+#include "../engine/graphics.h"
 
 #include "stdbool.h"
 
+/// Fish radius
+#define PL_RADIUS 0.5f
+/// Fish are pushed apart when closer than their radius
+/// sum times this
+#define PL_SEPARATION_FACTOR 1.6f
+
 /// Player type
 typedef struct
 {
@@ -35,6 +42,8 @@ typedef struct
     float dir;
     float swimWave;
     float swimWave2;
+
+    Uint32 rng; /// Random number generator state
 }
 PLAYER;
 
@@ -44,8 +53,9 @@ void init_player(ASSET_PACK* ass);
 
 /// Create a player object
 /// < pos Position
+/// < seed Random seed. Same seed, same fish
 /// > A player object
-PLAYER pl_create(VEC3 pos);
+PLAYER pl_create(VEC3 pos, Uint32 seed);
 
 /// Update player
 /// < pl Player
@@ -56,6 +66,17 @@ void pl_update(PLAYER* pl, float tm);
 /// < pl Player
 void pl_draw(PLAYER* pl);
 
+/// Get the drawing instance of an NPC fish
+/// < pos Position
+/// < angle Angle
+/// > Instance
+INSTANCE pl_get_instance(VEC3 pos, VEC3 angle);
+
+/// Draw NPC fish at once
+/// < inst Instances (see pl_get_instance)
+/// < count Instance count
+void pl_draw_instances(const INSTANCE* inst, int count);
+
 /// Player-mesh collision
 /// < pl Player
 /// < m Mesh
@@ -81,5 +102,28 @@ void pl_fence_collision(PLAYER* pl, float y, float sx, float sz, float ex, float
 /// < tm Time mul. 
 void player_to_player_collision(PLAYER* pl, PLAYER* o, float tm);
 
+/// Push two overlapping fish apart (what player-to-player
+/// collision does, on positions only)
+/// < pa Position of the dominant fish
+/// < ra Radius of the dominant fish
+/// < pb Position of the other fish
+/// < rb Radius of the other fish
+void pl_separate(VEC3* pa, float ra, VEC3* pb, float rb);
+
+/// Random swim wave speed for NPC fish
+/// < rng Generator state
+/// > Wave speed
+float pl_random_swim_wave(Uint32* rng);
+
+/// Random swimming direction for NPC fish
+/// < rng Generator state
+/// > 1 or -1
+float pl_random_dir(Uint32* rng);
+
+/// Random max speed modifier for NPC fish
+/// < rng Generator state
+/// > Modifier
+float pl_random_speed_mod(Uint32* rng);
+
 #endif // __PLAYER__
 
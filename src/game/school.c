@@ -0,0 +1,532 @@
+/// NPC fish school (source)
+/// (c) 2018 Jani Nykänen
+
+#include "school.h"
+
+#include "../engine/mathext.h"
+#include "../engine/workers.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include "emmintrin.h"
+#define SCHOOL_SSE2
+#endif
+
+// Fish per block. The update runs in phases over a block
+// so the temporary sines & cosines stay in the cache
+#define SCHOOL_BLOCK 64
+// Initial capacity
+#define SCHOOL_CAPACITY 16
+
+// Update job data
+typedef struct
+{
+    SCHOOL* s;
+    float tm;
+}
+UPDATE_JOB;
+
+// Limits (same as in player.c)
+static const float MAX_SWIM = 2.0f * (float)M_PI;
+static const float ANGLE_LIMIT = (float)M_PI / 4.0f;
+static const float UPPER_LIMIT = 9.0f;
+static const float LOWER_LIMIT = -4.0f;
+
+
+// Grow an array
+static int grow(float** arr, int cap)
+{
+    float* p = (float*)realloc(*arr,sizeof(float) * cap);
+    if(p == NULL)
+    {
+        printf("Memory allocation error!\n");
+        return 1;
+    }
+    *arr = p;
+    return 0;
+}
+
+
+// Grow a component array triple
+static int grow3(SOA3* a, int cap)
+{
+    return grow(&a->x,cap) || grow(&a->y,cap) || grow(&a->z,cap);
+}
+
+
+// Free a component array triple
+static void free3(SOA3* a)
+{
+    free(a->x);
+    free(a->y);
+    free(a->z);
+}
+
+
+// Store a vector
+static void set3(SOA3* a, int i, VEC3 v)
+{
+    a->x[i] = v.x;
+    a->y[i] = v.y;
+    a->z[i] = v.z;
+}
+
+
+// Load a vector
+static VEC3 get3(SOA3* a, int i)
+{
+    return vec3(a->x[i],a->y[i],a->z[i]);
+}
+
+
+// Speed delta, same as pl_speed_delta: move towards the
+// target, at most acc*tm
+static float speed_delta(float speed, float target, float step)
+{
+    float lo = speed - step;
+    float hi = speed + step;
+    return target < lo ? lo : (target > hi ? hi : target);
+}
+
+
+// Create a school
+SCHOOL* school_create()
+{
+    SCHOOL* s = (SCHOOL*)malloc(sizeof(SCHOOL));
+    if(s == NULL)
+    {
+        printf("Memory allocation error!\n");
+        return NULL;
+    }
+    memset(s,0,sizeof(SCHOOL));
+
+    return s;
+}
+
+
+// Add a fish
+int school_add(SCHOOL* s, PLAYER* pl)
+{
+    if(s->count >= s->capacity)
+    {
+        int cap = s->capacity == 0 ? SCHOOL_CAPACITY : s->capacity*2;
+        if(grow3(&s->pos,cap) || grow3(&s->speed,cap) || grow3(&s->target,cap)
+        || grow3(&s->acc,cap) || grow3(&s->maxSpeed,cap) || grow3(&s->angle,cap)
+        || grow3(&s->angleSpeed,cap) || grow3(&s->angleTarget,cap)
+        || grow3(&s->angleMax,cap) || grow3(&s->angleAcc,cap)
+        || grow(&s->radius,cap) || grow(&s->swimAngleMod,cap)
+        || grow(&s->swimAngleMod2,cap) || grow(&s->dir,cap)
+        || grow(&s->swimWave,cap) || grow(&s->swimWave2,cap))
+            return 1;
+
+        Uint32* rng = (Uint32*)realloc(s->rng,sizeof(Uint32) * cap);
+        if(rng == NULL)
+        {
+            printf("Memory allocation error!\n");
+            return 1;
+        }
+        s->rng = rng;
+
+        INSTANCE* inst = (INSTANCE*)realloc(s->inst,sizeof(INSTANCE) * cap);
+        if(inst == NULL)
+        {
+            printf("Memory allocation error!\n");
+            return 1;
+        }
+        s->inst = inst;
+
+        Uint8* lod = (Uint8*)realloc(s->lod,sizeof(Uint8) * cap);
+        if(lod == NULL)
+        {
+            printf("Memory allocation error!\n");
+            return 1;
+        }
+        s->lod = lod;
+
+        s->capacity = cap;
+    }
+
+    s->lod[s->count] = 0;
+    school_set(s,s->count ++,pl);
+
+    return 0;
+}
+
+
+// Copy a fish out
+void school_get(SCHOOL* s, int i, PLAYER* pl)
+{
+    pl->pos = get3(&s->pos,i);
+    pl->speed = get3(&s->speed,i);
+    pl->target = get3(&s->target,i);
+    pl->acc = get3(&s->acc,i);
+    pl->maxSpeed = get3(&s->maxSpeed,i);
+
+    pl->angle = get3(&s->angle,i);
+    pl->angleSpeed = get3(&s->angleSpeed,i);
+    pl->angleTarget = get3(&s->angleTarget,i);
+    pl->angleMax = get3(&s->angleMax,i);
+    pl->angleAcc = get3(&s->angleAcc,i);
+
+    pl->radius = s->radius[i];
+    pl->control = false;
+    pl->outsideCamera = false;
+    pl->canControl = false;
+
+    pl->swimAngleMod = s->swimAngleMod[i];
+    pl->swimAngleMod2 = s->swimAngleMod2[i];
+    pl->dir = s->dir[i];
+    pl->swimWave = s->swimWave[i];
+    pl->swimWave2 = s->swimWave2[i];
+    pl->rng = s->rng[i];
+}
+
+
+// Copy a fish in
+void school_set(SCHOOL* s, int i, PLAYER* pl)
+{
+    set3(&s->pos,i,pl->pos);
+    set3(&s->speed,i,pl->speed);
+    set3(&s->target,i,pl->target);
+    set3(&s->acc,i,pl->acc);
+    set3(&s->maxSpeed,i,pl->maxSpeed);
+
+    set3(&s->angle,i,pl->angle);
+    set3(&s->angleSpeed,i,pl->angleSpeed);
+    set3(&s->angleTarget,i,pl->angleTarget);
+    set3(&s->angleMax,i,pl->angleMax);
+    set3(&s->angleAcc,i,pl->angleAcc);
+
+    s->radius[i] = pl->radius;
+    s->swimAngleMod[i] = pl->swimAngleMod;
+    s->swimAngleMod2[i] = pl->swimAngleMod2;
+    s->dir[i] = pl->dir;
+    s->swimWave[i] = pl->swimWave;
+    s->swimWave2[i] = pl->swimWave2;
+    s->rng[i] = pl->rng;
+}
+
+
+// Start new swimming cycles (the rare, random part of
+// pl_ai_control)
+static void new_swim_cycle(SCHOOL* s, int i)
+{
+    if(s->swimAngleMod[i] >= MAX_SWIM)
+    {
+        s->swimAngleMod[i] -= MAX_SWIM;
+        s->swimWave[i] = pl_random_swim_wave(&s->rng[i]);
+        s->dir[i] = pl_random_dir(&s->rng[i]);
+
+        float mod = pl_random_speed_mod(&s->rng[i]);
+        s->maxSpeed.x[i] *= mod;
+        s->maxSpeed.y[i] *= mod;
+        s->maxSpeed.z[i] *= mod;
+    }
+    if(s->swimAngleMod2[i] >= MAX_SWIM)
+    {
+        s->swimAngleMod2[i] -= MAX_SWIM;
+        s->swimWave2[i] = pl_random_swim_wave(&s->rng[i]);
+    }
+}
+
+
+// Advance swimming waves, one fish
+static void swim_one(SCHOOL* s, int i, float tm)
+{
+    s->swimAngleMod[i] += s->swimWave[i] * tm;
+    s->swimAngleMod2[i] += s->swimWave2[i] * tm;
+
+    if(s->swimAngleMod[i] >= MAX_SWIM || s->swimAngleMod2[i] >= MAX_SWIM)
+        new_swim_cycle(s,i);
+}
+
+
+// Steer & limit the angle, one fish
+static void steer_one(SCHOOL* s, int i, float sinSwim, float cosSwim2)
+{
+    s->angle.y[i] += 0.01f * s->dir[i] * sinSwim * (float)M_PI;
+    s->angle.x[i] += 0.025f * -1.0f * s->dir[i] * cosSwim2 * ANGLE_LIMIT;
+
+    if(s->angle.x[i] > ANGLE_LIMIT || s->angle.x[i] < -ANGLE_LIMIT)
+    {
+        s->angle.x[i] = s->angle.x[i] > 0.0f ? ANGLE_LIMIT : -ANGLE_LIMIT;
+        s->angleSpeed.x[i] = 0.0f;
+        s->swimAngleMod2[i] -= (float)M_PI;
+    }
+}
+
+
+// Targets, area limits, movement & rotation, one fish
+static void move_one(SCHOOL* s, int i, float sinY, float cosY, float sinX, float tm)
+{
+    s->target.x[i] = sinY * s->maxSpeed.x[i];
+    s->target.z[i] = cosY * s->maxSpeed.z[i];
+    s->target.y[i] = sinX * s->maxSpeed.y[i];
+
+    // Area limits
+    if(s->speed.y[i] < 0.0f && s->pos.y[i] < -UPPER_LIMIT)
+    {
+        s->pos.y[i] = -UPPER_LIMIT;
+        s->angleTarget.x[i] = 0.0f;
+        s->speed.y[i] = 0.0f;
+        s->angle.x[i] += (float)M_PI/2;
+        s->target.y[i] = fabsf(s->target.y[i]);
+    }
+    else if(s->speed.y[i] > 0.0f && s->pos.y[i] > -LOWER_LIMIT)
+    {
+        s->pos.y[i] = -LOWER_LIMIT;
+        s->angleTarget.x[i] = 0.0f;
+        s->speed.y[i] = 0.0f;
+        s->angle.x[i] -= (float)M_PI/2;
+        s->target.y[i] = -fabsf(s->target.y[i]);
+    }
+
+    // Move
+    s->speed.x[i] = speed_delta(s->speed.x[i],s->target.x[i],s->acc.x[i]*tm);
+    s->speed.y[i] = speed_delta(s->speed.y[i],s->target.y[i],s->acc.y[i]*tm);
+    s->speed.z[i] = speed_delta(s->speed.z[i],s->target.z[i],s->acc.z[i]*tm);
+    s->pos.x[i] += s->speed.x[i] * tm;
+    s->pos.y[i] += s->speed.y[i] * tm;
+    s->pos.z[i] += s->speed.z[i] * tm;
+
+    // Rotate
+    s->angleSpeed.x[i] = speed_delta(s->angleSpeed.x[i],s->angleTarget.x[i],s->angleAcc.x[i]*tm);
+    s->angleSpeed.y[i] = speed_delta(s->angleSpeed.y[i],s->angleTarget.y[i],s->angleAcc.y[i]*tm);
+    s->angleSpeed.z[i] = speed_delta(s->angleSpeed.z[i],s->angleTarget.z[i],s->angleAcc.z[i]*tm);
+    s->angle.x[i] += s->angleSpeed.x[i] * tm;
+    s->angle.y[i] += s->angleSpeed.y[i] * tm;
+    s->angle.z[i] += s->angleSpeed.z[i] * tm;
+}
+
+
+#ifdef SCHOOL_SSE2
+
+// Pick a where mask is set, b elsewhere
+static inline __m128 select4(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask,a),_mm_andnot_ps(mask,b));
+}
+
+
+// Speed delta, four fish
+static inline __m128 speed_delta4(__m128 speed, __m128 target, __m128 step)
+{
+    return _mm_min_ps(_mm_max_ps(target,_mm_sub_ps(speed,step)),_mm_add_ps(speed,step));
+}
+
+
+// Advance swimming waves, four fish
+static void swim_four(SCHOOL* s, int i, float tm)
+{
+    __m128 vtm = _mm_set1_ps(tm);
+    __m128 m1 = _mm_add_ps(_mm_loadu_ps(s->swimAngleMod+i),_mm_mul_ps(_mm_loadu_ps(s->swimWave+i),vtm));
+    __m128 m2 = _mm_add_ps(_mm_loadu_ps(s->swimAngleMod2+i),_mm_mul_ps(_mm_loadu_ps(s->swimWave2+i),vtm));
+    _mm_storeu_ps(s->swimAngleMod+i,m1);
+    _mm_storeu_ps(s->swimAngleMod2+i,m2);
+
+    __m128 lim = _mm_set1_ps(MAX_SWIM);
+    int mask = _mm_movemask_ps(_mm_or_ps(_mm_cmpge_ps(m1,lim),_mm_cmpge_ps(m2,lim)));
+    int k = 0;
+    for(; mask != 0; ++ k, mask >>= 1)
+    {
+        if(mask & 1) new_swim_cycle(s,i+k);
+    }
+}
+
+
+// Steer & limit the angle, four fish
+static void steer_four(SCHOOL* s, int i, const float* sinSwim, const float* cosSwim2)
+{
+    __m128 dir = _mm_loadu_ps(s->dir+i);
+    __m128 ay = _mm_add_ps(_mm_loadu_ps(s->angle.y+i),
+        _mm_mul_ps(_mm_mul_ps(dir,_mm_loadu_ps(sinSwim)),_mm_set1_ps(0.01f*(float)M_PI)));
+    __m128 ax = _mm_add_ps(_mm_loadu_ps(s->angle.x+i),
+        _mm_mul_ps(_mm_mul_ps(dir,_mm_loadu_ps(cosSwim2)),_mm_set1_ps(-0.025f*ANGLE_LIMIT)));
+
+    __m128 lim = _mm_set1_ps(ANGLE_LIMIT);
+    __m128 nlim = _mm_set1_ps(-ANGLE_LIMIT);
+    __m128 out = _mm_or_ps(_mm_cmpgt_ps(ax,lim),_mm_cmplt_ps(ax,nlim));
+    ax = _mm_min_ps(_mm_max_ps(ax,nlim),lim);
+
+    _mm_storeu_ps(s->angle.y+i,ay);
+    _mm_storeu_ps(s->angle.x+i,ax);
+    _mm_storeu_ps(s->angleSpeed.x+i,_mm_andnot_ps(out,_mm_loadu_ps(s->angleSpeed.x+i)));
+    _mm_storeu_ps(s->swimAngleMod2+i,_mm_sub_ps(_mm_loadu_ps(s->swimAngleMod2+i),
+        _mm_and_ps(out,_mm_set1_ps((float)M_PI))));
+}
+
+
+// Targets, area limits, movement & rotation, four fish
+static void move_four(SCHOOL* s, int i, const float* sinY, const float* cosY, const float* sinX, float tm)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 vtm = _mm_set1_ps(tm);
+
+    __m128 tx = _mm_mul_ps(_mm_loadu_ps(sinY),_mm_loadu_ps(s->maxSpeed.x+i));
+    __m128 tz = _mm_mul_ps(_mm_loadu_ps(cosY),_mm_loadu_ps(s->maxSpeed.z+i));
+    __m128 ty = _mm_mul_ps(_mm_loadu_ps(sinX),_mm_loadu_ps(s->maxSpeed.y+i));
+
+    // Area limits
+    __m128 py = _mm_loadu_ps(s->pos.y+i);
+    __m128 vy = _mm_loadu_ps(s->speed.y+i);
+    __m128 up = _mm_and_ps(_mm_cmplt_ps(vy,zero),_mm_cmplt_ps(py,_mm_set1_ps(-UPPER_LIMIT)));
+    __m128 down = _mm_andnot_ps(up,
+        _mm_and_ps(_mm_cmpgt_ps(vy,zero),_mm_cmpgt_ps(py,_mm_set1_ps(-LOWER_LIMIT))));
+    __m128 hit = _mm_or_ps(up,down);
+
+    py = select4(up,_mm_set1_ps(-UPPER_LIMIT),select4(down,_mm_set1_ps(-LOWER_LIMIT),py));
+    vy = _mm_andnot_ps(hit,vy);
+    __m128 ax = _mm_add_ps(_mm_loadu_ps(s->angle.x+i),
+        _mm_and_ps(up,_mm_set1_ps((float)M_PI/2)));
+    ax = _mm_sub_ps(ax,_mm_and_ps(down,_mm_set1_ps((float)M_PI/2)));
+    __m128 aty = _mm_andnot_ps(hit,_mm_loadu_ps(s->angleTarget.x+i));
+    __m128 absTy = _mm_andnot_ps(sign,ty);
+    ty = select4(up,absTy,select4(down,_mm_or_ps(absTy,sign),ty));
+
+    _mm_storeu_ps(s->target.x+i,tx);
+    _mm_storeu_ps(s->target.y+i,ty);
+    _mm_storeu_ps(s->target.z+i,tz);
+    _mm_storeu_ps(s->angleTarget.x+i,aty);
+
+    // Move
+    __m128 vx = speed_delta4(_mm_loadu_ps(s->speed.x+i),tx,_mm_mul_ps(_mm_loadu_ps(s->acc.x+i),vtm));
+    vy = speed_delta4(vy,ty,_mm_mul_ps(_mm_loadu_ps(s->acc.y+i),vtm));
+    __m128 vz = speed_delta4(_mm_loadu_ps(s->speed.z+i),tz,_mm_mul_ps(_mm_loadu_ps(s->acc.z+i),vtm));
+    _mm_storeu_ps(s->speed.x+i,vx);
+    _mm_storeu_ps(s->speed.y+i,vy);
+    _mm_storeu_ps(s->speed.z+i,vz);
+    _mm_storeu_ps(s->pos.x+i,_mm_add_ps(_mm_loadu_ps(s->pos.x+i),_mm_mul_ps(vx,vtm)));
+    _mm_storeu_ps(s->pos.y+i,_mm_add_ps(py,_mm_mul_ps(vy,vtm)));
+    _mm_storeu_ps(s->pos.z+i,_mm_add_ps(_mm_loadu_ps(s->pos.z+i),_mm_mul_ps(vz,vtm)));
+
+    // Rotate
+    __m128 wx = speed_delta4(_mm_loadu_ps(s->angleSpeed.x+i),aty,
+        _mm_mul_ps(_mm_loadu_ps(s->angleAcc.x+i),vtm));
+    __m128 wy = speed_delta4(_mm_loadu_ps(s->angleSpeed.y+i),_mm_loadu_ps(s->angleTarget.y+i),
+        _mm_mul_ps(_mm_loadu_ps(s->angleAcc.y+i),vtm));
+    __m128 wz = speed_delta4(_mm_loadu_ps(s->angleSpeed.z+i),_mm_loadu_ps(s->angleTarget.z+i),
+        _mm_mul_ps(_mm_loadu_ps(s->angleAcc.z+i),vtm));
+    _mm_storeu_ps(s->angleSpeed.x+i,wx);
+    _mm_storeu_ps(s->angleSpeed.y+i,wy);
+    _mm_storeu_ps(s->angleSpeed.z+i,wz);
+    _mm_storeu_ps(s->angle.x+i,_mm_add_ps(ax,_mm_mul_ps(wx,vtm)));
+    _mm_storeu_ps(s->angle.y+i,_mm_add_ps(_mm_loadu_ps(s->angle.y+i),_mm_mul_ps(wy,vtm)));
+    _mm_storeu_ps(s->angle.z+i,_mm_add_ps(_mm_loadu_ps(s->angle.z+i),_mm_mul_ps(wz,vtm)));
+}
+
+#endif // SCHOOL_SSE2
+
+
+// Update a block of fish
+static void update_block(SCHOOL* s, int start, int end, float tm)
+{
+    float sinA[SCHOOL_BLOCK], cosA[SCHOOL_BLOCK];
+    float sinB[SCHOOL_BLOCK], cosB[SCHOOL_BLOCK];
+    int n = end - start;
+    int i;
+
+    // Swimming waves
+    i = start;
+#ifdef SCHOOL_SSE2
+    for(; i + 4 <= end; i += 4) swim_four(s,i,tm);
+#endif
+    for(; i < end; ++ i) swim_one(s,i,tm);
+
+    // Steering
+    fast_sincos_n(s->swimAngleMod+start,sinA,cosA,n);
+    fast_sincos_n(s->swimAngleMod2+start,sinB,cosB,n);
+    i = start;
+#ifdef SCHOOL_SSE2
+    for(; i + 4 <= end; i += 4) steer_four(s,i,sinA+i-start,cosB+i-start);
+#endif
+    for(; i < end; ++ i) steer_one(s,i,sinA[i-start],cosB[i-start]);
+
+    // Movement
+    fast_sincos_n(s->angle.y+start,sinA,cosA,n);
+    fast_sincos_n(s->angle.x+start,sinB,cosB,n);
+    i = start;
+#ifdef SCHOOL_SSE2
+    for(; i + 4 <= end; i += 4) move_four(s,i,sinA+i-start,cosA+i-start,sinB+i-start,tm);
+#endif
+    for(; i < end; ++ i) move_one(s,i,sinA[i-start],cosA[i-start],sinB[i-start],tm);
+}
+
+
+// Update job. Blocks always start at multiples of
+// SCHOOL_BLOCK, so every fish takes the same (SSE2 or
+// scalar) path whatever the thread count is
+static void update_job(int start, int end, void* user)
+{
+    UPDATE_JOB* job = (UPDATE_JOB*)user;
+    SCHOOL* s = job->s;
+
+    int b = start;
+    int first, last;
+    for(; b < end; ++ b)
+    {
+        first = b * SCHOOL_BLOCK;
+        last = first + SCHOOL_BLOCK < s->count ? first + SCHOOL_BLOCK : s->count;
+        update_block(s,first,last,job->tm);
+    }
+}
+
+
+// Update
+void school_update(SCHOOL* s, float tm)
+{
+    UPDATE_JOB job;
+    job.s = s;
+    job.tm = tm;
+
+    int blocks = (s->count + SCHOOL_BLOCK-1) / SCHOOL_BLOCK;
+    wk_run(update_job,&job,blocks,1);
+}
+
+
+// Draw the school
+void school_draw(SCHOOL* s)
+{
+    int i = 0;
+    for(; i < s->count; ++ i)
+    {
+        s->inst[i] = pl_get_instance(get3(&s->pos,i),get3(&s->angle,i));
+        s->inst[i].lod = s->lod + i;
+    }
+
+    pl_draw_instances(s->inst,s->count);
+}
+
+
+// Destroy
+void school_destroy(SCHOOL* s)
+{
+    if(s == NULL) return;
+
+    free3(&s->pos);
+    free3(&s->speed);
+    free3(&s->target);
+    free3(&s->acc);
+    free3(&s->maxSpeed);
+    free3(&s->angle);
+    free3(&s->angleSpeed);
+    free3(&s->angleTarget);
+    free3(&s->angleMax);
+    free3(&s->angleAcc);
+
+    free(s->radius);
+    free(s->swimAngleMod);
+    free(s->swimAngleMod2);
+    free(s->dir);
+    free(s->swimWave);
+    free(s->swimWave2);
+    free(s->rng);
+    free(s->inst);
+    free(s->lod);
+
+    free(s);
+}
@@ -0,0 +1,87 @@
+/// NPC fish school (header)
+/// (c) 2018 Jani Nykänen
+
+#ifndef __SCHOOL__
+#define __SCHOOL__
+
+#include "player.h"
+
+/// Three float arrays, one per component
+typedef struct
+{
+    float* x;
+    float* y;
+    float* z;
+}
+SOA3;
+
+/// Fish school. Same fields as PLAYER, one array per
+/// field, so the update can run on several fish at once
+typedef struct
+{
+    SOA3 pos;
+    SOA3 speed;
+    SOA3 target;
+    SOA3 acc;
+    SOA3 maxSpeed;
+
+    SOA3 angle;
+    SOA3 angleSpeed;
+    SOA3 angleTarget;
+    SOA3 angleMax;
+    SOA3 angleAcc;
+
+    float* radius;
+    float* swimAngleMod;
+    float* swimAngleMod2;
+    float* dir;
+    float* swimWave;
+    float* swimWave2;
+    Uint32* rng;
+
+    INSTANCE* inst; /// Drawing instances
+    Uint8* lod; /// Mesh detail levels
+
+    int count;
+    int capacity;
+}
+SCHOOL;
+
+/// Create an empty school
+/// > A new school
+SCHOOL* school_create();
+
+/// Add a fish
+/// < s School
+/// < pl Fish to copy
+/// > 0 on success, 1 on memory error
+int school_add(SCHOOL* s, PLAYER* pl);
+
+/// Copy a fish out of the school
+/// < s School
+/// < i Fish index
+/// < pl Destination
+void school_get(SCHOOL* s, int i, PLAYER* pl);
+
+/// Copy a fish back to the school
+/// < s School
+/// < i Fish index
+/// < pl Source
+void school_set(SCHOOL* s, int i, PLAYER* pl);
+
+/// Update every fish (AI, limits, movement & rotation).
+/// Runs on the worker pool. Every fish has its own random
+/// state, so the result does not depend on the thread count
+/// < s School
+/// < tm Time mul.
+void school_update(SCHOOL* s, float tm);
+
+/// Draw every fish at once
+/// < s School
+void school_draw(SCHOOL* s);
+
+/// Destroy a school
+/// < s School
+void school_destroy(SCHOOL* s);
+
+#endif // __SCHOOL__
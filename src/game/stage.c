@@ -4,15 +4,36 @@
 #include "stage.h"
 
 #include "decoration.h"
+#include "world.h"
 
 #include "../engine/graphics.h"
 #include "../engine/transform.h"
+#include "../engine/mathext.h"
+#include "../engine/vecmath.h"
+#include "../engine/mesh.h"
+#include "../engine/impostor.h"
 
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
 #include "math.h"
 #include "time.h"
 
+#define IS(s,x) strcmp(s,x) == 0
+
+// Maximum mesh-texture pairs with an impostor
+#define STAGE_MAX_IMPOSTORS 32
+
+// Impostor of a mesh-texture pair
+typedef struct
+{
+    MESH* mesh;
+    BITMAP* tex;
+    IMPOSTOR* imp; // NULL until created
+    bool failed;
+}
+IMP_ENTRY;
+
 // Grass texture
 static BITMAP* bmpGrass;
 // Road texture
@@ -26,12 +47,8 @@ static BITMAP* bmpMoon;
 // Fence texture
 static BITMAP* bmpFence;
 
-// Maximum amount of decorations
-#define DEC_MAX 32
 // Decorations
-static DECORATION decorations[DEC_MAX];
-// Decoration count
-static int decCount;
+static DEC_STORE* decorations;
 
 // Has the apocalypse begun
 static bool apocalypse;
@@ -40,42 +57,94 @@ static float skyDarkTimer;
 // Fence height
 static float fenceHeight;
 
-// Draw a floor tile (or piece of it)
-static void draw_floor_tile_small(float x, float y, float z, float w, float h, float u, float v, float uw, float vh)
+// Visible decorations, drawn in batches per mesh
+static DECORATION** visible;
+static int visibleCount;
+static int visibleCapacity;
+// Instances of a batch
+static INSTANCE* batch;
+static int batchCapacity;
+
+// Baked floor tiles and fence planes, per subdivision
+// level (1, 2 and 4). Unit sized, scaled when drawn
+static MESH* floorTiles[3];
+static MESH* fenceH[3];
+static MESH* fenceD[3];
+
+// Impostor settings. Decorations whose near side is
+// further than the distance are drawn as impostors,
+// dithered in over the band. Off if the distance is 0
+static float impDist;
+static float impBand;
+static int impViews;
+static int impSize;
+// Impostors, created in the update when first wanted
+static IMP_ENTRY impostors[STAGE_MAX_IMPOSTORS];
+static int impostorCount;
+
+// Bake a unit grid of quads, spanned by two axes, to a mesh
+static MESH* bake_grid(int subdivide, VEC3 ax, VEC3 ay, VEC3 n)
 {
+    Uint32 count = subdivide*subdivide*6;
+    float* v = (float*)malloc(sizeof(float) * count * 3);
+    float* uv = (float*)malloc(sizeof(float) * count * 2);
+    float* nv = (float*)malloc(sizeof(float) * count * 3);
+    if(v == NULL || uv == NULL || nv == NULL)
+    {
+        printf("Memory allocation error!\n");
+        free(v); free(uv); free(nv);
+        return NULL;
+    }
 
-    draw_triangle_3d(vec3(x,y,z),vec3(x+w,y,z),vec3(x+w,y,z+h),
-        vec2(u,v),vec2(u+uw,v),vec2(u+uw,v+vh),vec3(0,1,0));
-
-    draw_triangle_3d(vec3(x+w,y,z+h),vec3(x,y,z+h),vec3(x,y,z),
-       vec2(u+uw,v+vh),vec2(u,v+vh),vec2(u,v),vec3(0,1,0));
-
-}
-
-// Draw a floor tile
-static void draw_floor_tile(float x, float y, float z, float w, float h, int subdivide)
-{
-    int dx = 0, dz = 0;
-    float stepw = w / subdivide;
-    float steph = h / subdivide;
-    float stepuv = 1.0 / subdivide;
+    // Corner order of the two triangles of a quad
+    const int CX[6] = {0,1,1, 1,0,0};
+    const int CY[6] = {0,0,1, 1,1,0};
 
-    for(dz = 0; dz < subdivide; ++ dz)
+    float step = 1.0f / subdivide;
+    float px, py;
+    int dx, dy, k;
+    int i = 0;
+    for(dy = 0; dy < subdivide; ++ dy)
     {
         for(dx = 0; dx < subdivide; ++ dx)
         {
-             draw_floor_tile_small(x + stepw*dx, y, z + steph*dz,stepw,steph,stepuv * dx,stepuv*dz,stepuv,stepuv);
+            for(k = 0; k < 6; ++ k, ++ i)
+            {
+                px = step * (dx + CX[k]);
+                py = step * (dy + CY[k]);
+
+                v[i*3] = ax.x*px + ay.x*py;
+                v[i*3 +1] = ax.y*px + ay.y*py;
+                v[i*3 +2] = ax.z*px + ay.z*py;
+
+                uv[i*2] = px;
+                uv[i*2 +1] = py;
+
+                nv[i*3] = n.x; nv[i*3 +1] = n.y; nv[i*3 +2] = n.z;
+            }
         }
     }
 
+    MESH* m = create_mesh(v,uv,nv,count);
+
+    free(v);
+    free(uv);
+    free(nv);
+
+    return m;
 }
 
 
-// Draw floor
-static void draw_floor(CAMERA* cam, float y)
+// Index of a subdivision level in the baked meshes
+static int lod_index(int subdivide)
 {
-    bind_texture(bmpGrass);
+    return subdivide == 4 ? 2 : subdivide - 1;
+}
+
 
+// Draw floor
+static void draw_floor(CAMERA* cam, VIEW_WEDGE* view, float y)
+{
     const float TILE_SIZE = 10.0f;
     const int TILE_COUNT = 8;
 
@@ -87,17 +156,19 @@ static void draw_floor(CAMERA* cam, float y)
     int ex = sx + TILE_COUNT;
     int ez = sz + TILE_COUNT;
 
-    int stepx = 1;
-    int stepz = 1;
     int subdivide = 1;
 
-    int tcount = 0;
+    tr_scale_model(TILE_SIZE,1.0f,TILE_SIZE);
 
     int dx, dz;
-    for(dz = sz; dz <= ez; dz += stepz)
+    for(dz = sz; dz <= ez; ++ dz)
     {
-        for(dx = sx; dx <= ex; dx += stepx)
+        for(dx = sx; dx <= ex; ++ dx)
         {
+            if(!view_has_circle(view,(dx + 0.5f) * TILE_SIZE,(dz + 0.5f) * TILE_SIZE,
+                TILE_SIZE * 0.70711f))
+                continue;
+
             bind_texture(dx == 0 ? bmpRoad : bmpGrass);
 
             subdivide = 1;
@@ -110,11 +181,12 @@ static void draw_floor(CAMERA* cam, float y)
             && dz >= sz + TILE_COUNT/2 - 1 && dz <= ez - TILE_COUNT/2 + 1) 
                 subdivide = 4;
 
-            draw_floor_tile(dx * TILE_SIZE,y, dz * TILE_SIZE, TILE_SIZE, TILE_SIZE,subdivide);
-
-            tcount += subdivide*subdivide;
+            tr_translate_model(dx * TILE_SIZE,y,dz * TILE_SIZE);
+            draw_mesh(floorTiles[lod_index(subdivide)]);
         }
     }
+
+    tr_scale_model(1.0f,1.0f,1.0f);
 }
 
 
@@ -169,114 +241,269 @@ static void draw_background(CAMERA* cam)
 }
 
 
-// Draw horizontal fence plane
-static void draw_fence_plane_h(CAMERA* cam, float x,float y,float z, float w, float h)
+// Get the subdivision level of a fence plane
+static int fence_lod(CAMERA* cam, float cx, float cz, float w)
 {
-    float dist = hypot(cam->vpos.x-(x+w/2),cam->vpos.z-z);
+    cx = cam->vpos.x - cx;
+    cz = cam->vpos.z - cz;
+    float d2 = cx*cx + cz*cz;
+    float dist = d2 > 0.0f ? d2 * fast_rsqrt(d2) : 0.0f;
 
     int subdivide = 1;
     if(dist < 4*w) subdivide = 2;
     if(dist < 2*w) subdivide = 4;
 
-    int dx = 0, dy = 0;
-    float stepw = w / subdivide;
-    float steph = h / subdivide;
-    float stepuv = 1.0 / subdivide;
+    return subdivide;
+}
+
+
+// Draw horizontal fence plane
+static void draw_fence_plane_h(CAMERA* cam, VIEW_WEDGE* view, float x,float y,float z, float w, float h)
+{
+    if(!view_has_circle(view,x+w/2,z,w/2)) return;
+
+    tr_translate_model(x,y,z);
+    tr_scale_model(w,h,1.0f);
+    draw_mesh(fenceH[lod_index(fence_lod(cam,x+w/2,z,w))]);
+}
 
-    float tx, ty, tz;
-    float u,v;
 
-    for(dx = 0; dx < subdivide; ++ dx)
+// Draw depth-direction fence plane
+static void draw_fence_plane_d(CAMERA* cam, VIEW_WEDGE* view, float x,float y,float z, float w, float h)
+{
+    if(!view_has_circle(view,x,z+w/2,w/2)) return;
+
+    tr_translate_model(x,y,z);
+    tr_scale_model(1.0f,h,w);
+    draw_mesh(fenceD[lod_index(fence_lod(cam,x,z+w/2,w))]);
+}
+
+
+// Draw fence
+static void draw_fence(CAMERA* cam, VIEW_WEDGE* view, float x, float y, float z, float w, float h, float d, int repeat)
+{
+    if(h < 0.0f) return;
+
+    bind_texture(bmpFence);
+    int i = 0;
+
+    for(; i < repeat; ++ i)
     {
-        for(dy = 0; dy < subdivide; ++ dy)
+        if(i != 5 && i != 6)
         {
-            tx = x + stepw*dx;
-            ty = y + steph*dy;
-            tz = z;
-                
-            u = stepuv*dx;
-            v = stepuv*dy;
-
-            draw_triangle_3d(vec3(tx,ty,tz),vec3(tx+stepw,ty,tz),vec3(tx+stepw,ty+steph,tz),
-                vec2(u,v),vec2(u+stepuv,v),vec2(u+stepuv,v+stepuv),vec3(0,0,1));
-
-            draw_triangle_3d(vec3(tx+stepw,ty+steph,tz),vec3(tx,ty+steph,tz),vec3(tx,ty,tz),
-                vec2(u+stepuv,v+stepuv),vec2(u,v+stepuv),vec2(u,v),vec3(0,0,1));
+            draw_fence_plane_h(cam,view,x + i*w,y-h,z,w,h);
+            draw_fence_plane_h(cam,view,x + i*w,y-h,z + d * repeat,w,h);
         }
+
+        draw_fence_plane_d(cam,view,x,y-h,z + i*d,d,h);
+        draw_fence_plane_d(cam,view,x + w*repeat,y-h,z + i*d,d,h);
     }
+
+    tr_scale_model(1.0f,1.0f,1.0f);
 }
 
 
-// Draw depth-direction fence plane
-static void draw_fence_plane_d(CAMERA* cam, float x,float y,float z, float w, float h)
+// Collect a visible decoration, query callback
+static void collect_model(DECORATION* d, void* user)
 {
+    if(visibleCount >= visibleCapacity)
+    {
+        int cap = visibleCapacity == 0 ? 64 : visibleCapacity*2;
+        DECORATION** p = (DECORATION**)realloc(visible,sizeof(DECORATION*) * cap);
+        if(p == NULL)
+        {
+            printf("Memory allocation error!\n");
+            return;
+        }
+        visible = p;
+        visibleCapacity = cap;
+    }
+    visible[visibleCount ++] = d;
+}
 
-    float dist = hypot(cam->vpos.x-x,cam->vpos.z-(z+w/2));
 
-    int subdivide = 1;
-    if(dist < 4*w) subdivide = 2;
-    if(dist < 2*w) subdivide = 4;
+// Get the impostor of a mesh-texture pair. Unknown pairs
+// are queued for the next update, NULL until then
+static IMPOSTOR* get_impostor(MESH* m, BITMAP* tex)
+{
+    int i = 0;
+    for(; i < impostorCount; ++ i)
+    {
+        if(impostors[i].mesh == m && impostors[i].tex == tex)
+            return impostors[i].imp;
+    }
+    if(impostorCount >= STAGE_MAX_IMPOSTORS)
+        return NULL;
+
+    impostors[impostorCount ++] = (IMP_ENTRY){m,tex,NULL,false};
+    return NULL;
+}
 
-    int dx = 0, dy = 0;
-    float stepw = w / subdivide;
-    float steph = h / subdivide;
 
-    float stepuv = 1.0 / subdivide;
+// Create the queued impostors. Uses the triangle buffer,
+// so not called while drawing
+static void create_impostors()
+{
+    IMP_ENTRY* e;
+    int i = 0;
+    for(; i < impostorCount; ++ i)
+    {
+        e = &impostors[i];
+        if(e->imp != NULL || e->failed) continue;
 
-    float tx, ty, tz;
-    float u,v;
+        e->imp = imp_create(e->mesh,e->tex,impViews,impSize);
+        e->failed = e->imp == NULL;
+    }
+}
 
-    for(dx = 0; dx < subdivide; ++ dx)
+
+// Read impostor settings from the layout
+static int read_impostor_settings(WORDDATA* layout)
+{
+    impDist = 0.0f;
+    impBand = 4.0f;
+    impViews = 8;
+    impSize = 64;
+
+    int i = 0;
+    bool begun = false;
+    char* w;
+    char* v;
+    for(; i < layout->wordCount; ++ i)
     {
-        for(dy = 0; dy < subdivide; ++ dy)
+        w = get_word(layout,i);
+        if(IS(w,"@impostor"))
         {
-            tx = x;
-            ty = y+steph*dy;
-            tz = z+stepw*dx;
-                
-            u = stepuv*dx;
-            v = stepuv*dy;
-
-            draw_triangle_3d(vec3(tx,ty,tz),vec3(tx,ty,tz+stepw),vec3(tx,ty+steph,tz+stepw),
-                vec2(u,v),vec2(u+stepuv,v),vec2(u+stepuv,v+stepuv),vec3(0,0,1));
-
-            draw_triangle_3d(vec3(tx,ty+steph,tz+stepw),vec3(tx,ty+steph,tz),vec3(tx,ty,tz),
-                vec2(u+stepuv,v+stepuv),vec2(u,v+stepuv),vec2(u,v),vec3(0,0,1));
+            begun = true;
+            continue;
         }
+        if(!begun) continue;
+        if(IS(w,"@endimpostor")) break;
+
+        v = get_word(layout,i+1);
+        if(v == NULL) break;
+
+        if(IS(w,"distance"))
+            impDist = strtof(v,NULL);
+        else if(IS(w,"band"))
+            impBand = strtof(v,NULL);
+        else if(IS(w,"views"))
+            impViews = (int)strtol(v,NULL,10);
+        else if(IS(w,"size"))
+            impSize = (int)strtol(v,NULL,10);
+        else
+            continue;
+        ++ i;
     }
-}
 
+    if(impDist < 0.0f || impBand <= 0.0f || impViews < 1 || impViews > IMP_MAX_VIEWS
+    || impSize < 4 || (impSize & (impSize-1)) != 0)
+    {
+        printf("Bad impostor settings!\n");
+        return 1;
+    }
 
+    return 0;
+}
 
-// Draw fence
-static void draw_fence(CAMERA* cam, float x, float y, float z, float w, float h, float d, int repeat)
+
+// Draw the far away visible decorations as impostors and
+// take them out of the list. In the band the impostor and
+// the mesh are dithered to complementary pixels
+static void draw_impostors(VIEW_WEDGE* view)
 {
-    if(h < 0.0f) return;
+    if(impDist <= 0.0f) return;
 
-    bind_texture(bmpFence);
+    DECORATION* d;
+    IMPOSTOR* imp;
+    float dx, dz, dist;
+    int coverage;
+    Uint8 mask;
     int i = 0;
-
-    for(; i < repeat; ++ i)
+    for(; i < visibleCount; ++ i)
     {
-        if(i != 5 && i != 6)
+        d = visible[i];
+        imp = get_impostor(d->mesh,d->texture);
+        if(imp == NULL) continue;
+
+        // Distance to the near side of the picture, so
+        // big meshes switch further away
+        dx = d->pos.x + imp->center.x*d->scale.x - view->eye.x;
+        dz = d->pos.z + imp->center.z*d->scale.z - view->eye.y;
+        dist = sqrtf(dx*dx + dz*dz) - imp->extent * vm_maxf(d->scale.x,d->scale.y);
+        if(dist < impDist) continue;
+
+        coverage = dist >= impDist + impBand ? 4 :
+            1 + (int)floorf((dist - impDist) / impBand * 3.0f);
+        if(coverage >= 4)
+        {
+            imp_draw(imp,d->pos,d->scale,view->eye,view->right);
+        }
+        else
         {
-            draw_fence_plane_h(cam,x + i*w,y-h,z,w,h);
-            draw_fence_plane_h(cam,x + i*w,y-h,z + d * repeat,w,h);
+            mask = get_dither_mask(coverage);
+            set_dither_mask(mask);
+            imp_draw(imp,d->pos,d->scale,view->eye,view->right);
+            set_dither_mask(~mask & DITHER_FULL);
+            draw_decoration(d);
+            set_dither_mask(DITHER_FULL);
         }
 
-        draw_fence_plane_d(cam,x,y-h,z + i*d,d,h);
-        draw_fence_plane_d(cam,x + w*repeat,y-h,z + i*d,d,h);
+        visible[i] = NULL;
     }
 }
 
 
-// Draw various models
-static void draw_models()
+// Draw various models, the ones in the view only.
+// Decorations sharing a mesh are drawn as one batch, in
+// the order the meshes were first seen
+static void draw_models(VIEW_WEDGE* view)
 {
-    int i = 0;
-    for(; i < decCount; ++ i)
+    visibleCount = 0;
+    dec_store_query_view(decorations,view,collect_model,NULL);
+    world_query_view(view,collect_model,NULL);
+
+    draw_impostors(view);
+
+    if(visibleCount > batchCapacity)
+    {
+        INSTANCE* p = (INSTANCE*)realloc(batch,sizeof(INSTANCE) * visibleCount);
+        if(p == NULL)
+        {
+            printf("Memory allocation error!\n");
+            return;
+        }
+        batch = p;
+        batchCapacity = visibleCount;
+    }
+
+    MESH* m;
+    DECORATION* d;
+    int count;
+    int i = 0, j;
+    for(; i < visibleCount; ++ i)
     {
-        draw_decoration(&decorations[i]);
+        if(visible[i] == NULL) continue;
+
+        // Take every decoration with the same mesh
+        m = visible[i]->mesh;
+        count = 0;
+        for(j = i; j < visibleCount; ++ j)
+        {
+            d = visible[j];
+            if(d == NULL || d->mesh != m) continue;
+
+            batch[count].pos = d->pos;
+            batch[count].angle = vec3(0,0,0);
+            batch[count].scale = d->scale;
+            batch[count].tex = d->texture;
+            batch[count].lod = &d->lod;
+            ++ count;
+
+            visible[j] = NULL;
+        }
+
+        draw_mesh_instanced(m,NULL,batch,count);
     }
 }
 
@@ -296,7 +523,28 @@ int init_stage(ASSET_PACK* ass)
     if(layout == NULL)
         return 1;
 
-    decCount = read_decoration_from_layout(ass,layout,decorations);
+    decorations = dec_store_create();
+    if(decorations == NULL)
+        return 1;
+    if(read_decoration_from_layout(ass,layout,decorations) == 1
+    || world_init(ass,layout) == 1
+    || read_impostor_settings(layout) == 1)
+    {
+        destroy_word_data(layout);
+        return 1;
+    }
+    destroy_word_data(layout);
+
+    // Bake the static geometry
+    int i = 0;
+    for(; i < 3; ++ i)
+    {
+        floorTiles[i] = bake_grid(1 << i,vec3(1,0,0),vec3(0,0,1),vec3(0,1,0));
+        fenceH[i] = bake_grid(1 << i,vec3(1,0,0),vec3(0,1,0),vec3(0,0,1));
+        fenceD[i] = bake_grid(1 << i,vec3(0,0,1),vec3(0,1,0),vec3(0,0,1));
+        if(floorTiles[i] == NULL || fenceH[i] == NULL || fenceD[i] == NULL)
+            return 1;
+    }
 
     apocalypse = false;
     fenceHeight = 5.0f;
@@ -310,7 +558,8 @@ void stage_player_collision(PLAYER* pl, float tm)
 {
     if(apocalypse) return;
 
-    player_decoration_collision(pl,decorations,decCount);
+    player_decoration_collision(pl,decorations);
+    world_player_collision(pl);
     pl_fence_collision(pl,-1,-25,-25,25,25,0.0f,10.0f,tm);
 }
 
@@ -320,9 +569,11 @@ void update_stage(float tm)
 {
     const float ULIMIT = -20.0f;
 
+    create_impostors();
+
     if(!apocalypse) return;
 
-    if(decCount == 0)
+    if(decorations->count == 0)
     {
         if(skyDarkTimer < 120.0f)
         {
@@ -339,18 +590,18 @@ void update_stage(float tm)
     float speed = 0.0f;
     int i = 0;
     int above = 0;
-    for(; i < decCount; ++ i)
+    for(; i < decorations->count; ++ i)
     {
         speed = 0.1f + 0.01f * i;
-        decorations[i].pos.y -= speed * tm;
-        if(decorations[i].pos.y < ULIMIT)
+        decorations->decs[i].pos.y -= speed * tm;
+        if(decorations->decs[i].pos.y < ULIMIT)
         {
             ++ above;
         }
     }
-    if(above >= decCount)
+    if(above >= decorations->count)
     {
-        decCount = 0;
+        dec_store_clear(decorations);
     }
 }
 
@@ -358,12 +609,14 @@ void update_stage(float tm)
 // Draw the stage
 void draw_stage(CAMERA* cam)
 {
+    VIEW_WEDGE view = cam_get_view(cam);
+
     draw_background(cam);
 
     toggle_darkness(true);
     set_darkness(10.0f,35.0f);
 
-    draw_floor(cam,5);
+    draw_floor(cam,&view,5);
 
     draw_triangle_buffer();
     clear_triangle_buffer();
@@ -371,9 +624,9 @@ void draw_stage(CAMERA* cam)
     toggle_darkness(true);
     set_darkness(10.0f,35.0f);
 
-    draw_fence(cam,-25,5,-25,5.0f,fenceHeight,5.0f,10);
+    draw_fence(cam,&view,-25,5,-25,5.0f,fenceHeight,5.0f,10);
 
-    draw_models();
+    draw_models(&view);
 }
 
 
@@ -381,10 +634,46 @@ void draw_stage(CAMERA* cam)
 void end_stage()
 {
     apocalypse = true;
+
+    // Streamed chunks do not take part in the apocalypse
+    world_clear();
 }
 
 // Has the stage ended & are the decorations gone
 bool world_ended()
 {
-    return decCount == 0 && apocalypse;
+    return decorations->count == 0 && apocalypse;
+}
+
+
+// Destroy stage
+void destroy_stage()
+{
+    dec_store_destroy(decorations);
+    decorations = NULL;
+
+    int i = 0;
+    for(; i < 3; ++ i)
+    {
+        destroy_mesh(floorTiles[i]);
+        destroy_mesh(fenceH[i]);
+        destroy_mesh(fenceD[i]);
+        floorTiles[i] = NULL;
+        fenceH[i] = NULL;
+        fenceD[i] = NULL;
+    }
+
+    free(visible);
+    free(batch);
+    visible = NULL;
+    batch = NULL;
+    visibleCount = visibleCapacity = batchCapacity = 0;
+
+    for(i = 0; i < impostorCount; ++ i)
+    {
+        imp_destroy(impostors[i].imp);
+    }
+    impostorCount = 0;
+
+    world_destroy();
 }
\ No newline at end of file
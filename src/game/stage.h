@@ -33,4 +33,7 @@ void end_stage();
 /// < True, if true (ehheh)
 bool world_ended();
 
+/// Destroy stage
+void destroy_stage();
+
 #endif // __STAGE__
\ No newline at end of file
@@ -0,0 +1,501 @@
+/// World chunk streaming (source)
+/// (c) 2018 Jani Nykänen
+
+#include "world.h"
+
+#include "SDL2/SDL.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdbool.h"
+#include "math.h"
+
+#define IS(s,x) strcmp(s,x) == 0
+
+// Maximum number of chunks loaded or waiting
+#define WORLD_MAX_CHUNKS 64
+// Chunk directory path size
+#define WORLD_PATH_SIZE 256
+// Minimum movement per update to prefetch
+#define WORLD_MIN_MOVE 0.001f
+
+// Chunk states
+enum
+{
+    CHUNK_FREE = 0,
+    CHUNK_QUEUED = 1,
+    CHUNK_READY = 2,
+};
+
+// Chunk type
+typedef struct
+{
+    int x;
+    int z;
+    int state;
+    DEC_STORE* decs; // NULL for an empty chunk
+    size_t bytes;
+    Uint32 lastUsed;
+}
+CHUNK;
+
+// Chunk position, or a loaded chunk
+typedef struct
+{
+    int x;
+    int z;
+    DEC_STORE* decs;
+}
+CHUNK_POS;
+
+// Assets for the loader
+static ASSET_PACK* assets;
+// Is streaming on
+static bool enabled;
+
+// Settings
+static char chunkDir[WORLD_PATH_SIZE];
+static float chunkSize;
+static int loadRadius;
+static size_t budget;
+
+// Chunks. Main thread only
+static CHUNK chunks[WORLD_MAX_CHUNKS];
+// Memory used by the ready chunks
+static size_t memoryUsed;
+// Update counter
+static Uint32 frame;
+// Previous position
+static VEC3 oldPos;
+// Direction of travel
+static VEC2 moveDir;
+
+// Loader thread
+static SDL_Thread* loader;
+// Lock for everything below
+static SDL_mutex* lock;
+// Signaled when there is work or the loader should quit
+static SDL_cond* wake;
+static bool quit;
+// Chunks to load, most important first
+static CHUNK_POS queue[WORLD_MAX_CHUNKS];
+static int queueCount;
+// Chunk being loaded
+static CHUNK_POS inFlight;
+static bool hasInFlight;
+// Loaded chunks, waiting for the main thread
+static CHUNK_POS done[WORLD_MAX_CHUNKS];
+static int doneCount;
+
+
+// Load a chunk file
+static DEC_STORE* world_load_chunk(int x, int z)
+{
+    char path[WORLD_PATH_SIZE + 32];
+    snprintf(path,sizeof(path),"%s/%d_%d.txt",chunkDir,x,z);
+
+    // No file, empty chunk
+    FILE* f = fopen(path,"r");
+    if(f == NULL)
+        return NULL;
+    fclose(f);
+
+    WORDDATA* wd = parse_file(path);
+    if(wd == NULL)
+        return NULL;
+
+    DEC_STORE* s = dec_store_create();
+    if(s != NULL && read_decoration_from_layout(assets,wd,s) == 1)
+    {
+        dec_store_destroy(s);
+        s = NULL;
+    }
+    destroy_word_data(wd);
+
+    return s;
+}
+
+
+// Loader thread
+static int world_loader(void* data)
+{
+    CHUNK_POS p;
+    DEC_STORE* s;
+
+    SDL_LockMutex(lock);
+    for(;;)
+    {
+        while(queueCount == 0 && !quit)
+            SDL_CondWait(wake,lock);
+        if(quit) break;
+
+        p = queue[0];
+        memmove(queue,queue+1,sizeof(CHUNK_POS) * (-- queueCount));
+        inFlight = p;
+        hasInFlight = true;
+        SDL_UnlockMutex(lock);
+
+        s = world_load_chunk(p.x,p.z);
+
+        SDL_LockMutex(lock);
+        hasInFlight = false;
+        p.decs = s;
+        done[doneCount ++] = p;
+    }
+    SDL_UnlockMutex(lock);
+
+    return 0;
+}
+
+
+// Find a chunk
+static CHUNK* world_find(int x, int z)
+{
+    int i = 0;
+    for(; i < WORLD_MAX_CHUNKS; ++ i)
+    {
+        if(chunks[i].state != CHUNK_FREE && chunks[i].x == x && chunks[i].z == z)
+            return &chunks[i];
+    }
+    return NULL;
+}
+
+
+// Unload a chunk
+static void world_unload(CHUNK* c)
+{
+    if(c->state == CHUNK_READY)
+        memoryUsed -= c->bytes;
+
+    dec_store_destroy(c->decs);
+    c->decs = NULL;
+    c->bytes = 0;
+    c->state = CHUNK_FREE;
+}
+
+
+// Least recently used ready chunk that is not wanted now
+static CHUNK* world_find_unused()
+{
+    CHUNK* best = NULL;
+    int i = 0;
+    for(; i < WORLD_MAX_CHUNKS; ++ i)
+    {
+        if(chunks[i].state == CHUNK_READY && chunks[i].lastUsed != frame
+        && (best == NULL || chunks[i].lastUsed < best->lastUsed))
+            best = &chunks[i];
+    }
+    return best;
+}
+
+
+// Get a free chunk slot, unloads one if needed
+static CHUNK* world_get_slot()
+{
+    int i = 0;
+    for(; i < WORLD_MAX_CHUNKS; ++ i)
+    {
+        if(chunks[i].state == CHUNK_FREE)
+            return &chunks[i];
+    }
+
+    CHUNK* c = world_find_unused();
+    if(c != NULL)
+        world_unload(c);
+    return c;
+}
+
+
+// Want a chunk. Queues it if not loaded, or only marks
+// it used if markOnly is set
+static void world_want(int x, int z, bool markOnly)
+{
+    CHUNK* c = world_find(x,z);
+    if(c != NULL && (markOnly || c->state == CHUNK_READY))
+    {
+        c->lastUsed = frame;
+        return;
+    }
+    if(markOnly) return;
+
+    // Already queued this update, or being loaded
+    int i = 0;
+    for(; i < queueCount; ++ i)
+    {
+        if(queue[i].x == x && queue[i].z == z) return;
+    }
+    if(hasInFlight && inFlight.x == x && inFlight.z == z) return;
+
+    if(c == NULL)
+    {
+        c = world_get_slot();
+        if(c == NULL) return;
+
+        c->x = x;
+        c->z = z;
+        c->state = CHUNK_QUEUED;
+        c->decs = NULL;
+        c->bytes = 0;
+    }
+    c->lastUsed = frame;
+
+    queue[queueCount].x = x;
+    queue[queueCount].z = z;
+    queue[queueCount].decs = NULL;
+    ++ queueCount;
+}
+
+
+// Want the chunks around a chunk, nearest first
+static void world_want_area(int cx, int cz, bool markOnly)
+{
+    int r, x, z;
+    for(r = 0; r <= loadRadius; ++ r)
+    {
+        for(z = cz-r; z <= cz+r; ++ z)
+        {
+            for(x = cx-r; x <= cx+r; ++ x)
+            {
+                if(abs(x-cx) == r || abs(z-cz) == r)
+                    world_want(x,z,markOnly);
+            }
+        }
+    }
+}
+
+
+// Initialize
+int world_init(ASSET_PACK* ass, WORDDATA* layout)
+{
+    assets = ass;
+    enabled = false;
+
+    strcpy(chunkDir,"assets/chunks");
+    chunkSize = 50.0f;
+    loadRadius = 1;
+    budget = 4096 * 1024;
+
+    memset(chunks,0,sizeof(chunks));
+    memoryUsed = 0;
+    frame = 0;
+    oldPos = vec3(0,0,0);
+    moveDir = vec2(0,0);
+
+    queueCount = 0;
+    doneCount = 0;
+    hasInFlight = false;
+    quit = false;
+    loader = NULL;
+
+    // Read settings
+    int i = 0;
+    bool begun = false;
+    char* w;
+    char* v;
+    for(; i < layout->wordCount; ++ i)
+    {
+        w = get_word(layout,i);
+        if(IS(w,"@world"))
+        {
+            begun = true;
+            continue;
+        }
+        if(!begun) continue;
+        if(IS(w,"@endworld")) break;
+
+        v = get_word(layout,i+1);
+        if(v == NULL) break;
+
+        if(IS(w,"dir"))
+            snprintf(chunkDir,WORLD_PATH_SIZE,"%s",v);
+        else if(IS(w,"size"))
+            chunkSize = strtof(v,NULL);
+        else if(IS(w,"radius"))
+            loadRadius = (int)strtol(v,NULL,10);
+        else if(IS(w,"budget"))
+            budget = (size_t)strtol(v,NULL,10) * 1024;
+        else
+            continue;
+        ++ i;
+    }
+    if(!begun) return 0;
+
+    // Every wanted chunk must fit, prefetch included
+    int side = loadRadius*2 +1;
+    if(chunkSize <= 0.0f || loadRadius < 0 || side*side*2 > WORLD_MAX_CHUNKS)
+    {
+        printf("Bad world settings!\n");
+        return 1;
+    }
+
+    lock = SDL_CreateMutex();
+    wake = SDL_CreateCond();
+    if(lock == NULL || wake == NULL)
+    {
+        printf("Failed to create a world lock!\n");
+        return 1;
+    }
+
+    loader = SDL_CreateThread(world_loader,"world",NULL);
+    if(loader == NULL)
+    {
+        printf("Failed to create the world loader thread!\n");
+        return 1;
+    }
+
+    enabled = true;
+
+    return 0;
+}
+
+
+// Update streaming
+void world_update(VEC3 pos)
+{
+    if(!enabled) return;
+
+    ++ frame;
+
+    // Direction of travel
+    float dx = pos.x - oldPos.x;
+    float dz = pos.z - oldPos.z;
+    float d = sqrtf(dx*dx + dz*dz);
+    if(d > WORLD_MIN_MOVE)
+        moveDir = vec2(dx/d,dz/d);
+    else
+        moveDir = vec2(0,0);
+    oldPos = pos;
+
+    int cx = (int)floorf(pos.x / chunkSize);
+    int cz = (int)floorf(pos.z / chunkSize);
+    int px = (int)floorf((pos.x + moveDir.x*chunkSize) / chunkSize);
+    int pz = (int)floorf((pos.z + moveDir.y*chunkSize) / chunkSize);
+
+    SDL_LockMutex(lock);
+
+    // Pick up loaded chunks
+    CHUNK* c;
+    int i = 0;
+    for(; i < doneCount; ++ i)
+    {
+        c = world_find(done[i].x,done[i].z);
+        if(c == NULL || c->state != CHUNK_QUEUED)
+        {
+            dec_store_destroy(done[i].decs);
+            continue;
+        }
+
+        c->state = CHUNK_READY;
+        c->decs = done[i].decs;
+        c->bytes = dec_store_get_size(c->decs);
+        memoryUsed += c->bytes;
+    }
+    doneCount = 0;
+
+    // Requeue from scratch: the chunks around the position
+    // first, then the ones ahead. Everything wanted is
+    // marked first, so making room cannot unload it
+    bool ahead = px != cx || pz != cz;
+    world_want_area(cx,cz,true);
+    if(ahead)
+        world_want_area(px,pz,true);
+
+    queueCount = 0;
+    world_want_area(cx,cz,false);
+    if(ahead)
+        world_want_area(px,pz,false);
+
+    // Queued chunks that are not wanted anymore
+    for(i = 0; i < WORLD_MAX_CHUNKS; ++ i)
+    {
+        c = &chunks[i];
+        if(c->state == CHUNK_QUEUED && c->lastUsed != frame
+        && !(hasInFlight && inFlight.x == c->x && inFlight.z == c->z))
+            world_unload(c);
+    }
+
+    if(queueCount > 0)
+        SDL_CondSignal(wake);
+    SDL_UnlockMutex(lock);
+
+    // Stay in the budget
+    while(memoryUsed > budget && (c = world_find_unused()) != NULL)
+    {
+        world_unload(c);
+    }
+}
+
+
+// Player-chunk collisions
+void world_player_collision(PLAYER* pl)
+{
+    if(!enabled) return;
+
+    int i = 0;
+    for(; i < WORLD_MAX_CHUNKS; ++ i)
+    {
+        if(chunks[i].state == CHUNK_READY && chunks[i].decs != NULL)
+            player_decoration_collision(pl,chunks[i].decs);
+    }
+}
+
+
+// Query the view
+void world_query_view(VIEW_WEDGE* v, DEC_FUNC f, void* user)
+{
+    if(!enabled) return;
+
+    int i = 0;
+    for(; i < WORLD_MAX_CHUNKS; ++ i)
+    {
+        if(chunks[i].state == CHUNK_READY && chunks[i].decs != NULL)
+            dec_store_query_view(chunks[i].decs,v,f,user);
+    }
+}
+
+
+// Unload every chunk
+void world_clear()
+{
+    if(!enabled) return;
+
+    SDL_LockMutex(lock);
+    queueCount = 0;
+    SDL_UnlockMutex(lock);
+
+    int i = 0;
+    for(; i < WORLD_MAX_CHUNKS; ++ i)
+    {
+        if(chunks[i].state != CHUNK_FREE)
+            world_unload(&chunks[i]);
+    }
+
+    enabled = false;
+}
+
+
+// Destroy
+void world_destroy()
+{
+    if(loader == NULL) return;
+
+    world_clear();
+
+    SDL_LockMutex(lock);
+    quit = true;
+    SDL_CondSignal(wake);
+    SDL_UnlockMutex(lock);
+    SDL_WaitThread(loader,NULL);
+    loader = NULL;
+
+    int i = 0;
+    for(; i < doneCount; ++ i)
+    {
+        dec_store_destroy(done[i].decs);
+    }
+    doneCount = 0;
+
+    SDL_DestroyCond(wake);
+    SDL_DestroyMutex(lock);
+}
@@ -0,0 +1,50 @@
+/// World chunk streaming (header)
+/// (c) 2018 Jani Nykänen
+
+#ifndef __WORLD__
+#define __WORLD__
+
+#include "../engine/assets.h"
+
+#include "../lib/parseword.h"
+
+#include "decoration.h"
+#include "player.h"
+
+/// Initialize the world. Reads the "@world" section of
+/// the layout, streaming is off if there is none.
+/// Chunk files are named "<x>_<z>.txt" in the chunk
+/// directory and use the decoration syntax of the layout
+/// < ass Asset pack
+/// < layout Layout word data
+/// > 0 on success, 1 on error
+int world_init(ASSET_PACK* ass, WORDDATA* layout);
+
+/// Update streaming. Picks up loaded chunks, requests
+/// the chunks around the position and ahead of the
+/// movement, and unloads the least recently used chunks
+/// while over the memory budget. Chunks that are wanted
+/// now are never unloaded.
+/// Call from the main thread, not while the chunks
+/// are queried
+/// < pos Position to stream around
+void world_update(VEC3 pos);
+
+/// Player-chunk decoration collisions
+/// < pl Player
+void world_player_collision(PLAYER* pl);
+
+/// Call a function for the chunk decorations that might
+/// be in the view (see dec_store_query_view)
+/// < v View wedge
+/// < f Callback
+/// < user User data passed to the callback
+void world_query_view(VIEW_WEDGE* v, DEC_FUNC f, void* user);
+
+/// Unload every chunk and stop streaming
+void world_clear();
+
+/// Destroy the world, stops the loader thread
+void world_destroy();
+
+#endif // __WORLD__
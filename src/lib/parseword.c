@@ -13,10 +13,8 @@
 #include "stdbool.h"
 #include "string.h"
 
-// File size in bytes
-static int fileSize;
-// File data (char array)
-static char* fdata;
+// File data is passed around instead of kept in
+// globals, so files can be parsed on several threads
 
 // Calculate file size
 static int calculate_file_size(FILE* f)
@@ -31,16 +29,16 @@ static int calculate_file_size(FILE* f)
 }
 
 // Store byte data to a char array
-static int store_byte_data(FILE* f)
+static char* store_byte_data(FILE* f, int fileSize)
 {
     rewind(f);
 
     // Allocate memory
-    fdata = (char*)malloc((size_t)fileSize);
+    char* fdata = (char*)malloc((size_t)fileSize +1);
     if(fdata == NULL)
     {
         printf("Memory allocation error!\n");
-        return 1;
+        return NULL;
     }
 
     // Store characters
@@ -52,11 +50,11 @@ static int store_byte_data(FILE* f)
         ++ index;
     }
 
-    return 0;
+    return fdata;
 }
 
 //  Calculate actual size & word count and/or store word positions, length and actual data
-static void read_data(int* charCount, int* wordCount, int* wordPos, int* wordLengths, char* data)
+static void read_data(const char* fdata, int fileSize, int* charCount, int* wordCount, int* wordPos, int* wordLengths, char* data)
 {
     int size = 0;
     int words = 0;
@@ -213,43 +211,50 @@ WORDDATA* parse_file(const char* path)
         return NULL;
     }
     // Calculate char count & store data
-    fileSize = calculate_file_size(f);
-    if(store_byte_data(f) == 1)
+    int fileSize = calculate_file_size(f);
+    char* fdata = store_byte_data(f,fileSize);
+    fclose(f);
+    if(fdata == NULL)
     {
-        fclose(f);
         return NULL;
     }
-    fclose(f);
 
     // Allocate memory
     WORDDATA* w = malloc(sizeof(WORDDATA));
     if(w == NULL)
     {
+        free(fdata);
         printf("Memory allocation error!\n");
         return NULL;
     }
 
     // Calculate actual size
-    read_data(&w->size,&w->wordCount,NULL,NULL,NULL);
-    // Allocate memory for the data
-    w->data = (char*)malloc(sizeof(char) * (w->size + w->wordCount) );
+    read_data(fdata,fileSize,&w->size,&w->wordCount,NULL,NULL,NULL);
+    // Allocate memory for the data and the terminator
+    w->data = (char*)malloc(sizeof(char) * (w->size + w->wordCount +1) );
     if(w->data == NULL)
     {
+        free(fdata);
         free(w);
         printf("Memory allocation error!\n");
         return NULL;
     }
-    w->wordPos = (int*)malloc(w->wordCount * sizeof(int));
-    if(w->data == NULL)
+    // An empty file has no words, at least one entry is
+    // allocated so that malloc does not return NULL
+    int entries = w->wordCount > 0 ? w->wordCount : 1;
+    w->wordPos = (int*)malloc(entries * sizeof(int));
+    if(w->wordPos == NULL)
     {
+        free(fdata);
         free(w->data);
         free(w);
         printf("Memory allocation error!\n");
         return NULL;
     }
-    w->wordLength = (int*)malloc(w->wordCount * sizeof(int));
+    w->wordLength = (int*)malloc(entries * sizeof(int));
     if(w->wordLength == NULL)
     {
+        free(fdata);
         free(w->data);
         free(w->wordPos);
         free(w);
@@ -257,7 +262,7 @@ WORDDATA* parse_file(const char* path)
         return NULL;
     }
     // Store word pos & length
-    read_data(NULL,NULL,w->wordPos,w->wordLength,w->data);
+    read_data(fdata,fileSize,NULL,NULL,w->wordPos,w->wordLength,w->data);
     w->data[w->size + w->wordCount] = 0;
 
     free(fdata);
@@ -270,6 +275,9 @@ void destroy_word_data(WORDDATA* w)
 {
     if(w == NULL) return;
 
+    free(w->data);
+    free(w->wordPos);
+    free(w->wordLength);
     free(w);
 }
 